@@ -48,6 +48,9 @@
 
 /* Other settings */
 /* #define JANET_NO_ASSEMBLER */
+/* #define JANET_GC_THREAD */
+/* #define JANET_JIT */
+/* #define JANET_PROFILE_OPCODES */
 /* #define JANET_NO_PEG */
 /* #define JANET_NO_TYPED_ARRAY */
 /* #define JANET_NO_INT_TYPES */
@@ -56,6 +59,7 @@
 /* #define JANET_MAX_PROTO_DEPTH 200 */
 /* #define JANET_MAX_MACRO_EXPAND 200 */
 /* #define JANET_STACK_MAX 16384 */
+/* #define JANET_JIT_MAX_MEMORY 0x4000000 */
 /* #define JANET_OS_NAME my-custom-os */
 /* #define JANET_ARCH_NAME pdp-8 */
 
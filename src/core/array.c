@@ -94,6 +94,7 @@ void janet_array_setcount(JanetArray *array, int32_t count) {
 void janet_array_push(JanetArray *array, Janet x) {
     int32_t newcount = array->count + 1;
     janet_array_ensure(array, newcount, 2);
+    janet_gc_barrier(array);
     array->data[array->count] = x;
     array->count = newcount;
 }
@@ -141,6 +142,7 @@ static Janet cfun_array_fill(int32_t argc, Janet *argv) {
     janet_arity(argc, 1, 2);
     JanetArray *array = janet_getarray(argv, 0);
     Janet x = (argc == 2) ? argv[1] : janet_wrap_nil();
+    janet_gc_barrier(array);
     for (int32_t i = 0; i < array->count; i++) {
         array->data[i] = x;
     }
@@ -164,6 +166,7 @@ static Janet cfun_array_push(int32_t argc, Janet *argv) {
     JanetArray *array = janet_getarray(argv, 0);
     int32_t newcount = array->count - 1 + argc;
     janet_array_ensure(array, newcount, 2);
+    janet_gc_barrier(array);
     if (argc > 1) memcpy(array->data + array->count, argv + 1, (argc - 1) * sizeof(Janet));
     array->count = newcount;
     return argv[0];
@@ -225,6 +228,7 @@ static Janet cfun_array_insert(int32_t argc, Janet *argv) {
     chunksize = (argc - 2) * sizeof(Janet);
     restsize = (array->count - at) * sizeof(Janet);
     janet_array_ensure(array, array->count + argc - 2, 2);
+    janet_gc_barrier(array);
     memmove(array->data + at + argc - 2,
             array->data + at,
             restsize);
@@ -339,4 +343,5 @@ static const JanetReg array_cfuns[] = {
 /* Load the array module */
 void janet_lib_array(JanetTable *env) {
     janet_core_cfuns(env, NULL, array_cfuns);
+    janet_register_leaf(cfun_array_slice);
 }
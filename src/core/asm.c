@@ -81,13 +81,27 @@ static const JanetInstructionDef janet_ops[] = {
     {"err", JOP_ERROR},
     {"get", JOP_GET},
     {"geti", JOP_GET_INDEX},
+    {"getint", JOP_GET_INT},
     {"gt", JOP_GREATER_THAN},
     {"gten", JOP_NUMERIC_GREATER_THAN_EQUAL},
     {"gtim", JOP_GREATER_THAN_IMMEDIATE},
     {"gtn", JOP_NUMERIC_GREATER_THAN},
     {"in", JOP_IN},
+    {"inint", JOP_IN_INT},
     {"jmp", JOP_JUMP},
+    {"jmpeq", JOP_JUMP_IF_EQUAL},
+    {"jmpeqim", JOP_JUMP_IF_EQUAL_IMMEDIATE},
+    {"jmpgt", JOP_JUMP_IF_GT},
+    {"jmpgte", JOP_JUMP_IF_GTE},
+    {"jmpgteim", JOP_JUMP_IF_GTE_IMMEDIATE},
+    {"jmpgtim", JOP_JUMP_IF_GT_IMMEDIATE},
     {"jmpif", JOP_JUMP_IF},
+    {"jmplt", JOP_JUMP_IF_LT},
+    {"jmplte", JOP_JUMP_IF_LTE},
+    {"jmplteim", JOP_JUMP_IF_LTE_IMMEDIATE},
+    {"jmpltim", JOP_JUMP_IF_LT_IMMEDIATE},
+    {"jmpneq", JOP_JUMP_IF_NOT_EQUAL},
+    {"jmpneqim", JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE},
     {"jmpno", JOP_JUMP_IF_NOT},
     {"ldc", JOP_LOAD_CONSTANT},
     {"ldf", JOP_LOAD_FALSE},
@@ -120,6 +134,7 @@ static const JanetInstructionDef janet_ops[] = {
     {"pusha", JOP_PUSH_ARRAY},
     {"put", JOP_PUT},
     {"puti", JOP_PUT_INDEX},
+    {"putint", JOP_PUT_INT},
     {"res", JOP_RESUME},
     {"ret", JOP_RETURN},
     {"retn", JOP_RETURN_NIL},
@@ -359,7 +374,9 @@ static uint32_t doarg(
     if (arg > max)
         janet_asm_errorv(a, janet_formatc("instruction argument %v is too large, must be %d byte%s",
                                           x, nbytes, nbytes > 1 ? "s" : ""));
-    return ((uint32_t) arg) << (nth << 3);
+    /* Mask off the sign bits of negative arguments so they do not spill
+     * into later arguments. */
+    return (((uint32_t) arg) & ((1u << (nbytes << 3)) - 1)) << (nth << 3);
 }
 
 /* Provide parsing methods for the different kinds of arguments */
@@ -440,6 +457,22 @@ static uint32_t read_instruction(
             instr |= doarg(a, JANET_OAT_INTEGER, 3, 1, type == JINT_SSI, argt[3]);
             break;
         }
+        case JINT_SSL: {
+            if (janet_tuple_length(argt) != 4)
+                janet_asm_error(a, "expected 3 arguments: (op, slot, slot, label)");
+            instr |= doarg(a, JANET_OAT_SLOT, 1, 1, 0, argt[1]);
+            instr |= doarg(a, JANET_OAT_SLOT, 2, 1, 0, argt[2]);
+            instr |= doarg(a, JANET_OAT_LABEL, 3, 1, 1, argt[3]);
+            break;
+        }
+        case JINT_SIL: {
+            if (janet_tuple_length(argt) != 4)
+                janet_asm_error(a, "expected 3 arguments: (op, slot, integer, label)");
+            instr |= doarg(a, JANET_OAT_SLOT, 1, 1, 0, argt[1]);
+            instr |= doarg(a, JANET_OAT_INTEGER, 2, 1, 1, argt[2]);
+            instr |= doarg(a, JANET_OAT_LABEL, 3, 1, 1, argt[3]);
+            break;
+        }
         case JINT_SES: {
             JanetAssembler *b = a;
             uint32_t env;
@@ -761,6 +794,12 @@ static const JanetInstructionDef *janet_asm_reverse_lookup(uint32_t instr) {
     return NULL;
 }
 
+/* Get the assembler name of an opcode, or NULL if there is none */
+const char *janet_opcode_name(int opcode) {
+    const JanetInstructionDef *def = janet_asm_reverse_lookup((uint32_t) opcode);
+    return def ? def->name : NULL;
+}
+
 /* Create some constant sized tuples */
 static const Janet *tup1(Janet x) {
     Janet *tup = janet_tuple_begin(1);
@@ -833,11 +872,18 @@ Janet janet_asm_decode_instruction(uint32_t instr) {
                        janet_wrap_integer(oparg(3, 0xFF)));
             break;
         case JINT_SSI:
+        case JINT_SSL:
             ret = tup4(name,
                        janet_wrap_integer(oparg(1, 0xFF)),
                        janet_wrap_integer(oparg(2, 0xFF)),
                        janet_wrap_integer((int32_t)instr >> 24));
             break;
+        case JINT_SIL:
+            ret = tup4(name,
+                       janet_wrap_integer(oparg(1, 0xFF)),
+                       janet_wrap_integer((int8_t) oparg(2, 0xFF)),
+                       janet_wrap_integer((int32_t)instr >> 24));
+            break;
     }
 #undef oparg
     if (ret) {
@@ -97,7 +97,22 @@ enum JanetInstructionType janet_instructions[JOP_INSTRUCTION_COUNT] = {
     JINT_SSS, /* JOP_NUMERIC_LESS_THAN_EQUAL */
     JINT_SSS, /* JOP_NUMERIC_GREATER_THAN */
     JINT_SSS, /* JOP_NUMERIC_GREATER_THAN_EQUAL */
-    JINT_SSS /* JOP_NUMERIC_EQUAL */
+    JINT_SSS, /* JOP_NUMERIC_EQUAL */
+    JINT_SSL, /* JOP_JUMP_IF_LT */
+    JINT_SSL, /* JOP_JUMP_IF_LTE */
+    JINT_SSL, /* JOP_JUMP_IF_GT */
+    JINT_SSL, /* JOP_JUMP_IF_GTE */
+    JINT_SSL, /* JOP_JUMP_IF_EQUAL */
+    JINT_SSL, /* JOP_JUMP_IF_NOT_EQUAL */
+    JINT_SIL, /* JOP_JUMP_IF_LT_IMMEDIATE */
+    JINT_SIL, /* JOP_JUMP_IF_LTE_IMMEDIATE */
+    JINT_SIL, /* JOP_JUMP_IF_GT_IMMEDIATE */
+    JINT_SIL, /* JOP_JUMP_IF_GTE_IMMEDIATE */
+    JINT_SIL, /* JOP_JUMP_IF_EQUAL_IMMEDIATE */
+    JINT_SIL, /* JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE */
+    JINT_SSS, /* JOP_GET_INT */
+    JINT_SSS, /* JOP_IN_INT */
+    JINT_SSS, /* JOP_PUT_INT */
 };
 
 /* Verify some bytecode */
@@ -154,6 +169,19 @@ int32_t janet_verify(JanetFuncDef *def) {
                 if (jumpdest < 0 || jumpdest >= def->bytecode_length) return 5;
                 continue;
             }
+            case JINT_SSL: {
+                int32_t jumpdest = i + (((int32_t)instr) >> 24);
+                if ((int32_t)((instr >> 8) & 0xFF) >= sc ||
+                        (int32_t)((instr >> 16) & 0xFF) >= sc) return 4;
+                if (jumpdest < 0 || jumpdest >= def->bytecode_length) return 5;
+                continue;
+            }
+            case JINT_SIL: {
+                int32_t jumpdest = i + (((int32_t)instr) >> 24);
+                if ((int32_t)((instr >> 8) & 0xFF) >= sc) return 4;
+                if (jumpdest < 0 || jumpdest >= def->bytecode_length) return 5;
+                continue;
+            }
             case JINT_SSS: {
                 if (((int32_t)(instr >> 8) & 0xFF) >= sc ||
                         ((int32_t)(instr >> 16) & 0xFF) >= sc ||
@@ -222,6 +250,14 @@ JanetFuncDef *janet_funcdef_alloc(void) {
     def->constants_length = 0;
     def->bytecode_length = 0;
     def->environments_length = 0;
+    def->noescape = 0;
+#ifdef JANET_JIT
+    def->jit = NULL;
+    def->jit_heat = 0;
+#endif
+#ifdef JANET_PROFILE_OPCODES
+    def->calls = 0;
+#endif
     return def;
 }
 
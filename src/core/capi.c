@@ -27,6 +27,11 @@
 #endif
 
 void janet_panicv(Janet message) {
+    /* Give a leaf C function the stack frame it would have had */
+    if (janet_vm_leaf != NULL) {
+        janet_fiber_cframe(janet_vm_fiber, janet_vm_leaf);
+        janet_vm_leaf = NULL;
+    }
     if (janet_vm_return_reg != NULL) {
         *janet_vm_return_reg = message;
 #if defined(JANET_BSD) || defined(JANET_APPLE)
@@ -48,20 +48,164 @@ static int fixarity3(JanetFopts opts, JanetSlot *args) {
     return janet_v_count(args) == 3;
 }
 
+/* Mark the result of op as an integer if it is known to be one. Bitwise
+ * operators always produce integers, and arithmetic on integers that
+ * cannot divide keeps them integral. */
+static JanetSlot intop(JanetCompiler *c, int op, JanetSlot t, JanetSlot *args, int32_t len) {
+    uint32_t deps = 0;
+    switch (op) {
+        default:
+            return t;
+        case JOP_BAND:
+        case JOP_BOR:
+        case JOP_BXOR:
+        case JOP_BNOT:
+        case JOP_SHIFT_LEFT:
+        case JOP_SHIFT_RIGHT:
+        case JOP_SHIFT_RIGHT_UNSIGNED:
+            break;
+        case JOP_ADD:
+        case JOP_ADD_IMMEDIATE:
+        case JOP_SUBTRACT:
+        case JOP_MULTIPLY:
+        case JOP_MULTIPLY_IMMEDIATE:
+            for (int32_t i = 0; i < len; i++) {
+                if (!janetc_isint(c, args[i])) return t;
+                deps |= args[i].intdeps;
+            }
+            break;
+    }
+    t.flags |= JANET_SLOT_INT;
+    t.intdeps = deps;
+    return t;
+}
+
 /* Generic handling for $A = op $B */
 static JanetSlot genericSS(JanetFopts opts, int op, JanetSlot s) {
     JanetSlot target = janetc_gettarget(opts);
     janetc_emit_ss(opts.compiler, op, target, s, 1);
-    return target;
+    return intop(opts.compiler, op, target, &s, 1);
 }
 
 /* Generic handling for $A = $B op I */
 static JanetSlot genericSSI(JanetFopts opts, int op, JanetSlot s, int32_t imm) {
     JanetSlot target = janetc_gettarget(opts);
     janetc_emit_ssi(opts.compiler, op, target, s, imm, 1);
+    return intop(opts.compiler, op, target, &s, 1);
+}
+
+/* Emit an integer indexing instruction, $A = $B[$C] */
+static JanetSlot getint(JanetFopts opts, int op, JanetSlot ds, JanetSlot key) {
+    int32_t start = janet_v_count(opts.compiler->buffer);
+    JanetSlot target = janetc_gettarget(opts);
+    janetc_emit_sss(opts.compiler, op, target, ds, key, 1);
+    janetc_intsite(opts.compiler, start, key);
     return target;
 }
 
+/* Check for a constant that fits in a one byte signed immediate */
+static int smallint(JanetSlot s) {
+    if (!(s.flags & JANET_SLOT_CONSTANT) || !janetc_checkint(s.constant)) return 0;
+    int32_t x = janet_unwrap_integer(s.constant);
+    return x >= -128 && x <= 127;
+}
+
+/* Check for a constant that can be folded by the compiler. Values whose
+ * operations could call methods or compare by identity are left to
+ * the VM. */
+static int foldable(JanetSlot s) {
+    if (!(s.flags & JANET_SLOT_CONSTANT)) return 0;
+    switch (janet_type(s.constant)) {
+        default:
+            return 0;
+        case JANET_NIL:
+        case JANET_BOOLEAN:
+        case JANET_NUMBER:
+        case JANET_STRING:
+        case JANET_SYMBOL:
+        case JANET_KEYWORD:
+            return 1;
+    }
+}
+
+/* Compute x op y for constants the way the VM would. Returns 0 if the
+ * operation should be left for runtime, such as when it would error. */
+static int foldop(int op, Janet x, Janet y, Janet *out) {
+    if (op == JOP_EQUALS) {
+        *out = janet_wrap_boolean(janet_equals(x, y));
+        return 1;
+    } else if (op == JOP_LESS_THAN) {
+        *out = janet_wrap_boolean(janet_compare(x, y) < 0);
+        return 1;
+    } else if (op == JOP_GREATER_THAN) {
+        *out = janet_wrap_boolean(janet_compare(x, y) > 0);
+        return 1;
+    }
+    if (!janet_checktype(x, JANET_NUMBER) || !janet_checktype(y, JANET_NUMBER))
+        return 0;
+    double a = janet_unwrap_number(x);
+    double b = janet_unwrap_number(y);
+    switch (op) {
+        case JOP_ADD:
+            *out = janet_wrap_number(a + b);
+            return 1;
+        case JOP_SUBTRACT:
+            *out = janet_wrap_number(a - b);
+            return 1;
+        case JOP_MULTIPLY:
+            *out = janet_wrap_number(a * b);
+            return 1;
+        case JOP_DIVIDE:
+            *out = janet_wrap_number(a / b);
+            return 1;
+        case JOP_NUMERIC_LESS_THAN:
+            *out = janet_wrap_boolean(a < b);
+            return 1;
+        case JOP_NUMERIC_LESS_THAN_EQUAL:
+            *out = janet_wrap_boolean(a <= b);
+            return 1;
+        case JOP_NUMERIC_GREATER_THAN:
+            *out = janet_wrap_boolean(a > b);
+            return 1;
+        case JOP_NUMERIC_GREATER_THAN_EQUAL:
+            *out = janet_wrap_boolean(a >= b);
+            return 1;
+        case JOP_NUMERIC_EQUAL:
+            *out = janet_wrap_boolean(a == b);
+            return 1;
+    }
+    if (!janet_checkint(x) || !janet_checkint(y))
+        return 0;
+    int32_t ia = janet_unwrap_integer(x);
+    int32_t ib = janet_unwrap_integer(y);
+    switch (op) {
+        case JOP_BAND:
+            *out = janet_wrap_integer(ia & ib);
+            return 1;
+        case JOP_BOR:
+            *out = janet_wrap_integer(ia | ib);
+            return 1;
+        case JOP_BXOR:
+            *out = janet_wrap_integer(ia ^ ib);
+            return 1;
+    }
+    if (ib < 0 || ib > 31)
+        return 0;
+    switch (op) {
+        default:
+            return 0;
+        case JOP_SHIFT_LEFT:
+            *out = janet_wrap_integer((int32_t)((uint32_t) ia << ib));
+            return 1;
+        case JOP_SHIFT_RIGHT:
+            *out = janet_wrap_integer(ia >> ib);
+            return 1;
+        case JOP_SHIFT_RIGHT_UNSIGNED:
+            *out = janet_wrap_integer((int32_t)((uint32_t) ia >> ib));
+            return 1;
+    }
+}
+
 /* Emit a series of instructions instead of a function call to a math op */
 static JanetSlot opreduce(
     JanetFopts opts,
@@ -72,18 +216,51 @@ static JanetSlot opreduce(
     int32_t i, len;
     len = janet_v_count(args);
     JanetSlot t;
+    /* Fold leading constants. Later ones are left alone, as reordering
+     * floating point operations can change the result. */
+    if (len > 0 && foldable(args[0])) {
+        Janet acc = args[0].constant;
+        if (len == 1) {
+            if (foldop(op, nullary, acc, &acc))
+                return janetc_cslot(acc);
+        } else {
+            for (i = 1; i < len && foldable(args[i]); i++)
+                if (!foldop(op, acc, args[i].constant, &acc)) break;
+            if (i == len)
+                return janetc_cslot(acc);
+            if (i > 1) {
+                args += i - 1;
+                len -= i - 1;
+                args[0] = janetc_cslot(acc);
+            }
+        }
+    }
     if (len == 0) {
         return janetc_cslot(nullary);
     } else if (len == 1) {
         t = janetc_gettarget(opts);
         janetc_emit_sss(c, op, t, janetc_cslot(nullary), args[0], 1);
-        return t;
+    } else {
+        t = janetc_gettarget(opts);
+        janetc_emit_sss(c, op, t, args[0], args[1], 1);
+        for (i = 2; i < len; i++)
+            janetc_emit_sss(c, op, t, t, args[i], 1);
     }
-    t = janetc_gettarget(opts);
-    janetc_emit_sss(c, op, t, args[0], args[1], 1);
-    for (i = 2; i < len; i++)
-        janetc_emit_sss(c, op, t, t, args[i], 1);
-    return t;
+    if (!janetc_isint(c, janetc_cslot(nullary))) return t;
+    return intop(c, op, t, args, len);
+}
+
+/* Like opreduce, but use the immediate form of op when adding or
+ * multiplying by a small constant */
+static JanetSlot opreduce_immediate(
+    JanetFopts opts,
+    JanetSlot *args,
+    int op,
+    int opim,
+    Janet nullary) {
+    if (janet_v_count(args) == 2 && smallint(args[1]) && !foldable(args[0]))
+        return genericSSI(opts, opim, args[0], janet_unwrap_integer(args[1].constant));
+    return opreduce(opts, args, op, nullary);
 }
 
 /* Function optimizers */
@@ -106,19 +283,28 @@ static JanetSlot do_debug(JanetFopts opts, JanetSlot *args) {
     return t;
 }
 static JanetSlot do_in(JanetFopts opts, JanetSlot *args) {
+    if (janetc_isint(opts.compiler, args[1]))
+        return getint(opts, JOP_IN_INT, args[0], args[1]);
     return opreduce(opts, args, JOP_IN, janet_wrap_nil());
 }
 static JanetSlot do_get(JanetFopts opts, JanetSlot *args) {
+    if (janetc_isint(opts.compiler, args[1]))
+        return getint(opts, JOP_GET_INT, args[0], args[1]);
     return opreduce(opts, args, JOP_GET, janet_wrap_nil());
 }
 static JanetSlot do_put(JanetFopts opts, JanetSlot *args) {
+    int op = janetc_isint(opts.compiler, args[1]) ? JOP_PUT_INT : JOP_PUT;
     if (opts.flags & JANET_FOPTS_DROP) {
-        janetc_emit_sss(opts.compiler, JOP_PUT, args[0], args[1], args[2], 0);
+        int32_t start = janet_v_count(opts.compiler->buffer);
+        janetc_emit_sss(opts.compiler, op, args[0], args[1], args[2], 0);
+        janetc_intsite(opts.compiler, start, args[1]);
         return janetc_cslot(janet_wrap_nil());
     } else {
         JanetSlot t = janetc_gettarget(opts);
         janetc_copy(opts.compiler, t, args[0]);
-        janetc_emit_sss(opts.compiler, JOP_PUT, t, args[1], args[2], 0);
+        int32_t start = janet_v_count(opts.compiler->buffer);
+        janetc_emit_sss(opts.compiler, op, t, args[1], args[2], 0);
+        janetc_intsite(opts.compiler, start, args[1]);
         return t;
     }
 }
@@ -163,13 +349,13 @@ static JanetSlot do_apply(JanetFopts opts, JanetSlot *args) {
 /* Variadic operators specialization */
 
 static JanetSlot do_add(JanetFopts opts, JanetSlot *args) {
-    return opreduce(opts, args, JOP_ADD, janet_wrap_integer(0));
+    return opreduce_immediate(opts, args, JOP_ADD, JOP_ADD_IMMEDIATE, janet_wrap_integer(0));
 }
 static JanetSlot do_sub(JanetFopts opts, JanetSlot *args) {
     return opreduce(opts, args, JOP_SUBTRACT, janet_wrap_integer(0));
 }
 static JanetSlot do_mul(JanetFopts opts, JanetSlot *args) {
-    return opreduce(opts, args, JOP_MULTIPLY, janet_wrap_integer(1));
+    return opreduce_immediate(opts, args, JOP_MULTIPLY, JOP_MULTIPLY_IMMEDIATE, janet_wrap_integer(1));
 }
 static JanetSlot do_div(JanetFopts opts, JanetSlot *args) {
     return opreduce(opts, args, JOP_DIVIDE, janet_wrap_integer(1));
@@ -190,12 +376,61 @@ static JanetSlot do_rshift(JanetFopts opts, JanetSlot *args) {
     return opreduce(opts, args, JOP_SHIFT_RIGHT, janet_wrap_integer(1));
 }
 static JanetSlot do_rshiftu(JanetFopts opts, JanetSlot *args) {
-    return opreduce(opts, args, JOP_SHIFT_RIGHT, janet_wrap_integer(1));
+    return opreduce(opts, args, JOP_SHIFT_RIGHT_UNSIGNED, janet_wrap_integer(1));
 }
 static JanetSlot do_bnot(JanetFopts opts, JanetSlot *args) {
+    if (foldable(args[0]) && janet_checkint(args[0].constant))
+        return janetc_cslot(janet_wrap_integer(~janet_unwrap_integer(args[0].constant)));
     return genericSS(opts, JOP_BNOT, args[0]);
 }
 
+/* Emit a fused compare and branch for a condition, if op has one. The fused
+ * instruction skips the following jump when the comparison holds, and the jump
+ * is taken when it does not. Returns the label of that jump, or -1. */
+static int32_t compbranch(JanetCompiler *c, int op, int invert, JanetSlot lhs, JanetSlot rhs) {
+    int jop, jopim;
+    if (invert && op != JOP_EQUALS) return -1;
+    switch (op) {
+        default:
+            return -1;
+        case JOP_NUMERIC_LESS_THAN:
+            jop = JOP_JUMP_IF_LT;
+            jopim = JOP_JUMP_IF_LT_IMMEDIATE;
+            break;
+        case JOP_NUMERIC_LESS_THAN_EQUAL:
+            jop = JOP_JUMP_IF_LTE;
+            jopim = JOP_JUMP_IF_LTE_IMMEDIATE;
+            break;
+        case JOP_NUMERIC_GREATER_THAN:
+            jop = JOP_JUMP_IF_GT;
+            jopim = JOP_JUMP_IF_GT_IMMEDIATE;
+            break;
+        case JOP_NUMERIC_GREATER_THAN_EQUAL:
+            jop = JOP_JUMP_IF_GTE;
+            jopim = JOP_JUMP_IF_GTE_IMMEDIATE;
+            break;
+        case JOP_EQUALS:
+            jop = invert ? JOP_JUMP_IF_NOT_EQUAL : JOP_JUMP_IF_EQUAL;
+            jopim = invert ? JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE : JOP_JUMP_IF_EQUAL_IMMEDIATE;
+            /* Equality is symmetric, so move a small constant to the right */
+            if (smallint(lhs) && !smallint(rhs)) {
+                JanetSlot temp = lhs;
+                lhs = rhs;
+                rhs = temp;
+            }
+            break;
+    }
+    if (smallint(rhs)) {
+        int32_t imm = janet_unwrap_integer(rhs.constant);
+        janetc_emit_si(c, jopim, lhs, (int16_t)((imm & 0xFF) | (2 << 8)), 0);
+    } else {
+        janetc_emit_ssi(c, jop, lhs, rhs, 2, 0);
+    }
+    int32_t label = janet_v_count(c->buffer);
+    janetc_emit(c, JOP_JUMP);
+    return label;
+}
+
 /* Specialization for comparators */
 static JanetSlot compreduce(
     JanetFopts opts,
@@ -212,6 +447,27 @@ static JanetSlot compreduce(
                ? janetc_cslot(janet_wrap_false())
                : janetc_cslot(janet_wrap_true());
     }
+    /* Fold comparisons of leading constants. Pairs that hold can be dropped
+     * from the chain, and one that does not decides the result. */
+    while (len > 1 && foldable(args[0]) && foldable(args[1])) {
+        Janet x;
+        if (!foldop(op, args[0].constant, args[1].constant, &x)) break;
+        if (!janet_truthy(x))
+            return janetc_cslot(janet_wrap_boolean(invert));
+        args++;
+        len--;
+    }
+    if (len < 2)
+        return janetc_cslot(janet_wrap_boolean(!invert));
+    if ((opts.flags & JANET_FOPTS_BRANCH) && len == 2) {
+        int32_t label = compbranch(c, op, invert, args[0], args[1]);
+        if (label >= 0) {
+            t = janetc_cslot(janet_wrap_nil());
+            t.flags = JANET_SLOT_BRANCH;
+            t.index = label;
+            return t;
+        }
+    }
     t = janetc_gettarget(opts);
     for (i = 1; i < len; i++) {
         janetc_emit_sss(c, op, t, args[i - 1], args[i], 1);
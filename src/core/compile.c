@@ -27,8 +27,11 @@
 #include "vector.h"
 #include "util.h"
 #include "state.h"
+#include "fiber.h"
 #endif
 
+#include <math.h>
+
 JanetFopts janetc_fopts_default(JanetCompiler *c) {
     JanetFopts ret;
     ret.compiler = c;
@@ -76,6 +79,7 @@ JanetSlot janetc_cslot(Janet x) {
     ret.index = -1;
     ret.constant = x;
     ret.envindex = -1;
+    ret.intdeps = 0;
     return ret;
 }
 
@@ -86,6 +90,7 @@ JanetSlot janetc_farslot(JanetCompiler *c) {
     ret.index = janetc_allocfar(c);
     ret.constant = janet_wrap_nil();
     ret.envindex = -1;
+    ret.intdeps = 0;
     return ret;
 }
 
@@ -100,6 +105,9 @@ void janetc_scope(JanetScope *s, JanetCompiler *c, int flags, const char *name)
     scope.defs = NULL;
     scope.bytecode_start = janet_v_count(c->buffer);
     scope.flags = flags;
+    scope.intvars = 0;
+    scope.intdead = 0;
+    scope.intsites = NULL;
     scope.parent = c->scope;
     /* Inherit slots */
     if ((!(flags & JANET_SCOPE_FUNCTION)) && c->scope) {
@@ -147,6 +155,7 @@ void janetc_popscope(JanetCompiler *c) {
     janet_v_free(oldscope->syms);
     janet_v_free(oldscope->envs);
     janet_v_free(oldscope->defs);
+    janet_v_free(oldscope->intsites);
     janetc_regalloc_deinit(&oldscope->ra);
     /* Update pointer */
     if (newscope)
@@ -234,6 +243,9 @@ found:
     while (scope && !(scope->flags & JANET_SCOPE_FUNCTION))
         scope = scope->parent;
     janet_assert(scope, "invalid scopes");
+    if ((ret.flags & JANET_SLOT_INT) && (ret.flags & JANET_SLOT_MUTABLE))
+        janetc_nointegers(c, scope, ret.intdeps);
+    ret.flags &= ~JANET_SLOT_INT;
     scope->flags |= JANET_SCOPE_ENV;
     scope = scope->child;
 
@@ -266,6 +278,83 @@ found:
     return ret;
 }
 
+/* Get the function scope containing a scope */
+static JanetScope *janetc_funcscope(JanetScope *scope) {
+    while (scope && !(scope->flags & JANET_SCOPE_FUNCTION))
+        scope = scope->parent;
+    return scope;
+}
+
+/* Check if a constant can be treated as an integer. -0 cannot, as it
+ * would turn into 0. */
+int janetc_checkint(Janet x) {
+    return janet_checkint(x) && !signbit(janet_unwrap_number(x));
+}
+
+/* Check if a slot is known to hold an integer. A var is trusted to hold
+ * integers as long as every assignment to it seen so far did, so slots
+ * derived from vars remember the vars' bits in case that changes. */
+int janetc_isint(JanetCompiler *c, JanetSlot s) {
+    if (s.flags & JANET_SLOT_CONSTANT)
+        return janetc_checkint(s.constant);
+    if (!(s.flags & JANET_SLOT_INT) || s.envindex >= 0)
+        return 0;
+    JanetScope *scope = janetc_funcscope(c->scope);
+    return !scope || !(s.intdeps & scope->intdead);
+}
+
+/* Get a bit for a new var that holds an integer, or 0 if there are
+ * none left. */
+uint32_t janetc_intvar(JanetCompiler *c) {
+    JanetScope *scope = janetc_funcscope(c->scope);
+    if (!scope || scope->intvars == UINT32_MAX) return 0;
+    uint32_t bit = (scope->intvars + 1) & ~scope->intvars;
+    scope->intvars |= bit;
+    return bit;
+}
+
+/* Remember the integer indexing instruction emitted since start, so it
+ * can be undone if a var its key relies on is killed. */
+void janetc_intsite(JanetCompiler *c, int32_t start, JanetSlot key) {
+    JanetScope *scope = janetc_funcscope(c->scope);
+    if (!scope || (key.flags & JANET_SLOT_CONSTANT) || !key.intdeps) return;
+    JanetIntSite site;
+    site.start = start;
+    site.end = janet_v_count(c->buffer);
+    site.deps = key.intdeps;
+    janet_v_push(scope->intsites, site);
+}
+
+/* Kill the var bits in deps for the function containing scope. Turn the
+ * integer indexing instructions that relied on them back into their
+ * generic forms. Bytecode may have been rewound since the instructions
+ * were emitted, but making an instruction generic is always safe. */
+void janetc_nointegers(JanetCompiler *c, JanetScope *scope, uint32_t deps) {
+    scope = janetc_funcscope(scope);
+    if (!scope) return;
+    scope->intdead |= deps;
+    for (int32_t i = 0; i < janet_v_count(scope->intsites); i++) {
+        JanetIntSite site = scope->intsites[i];
+        if (!(site.deps & deps)) continue;
+        for (int32_t j = site.start; j < site.end && j < janet_v_count(c->buffer); j++) {
+            uint32_t instr = c->buffer[j];
+            switch (instr & 0xFF) {
+                default:
+                    break;
+                case JOP_GET_INT:
+                    c->buffer[j] = (instr & ~0xFFu) | JOP_GET;
+                    break;
+                case JOP_IN_INT:
+                    c->buffer[j] = (instr & ~0xFFu) | JOP_IN;
+                    break;
+                case JOP_PUT_INT:
+                    c->buffer[j] = (instr & ~0xFFu) | JOP_PUT;
+                    break;
+            }
+        }
+    }
+}
+
 /* Generate the return instruction for a slot. */
 JanetSlot janetc_return(JanetCompiler *c, JanetSlot s) {
     if (!(s.flags & JANET_SLOT_RETURNED)) {
@@ -285,10 +374,12 @@ JanetSlot janetc_gettarget(JanetFopts opts) {
             (opts.hint.envindex < 0) &&
             (opts.hint.index >= 0 && opts.hint.index <= 0xFF)) {
         slot = opts.hint;
+        slot.flags &= ~JANET_SLOT_INT;
     } else {
         slot.envindex = -1;
         slot.constant = janet_wrap_nil();
         slot.flags = 0;
+        slot.intdeps = 0;
         slot.index = janetc_allocfar(opts.compiler);
     }
     return slot;
@@ -399,6 +490,285 @@ void janetc_throwaway(JanetFopts opts, Janet x) {
     }
 }
 
+/* Inlining
+ *
+ * A call to a small function known at compile time, such as one bound
+ * with defn at the top level, is replaced by a copy of the function's
+ * bytecode. The copy's registers are renamed to free registers of the
+ * caller, its constants are added to the caller's constants, and its
+ * returns become jumps to the end of the copy. Functions that use an
+ * environment, make closures, refer to themselves, take a variable
+ * number of arguments, are traced or have breakpoints are always called,
+ * as is everything compiled while the dynamic binding :no-inline is set.
+ * Tracing or setting a breakpoint on a function later does not affect
+ * calls to it that were already inlined. */
+
+#define JANETC_INLINE_MAX_INSTRUCTIONS 20
+#define JANETC_INLINE_MAX_SLOTS 16
+
+/* Check if def can be inlined into a call with argc arguments */
+static int janetc_caninline(JanetFuncDef *def, int32_t argc) {
+    if (def->flags & (JANET_FUNCDEF_FLAG_VARARG | JANET_FUNCDEF_FLAG_NEEDSENV)) return 0;
+    if (def->environments_length || def->defs_length) return 0;
+    if (def->arity != argc || def->min_arity != argc || def->max_arity != argc) return 0;
+    if (def->bytecode_length > JANETC_INLINE_MAX_INSTRUCTIONS) return 0;
+    if (def->slotcount > JANETC_INLINE_MAX_SLOTS) return 0;
+    /* The copy does not start with the nil registers of a new stack frame,
+     * so on every path each register must be written before it is read.
+     * Find the registers written on all paths to each instruction. Named
+     * functions load themselves on entry, which is fine as long as it is
+     * not used. */
+    int32_t n = def->bytecode_length;
+    uint32_t assigned[JANETC_INLINE_MAX_INSTRUCTIONS];
+    uint32_t read = 0;
+    for (int32_t i = 0; i < n; i++) {
+        int32_t regs[3];
+        int nr = janetc_reads(def->bytecode[i], regs);
+        for (int j = 0; j < nr; j++) {
+            if (regs[j] >= def->slotcount) return 0;
+            read |= 1u << regs[j];
+        }
+    }
+    assigned[0] = (1u << argc) - 1;
+    for (int32_t i = 1; i < n; i++) assigned[i] = 0xFFFFFFFFu;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int32_t i = 0; i < n; i++) {
+            uint32_t instr = def->bytecode[i];
+            int32_t next[2];
+            int32_t w = janetc_writes(instr);
+            if (w >= def->slotcount) return 0;
+            uint32_t out = assigned[i] | (w >= 0 ? 1u << w : 0);
+            int count = janetc_successors(instr, i, next);
+            for (int j = 0; j < count; j++) {
+                if (next[j] < 0 || next[j] >= n) return 0;
+                if (assigned[next[j]] & ~out) {
+                    assigned[next[j]] &= out;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t instr = def->bytecode[i];
+        int32_t regs[3];
+        /* Breakpoints must stay in the function */
+        if (instr & 0x80) return 0;
+        switch (instr & 0x7F) {
+            default:
+                break;
+            case JOP_LOAD_SELF:
+                if ((instr >> 8) >= (uint32_t) def->slotcount || (read & (1u << (instr >> 8)))) return 0;
+                break;
+            case JOP_LOAD_UPVALUE:
+            case JOP_SET_UPVALUE:
+            case JOP_CLOSURE:
+                return 0;
+        }
+        int nr = janetc_reads(instr, regs);
+        for (int j = 0; j < nr; j++) {
+            if (!(assigned[i] & (1u << regs[j]))) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Get the only register def returns, or -1 if there is not one */
+static int32_t janetc_inline_retreg(JanetFuncDef *def) {
+    int32_t reg = -1;
+    for (int32_t i = 0; i < def->bytecode_length; i++) {
+        uint32_t instr = def->bytecode[i];
+        if ((instr & 0x7F) != JOP_RETURN) continue;
+        if (reg >= 0 && reg != (int32_t)(instr >> 8)) return -1;
+        reg = instr >> 8;
+    }
+    return reg;
+}
+
+/* Rename the registers of an instruction */
+static uint32_t janetc_rename(uint32_t instr, const int32_t *map) {
+#define rename_a ((uint32_t) map[(instr >> 8) & 0xFF] << 8)
+#define rename_b ((uint32_t) map[(instr >> 16) & 0xFF] << 16)
+    switch (janet_instructions[instr & 0x7F]) {
+        default:
+            return instr;
+        case JINT_S:
+            return (instr & 0xFF) | (uint32_t) map[instr >> 8] << 8;
+        case JINT_SL:
+        case JINT_ST:
+        case JINT_SI:
+        case JINT_SU:
+        case JINT_SC:
+        case JINT_SD:
+        case JINT_SES:
+        case JINT_SIL:
+            return (instr & 0xFFFF00FF) | rename_a;
+        case JINT_SS:
+            return (instr & 0xFF) | rename_a | (uint32_t) map[instr >> 16] << 16;
+        case JINT_SSI:
+        case JINT_SSU:
+        case JINT_SSL:
+            return (instr & 0xFF0000FF) | rename_a | rename_b;
+        case JINT_SSS:
+            return (instr & 0xFF) | rename_a | rename_b | (uint32_t) map[instr >> 24] << 24;
+    }
+#undef rename_a
+#undef rename_b
+}
+
+/* Get the bit position of the jump offset of an instruction, or 0 if it
+ * does not jump */
+static int janetc_jumpshift(uint32_t instr) {
+    switch (janet_instructions[instr & 0x7F]) {
+        default:
+            return 0;
+        case JINT_L:
+            return 8;
+        case JINT_SL:
+            return 16;
+        case JINT_SSL:
+        case JINT_SIL:
+            return 24;
+    }
+}
+
+/* Get a slot for a near register */
+static JanetSlot janetc_inline_slot(int32_t reg) {
+    JanetSlot ret;
+    ret.flags = JANET_SLOTTYPE_ANY;
+    ret.index = reg;
+    ret.constant = janet_wrap_nil();
+    ret.envindex = -1;
+    ret.intdeps = 0;
+    return ret;
+}
+
+/* Replace a call to def with a copy of its bytecode. Returns 0 if the
+ * function should be called instead. */
+static int janetc_inline(JanetFopts opts, JanetSlot *slots, JanetFuncDef *def, JanetSlot *ret) {
+    JanetCompiler *c = opts.compiler;
+    int32_t argc = janet_v_count(slots);
+    if (!janetc_caninline(def, argc)) return 0;
+    int tail = (opts.flags & JANET_FOPTS_TAIL) && !(c->scope->flags & JANET_SCOPE_TOP);
+    int32_t len = def->bytecode_length;
+    int32_t map[JANETC_INLINE_MAX_SLOTS];
+    int32_t fresh[JANETC_INLINE_MAX_SLOTS + 1];
+    int32_t nfresh = 0;
+    int32_t result = -1;
+
+    /* Parameters that are never written can use the argument's register,
+     * and every other register gets a new one */
+    uint32_t written = 0;
+    for (int32_t i = 0; i < len; i++) {
+        int32_t w = janetc_writes(def->bytecode[i]);
+        if (w >= 0) written |= 1u << w;
+    }
+    for (int32_t i = 0; i < def->slotcount; i++) {
+        if (i < argc && !(written & (1u << i)) &&
+                !(slots[i].flags & (JANET_SLOT_CONSTANT | JANET_SLOT_REF)) &&
+                slots[i].envindex < 0 && slots[i].index >= 0 && slots[i].index <= 0xFF) {
+            map[i] = slots[i].index;
+        } else {
+            map[i] = fresh[nfresh++] = janetc_regalloc_1(&c->scope->ra);
+        }
+    }
+
+    /* Returns write to the register the function returns, if it has its
+     * own, or otherwise to a new one */
+    if (!tail) {
+        int32_t reg = janetc_inline_retreg(def);
+        for (int32_t i = 0; i < nfresh && reg >= 0; i++) {
+            if (fresh[i] == map[reg]) result = map[reg];
+        }
+        if (result < 0) result = fresh[nfresh++] = janetc_regalloc_1(&c->scope->ra);
+    }
+
+    /* Instructions can only name registers below 256 */
+    for (int32_t i = 0; i < nfresh; i++) {
+        if (fresh[i] > 0xFF) {
+            for (int32_t j = 0; j < nfresh; j++)
+                janetc_regalloc_free(&c->scope->ra, fresh[j]);
+            return 0;
+        }
+    }
+
+    /* Load the arguments */
+    for (int32_t i = 0; i < argc; i++) {
+        if (map[i] != slots[i].index || (slots[i].flags & (JANET_SLOT_CONSTANT | JANET_SLOT_REF)) ||
+                slots[i].envindex >= 0) {
+            janetc_copy(c, janetc_inline_slot(map[i]), slots[i]);
+        }
+    }
+
+    /* Copy the bytecode, remembering where each instruction went so that
+     * jumps can be fixed up afterwards */
+    int32_t newpos[JANETC_INLINE_MAX_INSTRUCTIONS + 1];
+    int32_t jumps[2 * JANETC_INLINE_MAX_INSTRUCTIONS];
+    int32_t targets[2 * JANETC_INLINE_MAX_INSTRUCTIONS];
+    int32_t njumps = 0;
+    for (int32_t i = 0; i < len; i++) {
+        uint32_t instr = def->bytecode[i];
+        newpos[i] = janet_v_count(c->buffer);
+        switch (instr & 0x7F) {
+            case JOP_RETURN:
+            case JOP_RETURN_NIL:
+            case JOP_TAILCALL:
+                if (tail) break;
+                if ((instr & 0x7F) == JOP_TAILCALL) {
+                    janetc_emit(c, (uint32_t) map[instr >> 8] << 16 | (uint32_t) result << 8 | JOP_CALL);
+                } else if ((instr & 0x7F) == JOP_RETURN_NIL) {
+                    janetc_emit(c, (uint32_t) result << 8 | JOP_LOAD_NIL);
+                } else if (map[instr >> 8] != result) {
+                    janetc_emit(c, (uint32_t) map[instr >> 8] << 16 | (uint32_t) result << 8 | JOP_MOVE_NEAR);
+                }
+                if (i < len - 1) {
+                    jumps[njumps] = janet_v_count(c->buffer);
+                    targets[njumps++] = len;
+                    janetc_emit(c, JOP_JUMP);
+                }
+                continue;
+            case JOP_LOAD_SELF:
+                continue;
+            case JOP_LOAD_CONSTANT: {
+                int32_t k = janetc_const(c, def->constants[instr >> 16]);
+                instr = (instr & 0xFFFF) | (uint32_t) k << 16;
+                break;
+            }
+            default:
+                break;
+        }
+        int shift = janetc_jumpshift(instr);
+        if (shift) {
+            jumps[njumps] = janet_v_count(c->buffer);
+            targets[njumps++] = i + ((int32_t) instr >> shift);
+        }
+        janetc_emit(c, janetc_rename(instr, map));
+    }
+    newpos[len] = janet_v_count(c->buffer);
+    for (int32_t i = 0; i < njumps; i++) {
+        uint32_t instr = c->buffer[jumps[i]];
+        int shift = janetc_jumpshift(instr);
+        uint32_t offset = (uint32_t)(newpos[targets[i]] - jumps[i]);
+        c->buffer[jumps[i]] = (instr & ((1u << shift) - 1)) | offset << shift;
+    }
+
+    /* Release the copy's registers */
+    for (int32_t i = 0; i < nfresh; i++) {
+        if (fresh[i] != result || (opts.flags & JANET_FOPTS_DROP))
+            janetc_regalloc_free(&c->scope->ra, fresh[i]);
+    }
+    if (tail) {
+        *ret = janetc_cslot(janet_wrap_nil());
+        ret->flags = JANET_SLOT_RETURNED;
+    } else if (opts.flags & JANET_FOPTS_DROP) {
+        *ret = janetc_cslot(janet_wrap_nil());
+    } else {
+        *ret = janetc_inline_slot(result);
+    }
+    return 1;
+}
+
 /* Compile a call or tailcall instruction */
 static JanetSlot janetc_call(JanetFopts opts, JanetSlot *slots, JanetSlot fun) {
     JanetSlot retslot;
@@ -411,9 +781,12 @@ static JanetSlot janetc_call(JanetFopts opts, JanetSlot *slots, JanetSlot fun) {
             if (o && (!o->can_optimize || o->can_optimize(opts, slots))) {
                 specialized = 1;
                 retslot = o->optimize(opts, slots);
+            } else if (!(f->gc.flags & JANET_FUNCFLAG_TRACE) &&
+                       !janet_truthy(janet_dyn("no-inline")) &&
+                       janetc_inline(opts, slots, f->def, &retslot)) {
+                specialized = 1;
             }
         }
-        /* TODO janet function inlining (no c functions)*/
     }
     if (!specialized) {
         int32_t min_arity = janetc_pushslots(c, slots);
@@ -593,6 +966,7 @@ static int macroexpand1(
         c->result.macrofiber = fiberp;
         janetc_error(c, es);
     } else {
+        janet_fiber_release(fiberp);
         *out = x;
     }
 
@@ -606,6 +980,10 @@ JanetSlot janetc_value(JanetFopts opts, Janet x) {
     JanetSourceMapping last_mapping = c->current_mapping;
     c->recursion_guard--;
 
+    /* Only direct calls to comparison functions can become branch slots */
+    uint32_t branch = opts.flags & JANET_FOPTS_BRANCH;
+    opts.flags &= ~JANET_FOPTS_BRANCH;
+
     /* Guard against previous errors and unbounded recursion */
     if (c->result.status == JANET_COMPILE_ERROR) return janetc_cslot(janet_wrap_nil());
     if (c->recursion_guard <= 0) {
@@ -642,8 +1020,10 @@ JanetSlot janetc_value(JanetFopts opts, Janet x) {
                     ret = janetc_tuple(opts, x);
                 } else {
                     JanetSlot head = janetc_value(subopts, tup[0]);
+                    JanetFopts callopts = opts;
+                    callopts.flags |= branch;
                     subopts.flags = JANET_FUNCTION | JANET_CFUNCTION;
-                    ret = janetc_call(opts, janetc_toslots(c, tup + 1, janet_tuple_length(tup) - 1), head);
+                    ret = janetc_call(callopts, janetc_toslots(c, tup + 1, janet_tuple_length(tup) - 1), head);
                     janetc_freeslot(c, head);
                 }
                 ret.flags &= ~JANET_SLOT_SPLICED;
@@ -675,8 +1055,15 @@ JanetSlot janetc_value(JanetFopts opts, Janet x) {
     if (opts.flags & JANET_FOPTS_TAIL)
         ret = janetc_return(c, ret);
     if (opts.flags & JANET_FOPTS_HINT) {
+        int isint = janetc_isint(c, ret);
+        uint32_t intdeps = ret.intdeps;
         janetc_copy(c, opts.hint, ret);
         ret = opts.hint;
+        ret.flags &= ~JANET_SLOT_INT;
+        if (isint) {
+            ret.flags |= JANET_SLOT_INT;
+            ret.intdeps = intdeps;
+        }
     }
     c->current_mapping = last_mapping;
     c->recursion_guard++;
@@ -731,6 +1118,9 @@ JanetFuncDef *janetc_pop_funcdef(JanetCompiler *c) {
     if (scope->flags & JANET_SCOPE_ENV) {
         def->flags |= JANET_FUNCDEF_FLAG_NEEDSENV;
     }
+    janetc_peephole(def);
+    janetc_hoist(def);
+    janetc_reallocate(def);
 
     /* Pop the scope */
     janetc_popscope(c);
@@ -738,6 +1128,1208 @@ JanetFuncDef *janetc_pop_funcdef(JanetCompiler *c) {
     return def;
 }
 
+/* Get the registers an instruction reads. Returns how many there are. */
+int janetc_reads(uint32_t instr, int32_t *regs) {
+    int32_t a = (instr >> 8) & 0xFF;
+    int32_t b = (instr >> 16) & 0xFF;
+    int32_t c = instr >> 24;
+    int32_t d = instr >> 8;
+    int32_t e = instr >> 16;
+    switch (instr & 0x7F) {
+        case JOP_RETURN:
+        case JOP_PUSH:
+        case JOP_PUSH_ARRAY:
+        case JOP_TAILCALL:
+            regs[0] = d;
+            return 1;
+        case JOP_ERROR:
+        case JOP_TYPECHECK:
+        case JOP_JUMP_IF:
+        case JOP_JUMP_IF_NOT:
+        case JOP_SET_UPVALUE:
+        case JOP_MOVE_FAR:
+            regs[0] = a;
+            return 1;
+        case JOP_PUSH_2:
+            regs[0] = a;
+            regs[1] = e;
+            return 2;
+        case JOP_PUSH_3:
+        case JOP_PUT:
+        case JOP_PUT_INT:
+            regs[0] = a;
+            regs[1] = b;
+            regs[2] = c;
+            return 3;
+        case JOP_PUT_INDEX:
+            regs[0] = a;
+            regs[1] = b;
+            return 2;
+        default:
+            break;
+    }
+    switch (janet_instructions[instr & 0x7F]) {
+        default:
+            return 0;
+        case JINT_SS:
+            regs[0] = e;
+            return 1;
+        case JINT_SSS:
+            regs[0] = b;
+            regs[1] = c;
+            return 2;
+        case JINT_SSI:
+        case JINT_SSU:
+            regs[0] = b;
+            return 1;
+        case JINT_SSL:
+            regs[0] = a;
+            regs[1] = b;
+            return 2;
+        case JINT_SIL:
+            regs[0] = a;
+            return 1;
+    }
+}
+
+/* Get the register an instruction writes, or -1 if it writes none */
+int32_t janetc_writes(uint32_t instr) {
+    switch (instr & 0x7F) {
+        case JOP_RETURN:
+        case JOP_PUSH:
+        case JOP_PUSH_2:
+        case JOP_PUSH_3:
+        case JOP_PUSH_ARRAY:
+        case JOP_TAILCALL:
+        case JOP_ERROR:
+        case JOP_TYPECHECK:
+        case JOP_JUMP_IF:
+        case JOP_JUMP_IF_NOT:
+        case JOP_SET_UPVALUE:
+        case JOP_PUT:
+        case JOP_PUT_INT:
+        case JOP_PUT_INDEX:
+            return -1;
+        case JOP_MOVE_FAR:
+            return instr >> 16;
+        default:
+            break;
+    }
+    switch (janet_instructions[instr & 0x7F]) {
+        default:
+            return (instr >> 8) & 0xFF;
+        case JINT_0:
+        case JINT_L:
+        case JINT_SSL:
+        case JINT_SIL:
+            return -1;
+        case JINT_S:
+            return instr >> 8;
+    }
+}
+
+/* Get the instructions that may run after instruction i. Returns how
+ * many there are. */
+int janetc_successors(uint32_t instr, int32_t i, int32_t *next) {
+    switch (instr & 0x7F) {
+        case JOP_RETURN:
+        case JOP_RETURN_NIL:
+        case JOP_ERROR:
+        case JOP_TAILCALL:
+            return 0;
+        case JOP_JUMP:
+            next[0] = i + ((int32_t) instr >> 8);
+            return 1;
+        case JOP_JUMP_IF:
+        case JOP_JUMP_IF_NOT:
+            next[0] = i + 1;
+            next[1] = i + ((int32_t) instr >> 16);
+            return 2;
+        default:
+            break;
+    }
+    switch (janet_instructions[instr & 0x7F]) {
+        default:
+            next[0] = i + 1;
+            return 1;
+        case JINT_SSL:
+        case JINT_SIL:
+            next[0] = i + 1;
+            next[1] = i + ((int32_t) instr >> 24);
+            return 2;
+    }
+}
+
+/* Liveness
+ *
+ * Find the registers that may be read after each instruction before they
+ * are written again, with a backward dataflow over the bytecode. The
+ * result has words 32 bit words per instruction. Registers captured by a
+ * closure can be read by any call, so the results only hold for functions
+ * that do not need an environment. */
+
+/* Skip very large functions rather than use a lot of memory */
+#define JANETC_LIVENESS_MAX_WORDS 0x40000
+
+uint32_t *janetc_liveness(JanetFuncDef *def, int32_t *words) {
+    int32_t n = def->bytecode_length;
+    int32_t w = (def->slotcount + 31) / 32;
+    if (w == 0 || (int64_t) n * w > JANETC_LIVENESS_MAX_WORDS) return NULL;
+    uint32_t *out = calloc((size_t)(n + 1) * w, sizeof(uint32_t));
+    if (NULL == out) {
+        JANET_OUT_OF_MEMORY;
+    }
+    uint32_t *in = out + (size_t) n * w;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int32_t i = n - 1; i >= 0; i--) {
+            int32_t next[2];
+            int count = janetc_successors(def->bytecode[i], i, next);
+            uint32_t *o = out + (size_t) i * w;
+            for (int j = 0; j < count; j++) {
+                int32_t k = next[j];
+                if (k < 0 || k >= n) continue;
+                /* Registers live before instruction k */
+                uint32_t instr = def->bytecode[k];
+                int32_t regs[3];
+                memcpy(in, out + (size_t) k * w, w * sizeof(uint32_t));
+                int32_t wr = janetc_writes(instr);
+                if (wr >= 0 && wr < def->slotcount) in[wr >> 5] &= ~(1u << (wr & 31));
+                int nr = janetc_reads(instr, regs);
+                for (int r = 0; r < nr; r++) {
+                    if (regs[r] < def->slotcount) in[regs[r] >> 5] |= 1u << (regs[r] & 31);
+                }
+                for (int32_t x = 0; x < w; x++) {
+                    if (in[x] & ~o[x]) {
+                        o[x] |= in[x];
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+    *words = w;
+    return out;
+}
+
+/* Peephole optimization
+ *
+ * Clean up the bytecode of a finished function. Chains of forward jumps
+ * are threaded, jumps to returns become returns, and jumps to the next
+ * instruction and unreachable code are removed. In functions without an
+ * environment, a value computed into a temporary and then moved is
+ * computed into the move's destination, and loads and moves into
+ * registers that are never read are removed. */
+
+/* Check if an instruction writes its register and does nothing else */
+static int janetc_peephole_pure(uint32_t instr) {
+    switch (instr & 0x7F) {
+        default:
+            return 0;
+        case JOP_MOVE_NEAR:
+        case JOP_MOVE_FAR:
+        case JOP_LOAD_NIL:
+        case JOP_LOAD_TRUE:
+        case JOP_LOAD_FALSE:
+        case JOP_LOAD_INTEGER:
+        case JOP_LOAD_CONSTANT:
+        case JOP_LOAD_UPVALUE:
+        case JOP_LOAD_SELF:
+            return 1;
+    }
+}
+
+/* Remove the instructions not marked in keep, and fix up jumps */
+static void janetc_peephole_compact(JanetFuncDef *def, const uint8_t *keep) {
+    int32_t n = def->bytecode_length;
+    int32_t *pos = malloc(sizeof(int32_t) * (n + 1));
+    if (NULL == pos) {
+        JANET_OUT_OF_MEMORY;
+    }
+    int32_t count = 0;
+    for (int32_t i = 0; i < n; i++) {
+        pos[i] = count;
+        if (keep[i]) count++;
+    }
+    pos[n] = count;
+    for (int32_t i = 0; i < n; i++) {
+        if (!keep[i]) continue;
+        uint32_t instr = def->bytecode[i];
+        int shift = janetc_jumpshift(instr);
+        if (shift) {
+            int32_t target = i + ((int32_t) instr >> shift);
+            uint32_t offset = (uint32_t)(pos[target] - pos[i]);
+            instr = (instr & ((1u << shift) - 1)) | offset << shift;
+        }
+        def->bytecode[pos[i]] = instr;
+        if (def->sourcemap) def->sourcemap[pos[i]] = def->sourcemap[i];
+    }
+    def->bytecode_length = count;
+    free(pos);
+}
+
+/* Point the jump at i to target if the offset fits */
+static int janetc_peephole_retarget(JanetFuncDef *def, int32_t i, int32_t target) {
+    uint32_t instr = def->bytecode[i];
+    int shift = janetc_jumpshift(instr);
+    int32_t offset = target - i;
+    int32_t limit = 1 << (31 - shift);
+    if (offset < -limit || offset >= limit) return 0;
+    def->bytecode[i] = (instr & ((1u << shift) - 1)) | (uint32_t) offset << shift;
+    return 1;
+}
+
+/* Thread jumps, and remove no-op jumps and unreachable code */
+static void janetc_peephole_jumps(JanetFuncDef *def, uint8_t *keep) {
+    int32_t n = def->bytecode_length;
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t instr = def->bytecode[i];
+        int shift = janetc_jumpshift(instr);
+        if (!shift) continue;
+        int32_t target = i + ((int32_t) instr >> shift);
+        /* Backward jumps are where the VM checks fuel, samples the
+         * profiler and enters the JIT, so they are kept */
+        for (int hops = 0; hops < 8; hops++) {
+            uint32_t hop = def->bytecode[target];
+            if ((hop & 0x7F) != JOP_JUMP || ((int32_t) hop >> 8) <= 0) break;
+            target += (int32_t) hop >> 8;
+        }
+        uint32_t dest = def->bytecode[target];
+        if ((instr & 0x7F) == JOP_JUMP &&
+                ((dest & 0x7F) == JOP_RETURN || (dest & 0x7F) == JOP_RETURN_NIL)) {
+            def->bytecode[i] = dest;
+        } else {
+            janetc_peephole_retarget(def, i, target);
+        }
+    }
+    /* Mark reachable instructions */
+    int32_t *stack = malloc(sizeof(int32_t) * n);
+    if (NULL == stack) {
+        JANET_OUT_OF_MEMORY;
+    }
+    int32_t top = 0;
+    memset(keep, 0, n);
+    keep[0] = 1;
+    stack[top++] = 0;
+    while (top) {
+        int32_t i = stack[--top];
+        int32_t next[2];
+        int count = janetc_successors(def->bytecode[i], i, next);
+        for (int j = 0; j < count; j++) {
+            if (next[j] < 0 || next[j] >= n || keep[next[j]]) continue;
+            keep[next[j]] = 1;
+            stack[top++] = next[j];
+        }
+    }
+    free(stack);
+    /* Jumps to the next instruction. Fused comparisons can call methods,
+     * so only plain jumps go. */
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t instr = def->bytecode[i];
+        switch (instr & 0x7F) {
+            default:
+                break;
+            case JOP_JUMP:
+            case JOP_JUMP_IF:
+            case JOP_JUMP_IF_NOT:
+                if (i + ((int32_t) instr >> janetc_jumpshift(instr)) == i + 1) keep[i] = 0;
+                break;
+        }
+    }
+}
+
+/* Remove dead loads and moves, and fold moves into the instruction that
+ * computes the moved value. Returns 1 if anything changed. */
+static int janetc_peephole_moves(JanetFuncDef *def, uint8_t *keep) {
+    int32_t n = def->bytecode_length;
+    int32_t w;
+    uint32_t *live = janetc_liveness(def, &w);
+    if (NULL == live) return 0;
+#define janetc_islive(i, reg) (live[(size_t)(i) * w + ((reg) >> 5)] & (1u << ((reg) & 31)))
+    /* Find jump targets, which fold can not cross */
+    uint8_t *target = calloc(n + 1, 1);
+    if (NULL == target) {
+        JANET_OUT_OF_MEMORY;
+    }
+    for (int32_t i = 0; i < n; i++) {
+        int shift = janetc_jumpshift(def->bytecode[i]);
+        if (shift) target[i + ((int32_t) def->bytecode[i] >> shift)] = 1;
+    }
+    int changed = 0;
+    memset(keep, 1, n);
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t instr = def->bytecode[i];
+        int32_t wr = janetc_writes(instr);
+        if (wr < 0 || wr >= def->slotcount) continue;
+        if (janetc_peephole_pure(instr) && !janetc_islive(i, wr)) {
+            keep[i] = 0;
+            changed = 1;
+            continue;
+        }
+        if (i + 1 >= n || target[i + 1]) continue;
+        uint32_t move = def->bytecode[i + 1];
+        int32_t regs[3];
+        if ((move & 0x7F) != JOP_MOVE_NEAR && (move & 0x7F) != JOP_MOVE_FAR) continue;
+        if (janetc_reads(move, regs) != 1 || regs[0] != wr) continue;
+        int32_t dest = janetc_writes(move);
+        /* Drop "move s d" right after "move d s" */
+        if (((instr & 0x7F) == JOP_MOVE_NEAR || (instr & 0x7F) == JOP_MOVE_FAR) &&
+                janetc_reads(instr, regs) == 1 && regs[0] == dest) {
+            keep[i + 1] = 0;
+            changed = 1;
+            i++;
+            continue;
+        }
+        /* Fold "op t ...; move d t" into "op d ..." when t dies */
+        if ((instr & 0x7F) == JOP_MOVE_FAR || janetc_islive(i + 1, wr)) continue;
+        if (janet_instructions[instr & 0x7F] == JINT_S) {
+            def->bytecode[i] = (instr & 0xFF) | (uint32_t) dest << 8;
+        } else if (dest <= 0xFF) {
+            def->bytecode[i] = (instr & 0xFFFF00FF) | (uint32_t) dest << 8;
+        } else {
+            continue;
+        }
+        keep[i + 1] = 0;
+        changed = 1;
+        i++;
+    }
+#undef janetc_islive
+    free(target);
+    free(live);
+    return changed;
+}
+
+/* Run the peephole optimizer on a finished function */
+void janetc_peephole(JanetFuncDef *def) {
+    if (def->bytecode_length == 0) return;
+    uint8_t *keep = malloc(def->bytecode_length);
+    if (NULL == keep) {
+        JANET_OUT_OF_MEMORY;
+    }
+    janetc_peephole_jumps(def, keep);
+    janetc_peephole_compact(def, keep);
+    if (!(def->flags & JANET_FUNCDEF_FLAG_NEEDSENV)) {
+        for (int round = 0; round < 4 && janetc_peephole_moves(def, keep); round++)
+            janetc_peephole_compact(def, keep);
+    }
+    free(keep);
+}
+
+/* Register allocation
+ *
+ * The compiler only frees registers when their scope ends, so a large
+ * function uses many more registers than it has values live at once.
+ * Once a function is finished, its registers are renumbered so that values
+ * that are never live at the same time share a register, which makes stack
+ * frames smaller. Registers that are read before they are written, such as
+ * parameters, keep their numbers. Registers joined by a move are given the
+ * same number when possible, and the move is removed. */
+
+/* Keep the interference matrix small, and all registers near */
+#define JANETC_REALLOCATE_MAX_SLOTS 0x100
+
+void janetc_reallocate(JanetFuncDef *def) {
+    int32_t n = def->bytecode_length;
+    int32_t slots = def->slotcount;
+    if (n == 0 || slots > JANETC_REALLOCATE_MAX_SLOTS) return;
+    if (def->flags & JANET_FUNCDEF_FLAG_NEEDSENV) return;
+    int32_t w;
+    uint32_t *live = janetc_liveness(def, &w);
+    if (NULL == live) return;
+#define janetc_bit(set, reg) ((set)[(reg) >> 5] & (1u << ((reg) & 31)))
+#define janetc_setbit(set, reg) ((set)[(reg) >> 5] |= (1u << ((reg) & 31)))
+    uint32_t *edges = calloc((size_t) slots * w + 2 * w, sizeof(uint32_t));
+    int32_t *color = malloc(sizeof(int32_t) * 2 * slots);
+    uint8_t *keep = malloc(n);
+    if (NULL == edges || NULL == color || NULL == keep) {
+        JANET_OUT_OF_MEMORY;
+    }
+    uint32_t *entry = edges + (size_t) slots * w;
+    uint32_t *used = entry + w;
+    int32_t *partner = color + slots;
+
+    /* Registers live on entry, and registers used at all */
+    int32_t regs[3];
+    memcpy(entry, live, w * sizeof(uint32_t));
+    int32_t wr = janetc_writes(def->bytecode[0]);
+    if (wr >= 0) entry[wr >> 5] &= ~(1u << (wr & 31));
+    for (int r = janetc_reads(def->bytecode[0], regs) - 1; r >= 0; r--)
+        janetc_setbit(entry, regs[r]);
+
+    /* A register written by an instruction interferes with every other
+     * register live after it, except the source of a move */
+    for (int32_t i = 0; i < slots; i++) partner[i] = -1;
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t instr = def->bytecode[i];
+        int nr = janetc_reads(instr, regs);
+        for (int r = 0; r < nr; r++) janetc_setbit(used, regs[r]);
+        wr = janetc_writes(instr);
+        if (wr < 0) continue;
+        janetc_setbit(used, wr);
+        int32_t src = -1;
+        if ((instr & 0x7F) == JOP_MOVE_NEAR || (instr & 0x7F) == JOP_MOVE_FAR) {
+            src = regs[0];
+            partner[wr] = src;
+            partner[src] = wr;
+        }
+        uint32_t *out = live + (size_t) i * w;
+        for (int32_t r = 0; r < slots; r++) {
+            if (r == wr || r == src || !janetc_bit(out, r)) continue;
+            janetc_setbit(edges + (size_t) wr * w, r);
+            janetc_setbit(edges + (size_t) r * w, wr);
+        }
+    }
+
+    /* Color the registers, starting with the fixed ones */
+    int32_t max = -1;
+    for (int32_t r = 0; r < slots; r++) {
+        color[r] = janetc_bit(entry, r) ? r : -1;
+        if (color[r] > max) max = color[r];
+    }
+    uint32_t taken[JANETC_REALLOCATE_MAX_SLOTS / 32];
+    for (int32_t r = 0; r < slots; r++) {
+        if (color[r] >= 0 || !janetc_bit(used, r)) continue;
+        memset(taken, 0, sizeof(taken));
+        for (int32_t x = 0; x < slots; x++) {
+            if (color[x] >= 0 && janetc_bit(edges + (size_t) r * w, x))
+                janetc_setbit(taken, color[x]);
+        }
+        int32_t p = partner[r];
+        if (p >= 0 && color[p] >= 0 && !janetc_bit(taken, color[p])) {
+            color[r] = color[p];
+        } else {
+            int32_t c = 0;
+            while (janetc_bit(taken, c)) c++;
+            color[r] = c;
+        }
+        if (color[r] > max) max = color[r];
+    }
+    for (int32_t r = 0; r < slots; r++) {
+        if (color[r] < 0) color[r] = 0;
+    }
+#undef janetc_bit
+#undef janetc_setbit
+
+    /* Rename, and remove moves that now do nothing */
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t instr = janetc_rename(def->bytecode[i], color);
+        def->bytecode[i] = instr;
+        keep[i] = 1;
+        if ((instr & 0x7F) == JOP_MOVE_NEAR || (instr & 0x7F) == JOP_MOVE_FAR) {
+            janetc_reads(instr, regs);
+            if (regs[0] == janetc_writes(instr)) keep[i] = 0;
+        }
+    }
+    janetc_peephole_compact(def, keep);
+    def->slotcount = max + 1;
+    free(keep);
+    free(color);
+    free(edges);
+    free(live);
+}
+
+/* Loop invariant code motion
+ *
+ * Move instructions that compute the same value on every iteration of a
+ * loop in front of the loop. Loops are found from backward jumps, which
+ * the compiler only emits at the end of a loop. An instruction moves when
+ * the registers it reads are not written in the loop, its own register is
+ * written nowhere else in the loop and is not read before it, and running
+ * it early can not be seen. That depends on what the instruction can do:
+ * constant loads and moves can always move, indexing and length only when
+ * nothing in the loop changes memory or runs unknown code, and
+ * instructions that can raise an error only when they are among the
+ * instructions that run first in the loop. Arithmetic calls methods
+ * unless its first operand is a number, so the registers that only ever
+ * hold numbers are found first. Like the other passes over finished
+ * functions, this only runs on functions that do not need an
+ * environment. */
+
+/* Effects of an instruction */
+#define JANETC_EFFECT_TRAP 1  /* May raise an error */
+#define JANETC_EFFECT_READ 2  /* Reads memory that can change */
+#define JANETC_EFFECT_WRITE 4 /* Changes memory or runs unknown code */
+#define JANETC_EFFECT_FIXED 8 /* Transfers control, uses the argument stack or allocates */
+
+/* Limit the number of loops changed in one function */
+#define JANETC_HOIST_MAX_LOOPS 64
+
+static int janetc_effects(uint32_t instr, const uint8_t *num) {
+    int32_t a = (instr >> 8) & 0xFF;
+    int32_t b = (instr >> 16) & 0xFF;
+    int32_t c = instr >> 24;
+    int32_t e = instr >> 16;
+    switch (instr & 0x7F) {
+        default:
+            return JANETC_EFFECT_FIXED | JANETC_EFFECT_WRITE | JANETC_EFFECT_TRAP;
+        case JOP_NOOP:
+        case JOP_MOVE_NEAR:
+        case JOP_MOVE_FAR:
+        case JOP_LOAD_NIL:
+        case JOP_LOAD_TRUE:
+        case JOP_LOAD_FALSE:
+        case JOP_LOAD_INTEGER:
+        case JOP_LOAD_CONSTANT:
+        case JOP_LOAD_SELF:
+        case JOP_EQUALS:
+        case JOP_EQUALS_IMMEDIATE:
+        case JOP_COMPARE:
+        case JOP_LESS_THAN:
+        case JOP_LESS_THAN_IMMEDIATE:
+        case JOP_GREATER_THAN:
+        case JOP_GREATER_THAN_IMMEDIATE:
+            return 0;
+        case JOP_ADD:
+        case JOP_SUBTRACT:
+        case JOP_MULTIPLY:
+        case JOP_DIVIDE:
+        case JOP_NUMERIC_LESS_THAN:
+        case JOP_NUMERIC_LESS_THAN_EQUAL:
+        case JOP_NUMERIC_GREATER_THAN:
+        case JOP_NUMERIC_GREATER_THAN_EQUAL:
+        case JOP_NUMERIC_EQUAL:
+            if (!num[b]) return JANETC_EFFECT_WRITE | JANETC_EFFECT_TRAP;
+            return num[c] ? 0 : JANETC_EFFECT_TRAP;
+        case JOP_ADD_IMMEDIATE:
+        case JOP_MULTIPLY_IMMEDIATE:
+        case JOP_DIVIDE_IMMEDIATE:
+            return num[b] ? 0 : JANETC_EFFECT_WRITE | JANETC_EFFECT_TRAP;
+        case JOP_BAND:
+        case JOP_BOR:
+        case JOP_BXOR:
+        case JOP_SHIFT_LEFT:
+        case JOP_SHIFT_RIGHT:
+        case JOP_SHIFT_RIGHT_UNSIGNED:
+            return num[b] && num[c] ? 0 : JANETC_EFFECT_TRAP;
+        case JOP_SHIFT_LEFT_IMMEDIATE:
+        case JOP_SHIFT_RIGHT_IMMEDIATE:
+        case JOP_SHIFT_RIGHT_UNSIGNED_IMMEDIATE:
+            return num[b] ? 0 : JANETC_EFFECT_TRAP;
+        case JOP_BNOT:
+            return num[e] ? 0 : JANETC_EFFECT_TRAP;
+        case JOP_GET:
+        case JOP_GET_INT:
+        case JOP_IN:
+        case JOP_IN_INT:
+        case JOP_GET_INDEX:
+        case JOP_LENGTH:
+        case JOP_LOAD_UPVALUE:
+            return JANETC_EFFECT_READ | JANETC_EFFECT_TRAP;
+        case JOP_TYPECHECK:
+            return JANETC_EFFECT_TRAP;
+        case JOP_PUT:
+        case JOP_PUT_INDEX:
+        case JOP_PUT_INT:
+        case JOP_SET_UPVALUE:
+            return JANETC_EFFECT_WRITE | JANETC_EFFECT_TRAP;
+        case JOP_JUMP_IF_LT:
+        case JOP_JUMP_IF_LTE:
+        case JOP_JUMP_IF_GT:
+        case JOP_JUMP_IF_GTE:
+            if (!num[a]) return JANETC_EFFECT_FIXED | JANETC_EFFECT_WRITE | JANETC_EFFECT_TRAP;
+            return num[b] ? JANETC_EFFECT_FIXED : JANETC_EFFECT_FIXED | JANETC_EFFECT_TRAP;
+        case JOP_JUMP_IF_LT_IMMEDIATE:
+        case JOP_JUMP_IF_LTE_IMMEDIATE:
+        case JOP_JUMP_IF_GT_IMMEDIATE:
+        case JOP_JUMP_IF_GTE_IMMEDIATE:
+            if (!num[a]) return JANETC_EFFECT_FIXED | JANETC_EFFECT_WRITE | JANETC_EFFECT_TRAP;
+            return JANETC_EFFECT_FIXED;
+        case JOP_JUMP:
+        case JOP_JUMP_IF:
+        case JOP_JUMP_IF_NOT:
+        case JOP_JUMP_IF_EQUAL:
+        case JOP_JUMP_IF_NOT_EQUAL:
+        case JOP_JUMP_IF_EQUAL_IMMEDIATE:
+        case JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE:
+        case JOP_RETURN:
+        case JOP_RETURN_NIL:
+        case JOP_PUSH:
+        case JOP_PUSH_2:
+        case JOP_PUSH_3:
+        case JOP_CLOSURE:
+        case JOP_MAKE_ARRAY:
+        case JOP_MAKE_TUPLE:
+        case JOP_MAKE_BRACKET_TUPLE:
+        case JOP_MAKE_TABLE:
+        case JOP_MAKE_STRUCT:
+            return JANETC_EFFECT_FIXED;
+        case JOP_ERROR:
+        case JOP_PUSH_ARRAY:
+        case JOP_MAKE_STRING:
+        case JOP_MAKE_BUFFER:
+            return JANETC_EFFECT_FIXED | JANETC_EFFECT_TRAP;
+    }
+}
+
+/* Check if an instruction always writes a number, given the registers
+ * that hold numbers. Bit operations raise an error on anything else. */
+static int janetc_makesnum(JanetFuncDef *def, uint32_t instr, const uint8_t *num) {
+    switch (instr & 0x7F) {
+        default:
+            return 0;
+        case JOP_LOAD_INTEGER:
+        case JOP_BAND:
+        case JOP_BOR:
+        case JOP_BXOR:
+        case JOP_BNOT:
+        case JOP_SHIFT_LEFT:
+        case JOP_SHIFT_LEFT_IMMEDIATE:
+        case JOP_SHIFT_RIGHT:
+        case JOP_SHIFT_RIGHT_IMMEDIATE:
+        case JOP_SHIFT_RIGHT_UNSIGNED:
+        case JOP_SHIFT_RIGHT_UNSIGNED_IMMEDIATE:
+            return 1;
+        case JOP_LOAD_CONSTANT:
+            return janet_checktype(def->constants[instr >> 16], JANET_NUMBER);
+        case JOP_MOVE_NEAR:
+            return num[instr >> 16];
+        case JOP_MOVE_FAR:
+            return num[(instr >> 8) & 0xFF];
+        case JOP_ADD:
+        case JOP_ADD_IMMEDIATE:
+        case JOP_SUBTRACT:
+        case JOP_MULTIPLY:
+        case JOP_MULTIPLY_IMMEDIATE:
+        case JOP_DIVIDE:
+        case JOP_DIVIDE_IMMEDIATE:
+            return num[(instr >> 16) & 0xFF];
+    }
+}
+
+/* Find the registers that only ever hold numbers. Start from every
+ * register not read before it is written, and drop registers written
+ * with anything else until nothing changes. */
+static void janetc_numbers(JanetFuncDef *def, const uint32_t *entry, uint8_t *num) {
+    int32_t n = def->bytecode_length;
+    for (int32_t r = 0; r < def->slotcount; r++)
+        num[r] = !(entry[r >> 5] & (1u << (r & 31)));
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int32_t i = 0; i < n; i++) {
+            uint32_t instr = def->bytecode[i];
+            int32_t wr = janetc_writes(instr);
+            if (wr < 0 || !num[wr] || janetc_makesnum(def, instr, num)) continue;
+            num[wr] = 0;
+            changed = 1;
+        }
+    }
+}
+
+/* Get the registers live before instruction i */
+static void janetc_livein(JanetFuncDef *def, const uint32_t *live, int32_t w,
+                          int32_t i, uint32_t *in) {
+    int32_t regs[3];
+    uint32_t instr = def->bytecode[i];
+    memcpy(in, live + (size_t) i * w, w * sizeof(uint32_t));
+    int32_t wr = janetc_writes(instr);
+    if (wr >= 0) in[wr >> 5] &= ~(1u << (wr & 31));
+    for (int r = janetc_reads(instr, regs) - 1; r >= 0; r--)
+        in[regs[r] >> 5] |= 1u << (regs[r] & 31);
+}
+
+/* Give the value written by instruction i a register of its own, so it
+ * can move even though its register is used for other values in the
+ * loop. Only done when every read of the value is in the same block. */
+static int janetc_hoist_rename(JanetFuncDef *def, const uint32_t *live, int32_t w,
+                               const uint8_t *target, int32_t i, int32_t reg) {
+    int32_t fresh = def->slotcount;
+    int32_t regs[3];
+    int32_t next[2];
+    int32_t last;
+    if (fresh > 0xFF) return 0;
+#define janetc_islive(k) (live[(size_t)(k) * w + (reg >> 5)] & (1u << (reg & 31)))
+    for (last = i + 1;; last++) {
+        uint32_t instr = def->bytecode[last];
+        int reads = 0;
+        for (int r = janetc_reads(instr, regs) - 1; r >= 0; r--) {
+            if (regs[r] == reg) reads = 1;
+        }
+        int writes = janetc_writes(instr) == reg;
+        if (target[last]) {
+            /* Other paths join here, so the value must be dead */
+            if (reads || (!writes && janetc_islive(last))) return 0;
+            last--;
+            break;
+        }
+        if (writes) {
+            if (reads) return 0;
+            last--;
+            break;
+        }
+        int count = janetc_successors(instr, last, next);
+        if (count != 1 || next[0] != last + 1) {
+            if (janetc_islive(last)) return 0;
+            break;
+        }
+    }
+#undef janetc_islive
+    int32_t *map = malloc(sizeof(int32_t) * fresh);
+    if (NULL == map) {
+        JANET_OUT_OF_MEMORY;
+    }
+    for (int32_t r = 0; r < fresh; r++) map[r] = r;
+    map[reg] = fresh;
+    for (int32_t k = i; k <= last; k++)
+        def->bytecode[k] = janetc_rename(def->bytecode[k], map);
+    free(map);
+    def->slotcount++;
+    return 1;
+}
+
+/* Move the invariant instructions of the loop from h to the backward
+ * jump at j in front of it. Returns 1 if anything moved. */
+static int janetc_hoist_loop(JanetFuncDef *def, const uint32_t *live, int32_t w,
+                             uint8_t *num, int32_t h, int32_t j) {
+    int32_t n = def->bytecode_length;
+    int32_t next[2];
+    int32_t regs[3];
+#define janetc_bit(set, reg) ((set)[(reg) >> 5] & (1u << ((reg) & 31)))
+    /* The loop must only be entered at h */
+    for (int32_t i = 0; i < n; i++) {
+        if (i >= h && i <= j) continue;
+        int count = janetc_successors(def->bytecode[i], i, next);
+        for (int k = 0; k < count; k++) {
+            if (next[k] > h && next[k] <= j) return 0;
+        }
+    }
+    /* Sets also cover the registers added by renaming */
+    int32_t sw = w < 8 ? 8 : w;
+    uint32_t *sets = calloc((size_t) 4 * sw, sizeof(uint32_t));
+    int32_t *wcount = calloc(def->slotcount, sizeof(int32_t));
+    uint8_t *moved = calloc(n, 1);
+    uint8_t *target = calloc(n + 1, 1);
+    if (NULL == sets || NULL == wcount || NULL == moved || NULL == target) {
+        JANET_OUT_OF_MEMORY;
+    }
+    uint32_t *header = sets;
+    uint32_t *exits = sets + sw;
+    uint32_t *variant = sets + 2 * sw;
+    uint32_t *in = sets + 3 * sw;
+    for (int32_t i = 0; i < n; i++) {
+        int shift = janetc_jumpshift(def->bytecode[i]);
+        if (shift) target[i + ((int32_t) def->bytecode[i] >> shift)] = 1;
+    }
+
+    /* Summarize the loop. The prefix is the instructions that run first,
+     * up to the first branch. */
+    int writes = 0;
+    int32_t prefix = -1;
+    janetc_livein(def, live, w, h, header);
+    for (int32_t i = h; i <= j; i++) {
+        uint32_t instr = def->bytecode[i];
+        int32_t wr = janetc_writes(instr);
+        if (wr >= 0) {
+            wcount[wr]++;
+            variant[wr >> 5] |= 1u << (wr & 31);
+        }
+        if (janetc_effects(instr, num) & JANETC_EFFECT_WRITE) writes = 1;
+        int count = janetc_successors(instr, i, next);
+        if (prefix < 0 && (count != 1 || next[0] != i + 1)) prefix = i;
+        for (int k = 0; k < count; k++) {
+            if (next[k] >= h && next[k] <= j) continue;
+            if (next[k] < 0 || next[k] >= n) continue;
+            janetc_livein(def, live, w, next[k], in);
+            for (int32_t x = 0; x < w; x++) exits[x] |= in[x];
+        }
+    }
+
+    /* Pick the instructions to move, in order */
+    int32_t hoisted = 0;
+    int barrier = 0;
+    for (int32_t i = h; i <= j; i++) {
+        uint32_t instr = def->bytecode[i];
+        int effects = janetc_effects(instr, num);
+        int32_t wr = janetc_writes(instr);
+        int first = i <= prefix;
+        int ok = wr >= 0 &&
+                 !(effects & (JANETC_EFFECT_WRITE | JANETC_EFFECT_FIXED)) &&
+                 (!(effects & JANETC_EFFECT_READ) || !writes) &&
+                 (!(effects & JANETC_EFFECT_TRAP) || (first && !barrier));
+        int nr = janetc_reads(instr, regs);
+        for (int r = 0; ok && r < nr; r++) {
+            if (janetc_bit(variant, regs[r])) ok = 0;
+        }
+        if (ok && (wcount[wr] > 1 || janetc_bit(header, wr) ||
+                   (!first && janetc_bit(exits, wr)))) {
+            ok = janetc_hoist_rename(def, live, w, target, i, wr);
+            if (ok) {
+                num[def->slotcount - 1] = num[wr];
+                wr = def->slotcount - 1;
+            }
+        }
+        if (ok) {
+            moved[i] = 1;
+            hoisted++;
+            variant[wr >> 5] &= ~(1u << (wr & 31));
+        } else if (first && (effects & (JANETC_EFFECT_TRAP | JANETC_EFFECT_WRITE))) {
+            barrier = 1;
+        }
+    }
+#undef janetc_bit
+    free(target);
+    free(wcount);
+    free(sets);
+    if (!hoisted) {
+        free(moved);
+        return 0;
+    }
+
+    /* New positions. Jumps into the loop from outside go to the moved
+     * instructions, jumps inside it skip them. */
+    int32_t *pos = malloc(sizeof(int32_t) * (n + 1));
+    uint32_t *bytecode = malloc(sizeof(uint32_t) * n);
+    if (NULL == pos || NULL == bytecode) {
+        JANET_OUT_OF_MEMORY;
+    }
+    int32_t count = h + hoisted;
+    for (int32_t i = 0; i < n; i++) {
+        if (i < h || i > j) pos[i] = i;
+        else if (!moved[i]) pos[i] = count++;
+    }
+    pos[n] = n;
+    for (int32_t i = j; i >= h; i--) {
+        if (moved[i]) pos[i] = pos[i + 1];
+    }
+    int32_t at = h;
+    for (int32_t i = h; i <= j; i++) {
+        if (moved[i]) bytecode[at++] = def->bytecode[i];
+    }
+    int fits = 1;
+    for (int32_t i = 0; i < n; i++) {
+        if (moved[i]) continue;
+        uint32_t instr = def->bytecode[i];
+        int shift = janetc_jumpshift(instr);
+        if (shift) {
+            int32_t target = i + ((int32_t) instr >> shift);
+            int32_t dest = (target == h && (i < h || i > j)) ? h : pos[target];
+            int32_t offset = dest - pos[i];
+            int32_t limit = 1 << (31 - shift);
+            if (offset < -limit || offset >= limit) fits = 0;
+            instr = (instr & ((1u << shift) - 1)) | (uint32_t) offset << shift;
+        }
+        bytecode[pos[i]] = instr;
+    }
+    if (fits) {
+        if (def->sourcemap) {
+            JanetSourceMapping *map = malloc(sizeof(JanetSourceMapping) * (j - h + 1));
+            if (NULL == map) {
+                JANET_OUT_OF_MEMORY;
+            }
+            at = 0;
+            for (int32_t i = h; i <= j; i++) {
+                if (moved[i]) map[at++] = def->sourcemap[i];
+            }
+            for (int32_t i = h; i <= j; i++) {
+                if (!moved[i]) map[pos[i] - h] = def->sourcemap[i];
+            }
+            memcpy(def->sourcemap + h, map, sizeof(JanetSourceMapping) * (j - h + 1));
+            free(map);
+        }
+        memcpy(def->bytecode, bytecode, sizeof(uint32_t) * n);
+    }
+    free(bytecode);
+    free(pos);
+    free(moved);
+    return fits;
+}
+
+/* Run loop invariant code motion on a finished function. Inner loops end
+ * first, so their invariants can move on out of the loops around them. */
+void janetc_hoist(JanetFuncDef *def) {
+    int32_t n = def->bytecode_length;
+    if (n == 0 || (def->flags & JANET_FUNCDEF_FLAG_NEEDSENV)) return;
+    uint8_t *num = malloc(def->slotcount > 0xFF ? def->slotcount : 0x100);
+    if (NULL == num) {
+        JANET_OUT_OF_MEMORY;
+    }
+    uint32_t *live = NULL;
+    int32_t w = 0;
+    int changes = 0;
+    for (int32_t j = 0; j < n && changes < JANETC_HOIST_MAX_LOOPS; j++) {
+        uint32_t instr = def->bytecode[j];
+        if ((instr & 0x7F) != JOP_JUMP || ((int32_t) instr >> 8) > 0) continue;
+        if (NULL == live) {
+            live = janetc_liveness(def, &w);
+            if (NULL == live) break;
+            uint32_t *entry = malloc(w * sizeof(uint32_t));
+            if (NULL == entry) {
+                JANET_OUT_OF_MEMORY;
+            }
+            janetc_livein(def, live, w, 0, entry);
+            janetc_numbers(def, entry, num);
+            free(entry);
+        }
+        if (janetc_hoist_loop(def, live, w, num, j + ((int32_t) instr >> 8), j)) {
+            changes++;
+            free(live);
+            live = NULL;
+        }
+    }
+    free(live);
+    free(num);
+}
+
+/* Escape analysis
+ *
+ * Follow three kinds of values through the registers of a finished
+ * function: its parameters (bits 0-29), the function itself, and closures
+ * that capture its stack frame. Calling, testing or moving such a value
+ * does not let anything keep it, and neither does passing it to a
+ * parameter that the callee never keeps. Any other use lets it escape. A
+ * local closure also escapes when a tail call replaces the frame while it
+ * is in use. Functions whose local closures never escape do not need to
+ * copy their environment off of the stack when they return. */
+
+#define JANETC_ESCAPE_PARAMS 0x3FFFFFFFu
+#define JANETC_ESCAPE_SELF 0x40000000u
+#define JANETC_ESCAPE_LOCAL 0x80000000u
+
+/* Skip very large functions rather than use a lot of memory */
+#define JANETC_ESCAPE_MAX_STATE 0x100000
+
+/* Check if an instruction only moves values to or from the argument
+ * stack, as the instructions around a function call do */
+static int janetc_escape_isload(uint32_t instr) {
+    switch (instr & 0x7F) {
+        default:
+            return 0;
+        case JOP_LOAD_NIL:
+        case JOP_LOAD_TRUE:
+        case JOP_LOAD_FALSE:
+        case JOP_LOAD_INTEGER:
+        case JOP_LOAD_CONSTANT:
+        case JOP_LOAD_UPVALUE:
+        case JOP_LOAD_SELF:
+        case JOP_MOVE_NEAR:
+            return 1;
+    }
+}
+
+/* Find the call that takes an argument pushed by instruction i, and get
+ * which kinds of values may be passed in that position */
+static uint32_t janetc_escape_arg(JanetFuncDef *def, int32_t i, int32_t operand) {
+    const uint32_t *bc = def->bytecode;
+    int32_t n = def->bytecode_length;
+    int32_t pos = operand;
+    int32_t j;
+    for (j = i - 1; j >= 0; j--) {
+        uint32_t op = bc[j] & 0x7F;
+        if (op == JOP_PUSH) pos += 1;
+        else if (op == JOP_PUSH_2) pos += 2;
+        else if (op == JOP_PUSH_3) pos += 3;
+        else if (op == JOP_PUSH_ARRAY) return 0;
+        else if (!janetc_escape_isload(bc[j])) break;
+    }
+    for (j = i + 1; j < n; j++) {
+        uint32_t op = bc[j] & 0x7F;
+        if (op != JOP_PUSH && op != JOP_PUSH_2 && op != JOP_PUSH_3 &&
+                op != JOP_PUSH_ARRAY && !janetc_escape_isload(bc[j]))
+            break;
+    }
+    if (j >= n || j == i + 1) return 0;
+    uint32_t call = bc[j];
+    uint32_t load = bc[j - 1];
+    if ((load & 0x7F) != JOP_LOAD_CONSTANT) return 0;
+    int32_t callee;
+    if ((call & 0x7F) == JOP_CALL) {
+        callee = call >> 16;
+    } else if ((call & 0x7F) == JOP_TAILCALL) {
+        callee = call >> 8;
+    } else {
+        return 0;
+    }
+    if (callee != (int32_t)((load >> 8) & 0xFF)) return 0;
+    if ((int32_t)(load >> 16) >= def->constants_length) return 0;
+    Janet fv = def->constants[load >> 16];
+    if (!janet_checktype(fv, JANET_FUNCTION)) return 0;
+    JanetFuncDef *callee_def = janet_unwrap_function(fv)->def;
+    if (pos >= 30 || pos >= callee_def->arity) return 0;
+    if (!(callee_def->noescape & (1 << pos))) return 0;
+    return ((call & 0x7F) == JOP_CALL)
+           ? 0xFFFFFFFFu
+           : (JANETC_ESCAPE_PARAMS | JANETC_ESCAPE_SELF);
+}
+
+/* Find the values of a function that a nested function definition can
+ * reach through the function's stack frame. envs marks which of the
+ * nested definition's environments is that frame. */
+static uint32_t janetc_escape_nested(JanetFuncDef *def, const uint8_t *envs,
+                                     const uint32_t *ever, int32_t slots, int depth) {
+    uint32_t escaped = 0;
+    int32_t i;
+    if (depth > JANET_RECURSION_GUARD) return 0xFFFFFFFFu;
+    for (i = 0; i < def->bytecode_length; i++) {
+        uint32_t instr = def->bytecode[i];
+        if ((instr & 0x7F) == JOP_LOAD_UPVALUE && envs[(instr >> 16) & 0xFF]) {
+            int32_t vindex = instr >> 24;
+            escaped |= vindex < slots ? ever[vindex] : 0xFFFFFFFFu;
+        }
+    }
+    for (i = 0; i < def->defs_length; i++) {
+        JanetFuncDef *sub = def->defs[i];
+        uint8_t subenvs[256] = {0};
+        int any = 0;
+        for (int32_t j = 0; j < sub->environments_length && j < 256; j++) {
+            int32_t inherit = sub->environments[j];
+            if (inherit >= 0 && inherit < 256 && envs[inherit]) {
+                subenvs[j] = 1;
+                any = 1;
+            }
+        }
+        if (any) {
+            /* Closures made by the nested function could keep the frame */
+            escaped |= JANETC_ESCAPE_LOCAL;
+            escaped |= janetc_escape_nested(sub, subenvs, ever, slots, depth + 1);
+        }
+    }
+    return escaped;
+}
+
+/* Check if a function definition captures the stack frame of the
+ * function that creates it */
+static int janetc_escape_captures(JanetFuncDef *def) {
+    for (int32_t i = 0; i < def->environments_length; i++) {
+        if (def->environments[i] == -1) return 1;
+    }
+    return 0;
+}
+
+void janetc_escape(JanetFuncDef *def) {
+    int32_t n = def->bytecode_length;
+    int32_t slots = def->slotcount;
+    int32_t nparams = def->arity < 30 ? def->arity : 30;
+    int32_t i;
+    uint32_t escaped = 0;
+    uint32_t tracked = (uint32_t)((1u << nparams) - 1) | JANETC_ESCAPE_SELF;
+    if (n == 0 || slots == 0 || (int64_t) n * slots > JANETC_ESCAPE_MAX_STATE) return;
+
+    uint32_t *state = calloc((size_t) n * slots + slots + slots, sizeof(uint32_t));
+    int32_t *work = malloc(sizeof(int32_t) * n);
+    uint8_t *queued = calloc(n, 1);
+    uint8_t *visited = calloc(n, 1);
+    if (NULL == state || NULL == work || NULL == queued || NULL == visited) {
+        JANET_OUT_OF_MEMORY;
+    }
+    uint32_t *regs = state + (size_t) n * slots;
+    uint32_t *ever = regs + slots;
+
+    /* Parameters start in the first registers */
+    for (i = 0; i < nparams && i < slots; i++) {
+        state[i] = 1u << i;
+        ever[i] = 1u << i;
+    }
+    int32_t nwork = 0;
+    work[nwork++] = 0;
+    queued[0] = 1;
+
+    while (nwork) {
+        int32_t pc = work[--nwork];
+        uint32_t instr = def->bytecode[pc];
+        uint32_t op = instr & 0x7F;
+        int32_t reads[3], next[2];
+        int nreads, nnext, k;
+        queued[pc] = 0;
+        visited[pc] = 1;
+        memcpy(regs, state + (size_t) pc * slots, sizeof(uint32_t) * slots);
+
+        /* Uses of values */
+        nreads = janetc_reads(instr, reads);
+        for (k = 0; k < nreads; k++) {
+            uint32_t held = reads[k] < slots ? regs[reads[k]] : 0;
+            uint32_t allowed;
+            if (!held) continue;
+            switch (op) {
+                default:
+                    allowed = 0;
+                    break;
+                case JOP_CALL:
+                case JOP_MOVE_NEAR:
+                case JOP_MOVE_FAR:
+                case JOP_JUMP_IF:
+                case JOP_JUMP_IF_NOT:
+                case JOP_TYPECHECK:
+                    allowed = 0xFFFFFFFFu;
+                    break;
+                case JOP_TAILCALL:
+                    allowed = JANETC_ESCAPE_PARAMS | JANETC_ESCAPE_SELF;
+                    break;
+                case JOP_PUSH:
+                case JOP_PUSH_2:
+                case JOP_PUSH_3:
+                    allowed = janetc_escape_arg(def, pc, k);
+                    break;
+            }
+            escaped |= held & ~allowed;
+        }
+
+        /* Definitions of values */
+        int32_t dest = janetc_writes(instr);
+        if (dest >= 0 && dest < slots) {
+            uint32_t value = 0;
+            if (op == JOP_MOVE_NEAR) {
+                value = reads[0] < slots ? regs[reads[0]] : 0;
+            } else if (op == JOP_MOVE_FAR) {
+                value = reads[0] < slots ? regs[reads[0]] : 0;
+            } else if (op == JOP_LOAD_SELF) {
+                value = JANETC_ESCAPE_SELF;
+            } else if (op == JOP_CLOSURE) {
+                int32_t defindex = instr >> 16;
+                if (defindex < def->defs_length && janetc_escape_captures(def->defs[defindex]))
+                    value = JANETC_ESCAPE_LOCAL;
+            }
+            regs[dest] = value;
+            ever[dest] |= value;
+        }
+
+        /* Merge in to following instructions */
+        nnext = janetc_successors(instr, pc, next);
+        for (k = 0; k < nnext; k++) {
+            int32_t to = next[k];
+            int changed = 0;
+            if (to < 0 || to >= n) continue;
+            uint32_t *target = state + (size_t) to * slots;
+            for (int32_t r = 0; r < slots; r++) {
+                if (regs[r] & ~target[r]) {
+                    target[r] |= regs[r];
+                    changed = 1;
+                }
+            }
+            if ((changed || !visited[to]) && !queued[to]) {
+                queued[to] = 1;
+                work[nwork++] = to;
+            }
+        }
+    }
+
+    /* Check what nested functions can do with the frame */
+    for (i = 0; i < def->defs_length; i++) {
+        JanetFuncDef *sub = def->defs[i];
+        uint8_t envs[256] = {0};
+        int any = 0;
+        for (int32_t j = 0; j < sub->environments_length && j < 256; j++) {
+            if (sub->environments[j] == -1) {
+                envs[j] = 1;
+                any = 1;
+            }
+        }
+        if (!any) continue;
+        if (!(sub->noescape & JANETC_ESCAPE_SELF)) escaped |= JANETC_ESCAPE_LOCAL;
+        escaped |= janetc_escape_nested(sub, envs, ever, slots, 0);
+    }
+
+    def->noescape = (int32_t)(tracked & ~escaped);
+    if ((def->flags & JANET_FUNCDEF_FLAG_NEEDSENV) && !(escaped & JANETC_ESCAPE_LOCAL)) {
+        def->flags |= JANET_FUNCDEF_FLAG_LOCALENV;
+    }
+
+    free(state);
+    free(work);
+    free(queued);
+    free(visited);
+}
+
 /* Initialize a compiler */
 static void janetc_init(JanetCompiler *c, JanetTable *env, const uint8_t *where) {
     c->scope = NULL;
@@ -786,6 +2378,7 @@ JanetCompileResult janet_compile(Janet source, JanetTable *env, const uint8_t *w
     if (c.result.status == JANET_COMPILE_OK) {
         JanetFuncDef *def = janetc_pop_funcdef(&c);
         def->name = janet_cstring("_thunk");
+        janetc_escape(def);
         c.result.funcdef = def;
     } else {
         c.result.error_mapping = c.current_mapping;
@@ -83,6 +83,14 @@ typedef struct JanetSpecial JanetSpecial;
 /* Used for unquote-splicing */
 #define JANET_SLOT_SPLICED 0x200000
 
+/* Not a value, but a fused compare and branch that has already been emitted.
+ * The index is the label of the jump taken when the comparison fails. */
+#define JANET_SLOT_BRANCH 0x400000
+
+/* Holds a number that is an integer whenever it is finite. Such slots can
+ * be used as keys for the integer indexing instructions. See janetc_isint. */
+#define JANET_SLOT_INT 0x800000
+
 #define JANET_SLOTTYPE_ANY 0xFFFF
 
 /* A stack slot */
@@ -91,6 +99,7 @@ struct JanetSlot {
     int32_t index;
     int32_t envindex; /* 0 is local, positive number is an upvalue */
     uint32_t flags;
+    uint32_t intdeps; /* Bits of the vars a JANET_SLOT_INT slot relies on */
 };
 
 #define JANET_SCOPE_FUNCTION 1
@@ -107,6 +116,14 @@ typedef struct SymPair {
     int keep;
 } SymPair;
 
+/* Integer indexing instructions emitted in a range of bytecode, and the
+ * bits of the vars their keys rely on */
+typedef struct JanetIntSite {
+    int32_t start;
+    int32_t end;
+    uint32_t deps;
+} JanetIntSite;
+
 /* A lexical scope during compilation */
 struct JanetScope {
 
@@ -136,6 +153,12 @@ struct JanetScope {
 
     int32_t bytecode_start;
     int flags;
+
+    /* Vars assumed to hold integers in this funcdef each get a bit. A bit is
+     * killed when its var is assigned something else or is captured. */
+    uint32_t intvars;
+    uint32_t intdead;
+    JanetIntSite *intsites;
 };
 
 /* Compilation state */
@@ -166,6 +189,9 @@ struct JanetCompiler {
 #define JANET_FOPTS_TAIL 0x10000
 #define JANET_FOPTS_HINT 0x20000
 #define JANET_FOPTS_DROP 0x40000
+/* The value is only tested for truthiness by a conditional jump, so a
+ * comparison may compile to a branch slot instead. */
+#define JANET_FOPTS_BRANCH 0x80000
 
 /* Options for compiling a single form */
 struct JanetFopts {
@@ -242,4 +268,31 @@ JanetSlot janetc_cslot(Janet x);
 /* Search for a symbol */
 JanetSlot janetc_resolve(JanetCompiler *c, const uint8_t *sym);
 
+/* Registers used by an instruction, and the instructions that can follow it */
+int janetc_reads(uint32_t instr, int32_t *regs);
+int32_t janetc_writes(uint32_t instr);
+int janetc_successors(uint32_t instr, int32_t i, int32_t *next);
+
+/* Registers live after each instruction of a finished function */
+uint32_t *janetc_liveness(JanetFuncDef *def, int32_t *words);
+
+/* Clean up the bytecode of a finished function */
+void janetc_peephole(JanetFuncDef *def);
+
+/* Move loop invariant instructions of a finished function out of loops */
+void janetc_hoist(JanetFuncDef *def);
+
+/* Renumber the registers of a finished function to make its frame smaller */
+void janetc_reallocate(JanetFuncDef *def);
+
+/* Find which parameters and closures of a finished function never escape */
+void janetc_escape(JanetFuncDef *def);
+
+/* Integer specialization */
+int janetc_checkint(Janet x);
+int janetc_isint(JanetCompiler *c, JanetSlot s);
+uint32_t janetc_intvar(JanetCompiler *c);
+void janetc_intsite(JanetCompiler *c, int32_t start, JanetSlot key);
+void janetc_nointegers(JanetCompiler *c, JanetScope *scope, uint32_t deps);
+
 #endif
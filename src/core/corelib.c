@@ -24,6 +24,7 @@
 #include <janet.h>
 #include <math.h>
 #include "compile.h"
+#include "gc.h"
 #include "state.h"
 #include "util.h"
 #endif
@@ -404,6 +405,7 @@ static Janet janet_core_gcsetinterval(int32_t argc, Janet *argv) {
     int32_t val = janet_getinteger(argv, 0);
     if (val < 0)
         janet_panic("expected non-negative integer");
+    janet_vm_gc_policy = JANET_GC_POLICY_FIXED;
     janet_vm_gc_interval = val;
     return janet_wrap_nil();
 }
@@ -414,6 +416,88 @@ static Janet janet_core_gcinterval(int32_t argc, Janet *argv) {
     return janet_wrap_number(janet_vm_gc_interval);
 }
 
+static Janet janet_core_gcsetpolicy(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 4);
+    const uint8_t *policy = janet_getkeyword(argv, 0);
+    double growth = janet_optnumber(argv, argc, 1, janet_vm_gc_growth);
+    int32_t min_interval = janet_optinteger(argv, argc, 2, janet_vm_gc_min_interval);
+    int32_t max_interval = janet_optinteger(argv, argc, 3, janet_vm_gc_max_interval);
+    if (!(growth > 0))
+        janet_panic("expected positive growth fraction");
+    if (min_interval < 0 || max_interval < min_interval)
+        janet_panic("expected 0 <= min-interval <= max-interval");
+    if (!janet_cstrcmp(policy, "fixed")) {
+        janet_gcsetpolicy(JANET_GC_POLICY_FIXED, growth, min_interval, max_interval);
+    } else if (!janet_cstrcmp(policy, "adaptive")) {
+        janet_gcsetpolicy(JANET_GC_POLICY_ADAPTIVE, growth, min_interval, max_interval);
+    } else {
+        janet_panicf("expected :fixed or :adaptive, got %v", argv[0]);
+    }
+    return janet_wrap_nil();
+}
+
+static Janet janet_core_gcpolicy(int32_t argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 0);
+    return janet_ckeywordv(janet_vm_gc_policy == JANET_GC_POLICY_ADAPTIVE ? "adaptive" : "fixed");
+}
+
+static Janet janet_core_gcsetincremental(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    int32_t val = janet_getinteger(argv, 0);
+    if (val < 0)
+        janet_panic("expected non-negative integer");
+    janet_vm_gc_step = val;
+    return janet_wrap_nil();
+}
+
+static Janet janet_core_gcincremental(int32_t argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 0);
+    return janet_wrap_number(janet_vm_gc_step);
+}
+
+static Janet janet_core_gcstats(int32_t argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 0);
+    JanetGCStats stats;
+    janet_gcstats(&stats);
+    JanetTable *types = janet_table(JANET_GC_TYPE_COUNT);
+    for (int i = 1; i < JANET_GC_TYPE_COUNT; i++) {
+        JanetKV *st = janet_struct_begin(2);
+        janet_struct_put(st, janet_ckeywordv("count"), janet_wrap_number((double) stats.type_counts[i]));
+        janet_struct_put(st, janet_ckeywordv("bytes"), janet_wrap_number((double) stats.type_bytes[i]));
+        janet_table_put(types, janet_ckeywordv(janet_gc_type_names[i]), janet_wrap_struct(janet_struct_end(st)));
+    }
+    JanetTable *t = janet_table(10);
+    janet_table_put(t, janet_ckeywordv("collections"), janet_wrap_number((double) stats.collections));
+    janet_table_put(t, janet_ckeywordv("minor-collections"), janet_wrap_number((double) stats.minor_collections));
+    janet_table_put(t, janet_ckeywordv("pause-total"), janet_wrap_number(stats.pause_total));
+    janet_table_put(t, janet_ckeywordv("pause-max"), janet_wrap_number(stats.pause_max));
+    janet_table_put(t, janet_ckeywordv("bytes-since-collection"), janet_wrap_number((double) stats.bytes_since_collection));
+    janet_table_put(t, janet_ckeywordv("live-bytes"), janet_wrap_number((double) stats.live_bytes));
+    janet_table_put(t, janet_ckeywordv("live-count"), janet_wrap_number((double) stats.live_count));
+    janet_table_put(t, janet_ckeywordv("roots"), janet_wrap_number(stats.root_count));
+    janet_table_put(t, janet_ckeywordv("pages"), janet_wrap_number((double) stats.page_count));
+    janet_table_put(t, janet_ckeywordv("types"), janet_wrap_table(types));
+    return janet_wrap_table(t);
+}
+
+static Janet janet_core_arena_begin(int32_t argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 0);
+    return janet_wrap_integer(janet_arena_begin());
+}
+
+static Janet janet_core_arena_end(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    int32_t handle = janet_getinteger(argv, 0);
+    if (handle < 0 || handle >= *janet_arena_depth())
+        janet_panicf("invalid arena handle %v", argv[0]);
+    janet_arena_end(handle);
+    return janet_wrap_nil();
+}
+
 static Janet janet_core_type(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
     JanetType t = janet_type(argv[0]);
@@ -599,7 +683,8 @@ static const JanetReg corelib_cfuns[] = {
         JDOC("(gcsetinterval interval)\n\n"
         "Set an integer number of bytes to allocate before running garbage collection. "
         "Low values for interval will be slower but use less memory. "
-        "High values will be faster but use more memory.")
+        "High values will be faster but use more memory. "
+        "This also selects the :fixed collection policy.")
     },
     {
         "gcinterval", janet_core_gcinterval,
@@ -607,6 +692,68 @@ static const JanetReg corelib_cfuns[] = {
         "Returns the integer number of bytes to allocate before running an iteration "
         "of garbage collection.")
     },
+    {
+        "gc/arena-begin", janet_core_arena_begin,
+        JDOC("(gc/arena-begin)\n\n"
+        "Begin a garbage collection arena. Objects allocated until the matching "
+        "gc/arena-end are not collected before then, and are freed all at once "
+        "when the arena ends unless they are still reachable. Returns a handle to pass to "
+        "gc/arena-end. Arenas belong to the fiber that began them and must be ended "
+        "in that fiber. Prefer the with-arena macro.")
+    },
+    {
+        "gc/arena-end", janet_core_arena_end,
+        JDOC("(gc/arena-end handle)\n\n"
+        "End a garbage collection arena started with gc/arena-begin, freeing the objects "
+        "allocated in it that are no longer reachable. Ending an arena also ends the "
+        "arenas nested in it. Returns nil.")
+    },
+    {
+        "gcsetpolicy", janet_core_gcsetpolicy,
+        JDOC("(gcsetpolicy policy &opt growth min-interval max-interval)\n\n"
+        "Choose how the garbage collector decides when to run. With the :fixed policy, "
+        "it runs every gcinterval bytes of allocation. With the :adaptive policy, "
+        "the interval is set after each collection to growth times the number of live bytes, "
+        "but no less than min-interval and no more than max-interval. The defaults are "
+        "a growth of 0.5, a min-interval of 64KiB and a max-interval of 256MiB. "
+        "Returns nil.")
+    },
+    {
+        "gcpolicy", janet_core_gcpolicy,
+        JDOC("(gcpolicy)\n\n"
+        "Returns the current garbage collection policy, either :fixed or :adaptive.")
+    },
+    {
+        "gcsetincremental", janet_core_gcsetincremental,
+        JDOC("(gcsetincremental budget)\n\n"
+        "Set the amount of marking work done in each step of an incremental full "
+        "garbage collection, roughly the number of values marked. A full collection "
+        "is then spread over many steps, one every gcinterval bytes of allocation, "
+        "instead of pausing the program until it is done. "
+        "A budget of 0 turns incremental collection off, which is the default.")
+    },
+    {
+        "gcincremental", janet_core_gcincremental,
+        JDOC("(gcincremental)\n\n"
+        "Returns the marking budget of each step of incremental garbage collection, "
+        "or 0 if incremental collection is turned off.")
+    },
+    {
+        "gc/stats", janet_core_gcstats,
+        JDOC("(gc/stats)\n\n"
+        "Get statistics about the garbage collector as a table with the following keys:\n\n"
+        "\t:collections - number of full collections\n"
+        "\t:minor-collections - number of collections of only the young generation\n"
+        "\t:pause-total - total time in seconds the program was paused for collection\n"
+        "\t:pause-max - longest single pause in seconds\n"
+        "\t:bytes-since-collection - bytes allocated since the last collection\n"
+        "\t:live-bytes - bytes used by objects that survived collection\n"
+        "\t:live-count - number of objects that survived collection\n"
+        "\t:roots - number of gc roots\n"
+        "\t:pages - number of pages small objects are allocated from\n"
+        "\t:types - table from memory type to a struct of :count and :bytes of "
+        "surviving objects of that type")
+    },
     {
         "type", janet_core_type,
         JDOC("(type x)\n\n"
@@ -662,7 +809,8 @@ static const JanetReg corelib_cfuns[] = {
     {
         "trace", janet_core_trace,
         JDOC("(trace func)\n\n"
-        "Enable tracing on a function. Returns the function.")
+        "Enable tracing on a function. Returns the function. Calls to the "
+        "function that were already inlined by the compiler are not traced.")
     },
     {
         "untrace", janet_core_untrace,
@@ -23,11 +23,22 @@
 #ifndef JANET_AMALG
 #include <janet.h>
 #include "gc.h"
+#include "fiber.h"
+#include "jit.h"
 #include "state.h"
 #include "util.h"
 #include "vector.h"
 #endif
 
+#include <stdlib.h>
+#ifdef JANET_POSIX
+#include <signal.h>
+#include <sys/time.h>
+#ifdef JANET_THREADS
+#include <pthread.h>
+#endif
+#endif
+
 /* Implements functionality to build a debugger from within janet.
  * The repl should also be able to serve as pretty featured debugger
  * out of the box. */
@@ -37,6 +48,10 @@ void janet_debug_break(JanetFuncDef *def, int32_t pc) {
     if (pc >= def->bytecode_length || pc < 0)
         janet_panic("invalid bytecode offset");
     def->bytecode[pc] |= 0x80;
+#ifdef JANET_JIT
+    janet_jit_free(def);
+    def->flags |= JANET_FUNCDEF_FLAG_NOJIT;
+#endif
 }
 
 /* Remove a break point from a function */
@@ -53,14 +68,22 @@ void janet_debug_unbreak(JanetFuncDef *def, int32_t pc) {
 void janet_debug_find(
     JanetFuncDef **def_out, int32_t *pc_out,
     const uint8_t *source, int32_t sourceLine, int32_t sourceColumn) {
-    /* Scan the heap for right func def */
-    JanetGCObject *current = janet_vm_blocks;
+    /* Scan the heap for right func def, first the young generation and then the old */
+    JanetGCObject *current;
+    janet_sweep_finish();
+    current = janet_vm_blocks;
+    int scanned_old = 0;
     /* Keep track of the best source mapping we have seen so far */
     int32_t besti = -1;
     int32_t best_line = -1;
     int32_t best_column = -1;
     JanetFuncDef *best_def = NULL;
-    while (NULL != current) {
+    while (NULL != current || !scanned_old) {
+        if (NULL == current) {
+            current = janet_vm_old_blocks;
+            scanned_old = 1;
+            continue;
+        }
         if ((current->flags & JANET_MEM_TYPEBITS) == JANET_MEMORY_FUNCDEF) {
             JanetFuncDef *def = (JanetFuncDef *)(current);
             if (def->sourcemap &&
@@ -168,6 +191,133 @@ void janet_stacktrace(JanetFiber *fiber, Janet err) {
     janet_v_free(fibers);
 }
 
+/*
+ * Sampling profiler
+ */
+
+volatile sig_atomic_t janet_vm_profile_pending = 0;
+JANET_THREAD_LOCAL JanetTable *janet_vm_profile = NULL;
+static JANET_THREAD_LOCAL int32_t janet_vm_profile_root = -1;
+static JANET_THREAD_LOCAL JanetBuffer janet_vm_profile_scratch;
+#ifdef JANET_POSIX
+/* The timer, the signal handler and janet_vm_profile_pending are shared by
+ * all threads, so the profiler only runs while there is a single vm thread. */
+static int janet_vm_profile_active = 0;
+static int janet_vm_profile_threads = 0;
+static struct sigaction janet_vm_profile_oldaction;
+#ifdef JANET_THREADS
+static pthread_mutex_t janet_vm_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#define profile_lock() pthread_mutex_lock(&janet_vm_profile_lock)
+#define profile_unlock() pthread_mutex_unlock(&janet_vm_profile_lock)
+#else
+#define profile_lock()
+#define profile_unlock()
+#endif
+#endif
+
+/* Append the name and location of one frame, in the same terms
+ * as janet_stacktrace */
+static void profile_frame(JanetBuffer *buffer, JanetStackFrame *frame) {
+    if (frame->func) {
+        JanetFuncDef *def = frame->func->def;
+        janet_buffer_push_cstring(buffer, def->name ? (const char *)def->name : "<anonymous>");
+        if (def->source) {
+            janet_buffer_push_cstring(buffer, " [");
+            janet_buffer_push_string(buffer, def->source);
+            if (def->sourcemap && frame->pc) {
+                char line[16];
+                JanetSourceMapping mapping = def->sourcemap[frame->pc - def->bytecode];
+                snprintf(line, sizeof(line), ":%d", mapping.line);
+                janet_buffer_push_cstring(buffer, line);
+            }
+            janet_buffer_push_u8(buffer, ']');
+        }
+    } else {
+        JanetCFunction cfun = (JanetCFunction)(frame->pc);
+        Janet name = janet_wrap_nil();
+        if (cfun) name = janet_table_get(janet_vm_registry, janet_wrap_cfunction(cfun));
+        if (janet_checktype(name, JANET_NIL)) {
+            janet_buffer_push_cstring(buffer, "<cfunction>");
+        } else {
+            janet_buffer_push_bytes(buffer, janet_to_string(name), janet_string_length(janet_to_string(name)));
+        }
+    }
+}
+
+/* Count one sample of the fiber's stack, as frames from the bottom
+ * of the stack up separated by semicolons. */
+void janet_profile_sample(JanetFiber *fiber) {
+    if (NULL == janet_vm_profile) return;
+    janet_vm_profile_pending = 0;
+    JanetStackFrame **frames = NULL;
+    int32_t i = fiber->frame;
+    while (i > 0) {
+        JanetStackFrame *frame = janet_stack_frame(fiber->data + i);
+        janet_v_push(frames, frame);
+        i = frame->prevframe;
+    }
+    JanetBuffer *buffer = &janet_vm_profile_scratch;
+    buffer->count = 0;
+    for (i = janet_v_count(frames) - 1; i >= 0; i--) {
+        profile_frame(buffer, frames[i]);
+        if (i) janet_buffer_push_u8(buffer, ';');
+    }
+    janet_v_free(frames);
+    Janet key = janet_stringv(buffer->data, buffer->count);
+    Janet count = janet_table_get(janet_vm_profile, key);
+    double n = janet_checktype(count, JANET_NUMBER) ? janet_unwrap_number(count) : 0;
+    janet_table_put(janet_vm_profile, key, janet_wrap_number(n + 1));
+}
+
+#ifdef JANET_POSIX
+static void profile_signal(int sig) {
+    (void) sig;
+    janet_vm_profile_pending = 1;
+}
+#endif
+
+/* Stop the timer and release the samples */
+void janet_profile_end(void) {
+    if (NULL == janet_vm_profile) return;
+#ifdef JANET_POSIX
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &janet_vm_profile_oldaction, NULL);
+    profile_lock();
+    janet_vm_profile_active = 0;
+    profile_unlock();
+#endif
+    janet_vm_profile_pending = 0;
+    janet_gcunroot_handle(janet_vm_profile_root);
+    janet_buffer_deinit(&janet_vm_profile_scratch);
+    janet_vm_profile_root = -1;
+    janet_vm_profile = NULL;
+}
+
+/* Count the vm threads, so the profiler can refuse to start while
+ * any thread other than its own is running */
+void janet_profile_init(void) {
+#ifdef JANET_POSIX
+    profile_lock();
+    janet_vm_profile_threads++;
+    profile_unlock();
+#endif
+}
+
+void janet_profile_deinit(void) {
+    janet_profile_end();
+#ifdef JANET_POSIX
+    profile_lock();
+    janet_vm_profile_threads--;
+    profile_unlock();
+#endif
+}
+
+static int profile_compare(const void *a, const void *b) {
+    return janet_compare(*(const Janet *)a, *(const Janet *)b);
+}
+
 /*
  * CFuns
  */
@@ -229,6 +379,7 @@ static Janet cfun_debug_lineage(int32_t argc, Janet *argv) {
     JanetFiber *fiber = janet_getfiber(argv, 0);
     JanetArray *array = janet_array(0);
     while (fiber) {
+        fiber->flags |= JANET_FIBER_FLAG_ESCAPED;
         janet_array_push(array, janet_wrap_fiber(fiber));
         fiber = fiber->child;
     }
@@ -321,6 +472,141 @@ static Janet cfun_debug_step(int32_t argc, Janet *argv) {
     return out;
 }
 
+static Janet cfun_debug_profile_start(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+    double interval = janet_optnumber(argv, argc, 0, 0.001);
+#ifdef JANET_POSIX
+    if (!(interval > 0)) janet_panic("expected positive interval");
+    profile_lock();
+    int active = janet_vm_profile_active;
+    int threads = janet_vm_profile_threads;
+    if (!active && threads <= 1) janet_vm_profile_active = 1;
+    profile_unlock();
+    if (active) janet_panic("profiler is already running");
+    if (threads > 1) janet_panic("cannot profile while other threads are running");
+    struct itimerval timer;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal;
+#ifdef SA_RESTART
+    action.sa_flags = SA_RESTART;
+#endif
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &janet_vm_profile_oldaction);
+    janet_vm_profile = janet_table(0);
+    janet_vm_profile_root = janet_gcroot_handle(janet_wrap_table(janet_vm_profile));
+    janet_buffer_init(&janet_vm_profile_scratch, 256);
+    timer.it_interval.tv_sec = (time_t) interval;
+    timer.it_interval.tv_usec = (suseconds_t)((interval - (double) timer.it_interval.tv_sec) * 1e6);
+    if (timer.it_interval.tv_sec == 0 && timer.it_interval.tv_usec == 0)
+        timer.it_interval.tv_usec = 1;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL)) {
+        janet_profile_end();
+        janet_panic("could not start profiling timer");
+    }
+    return janet_wrap_nil();
+#else
+    (void) interval;
+    janet_panic("profiler not supported on this platform");
+#endif
+}
+
+static Janet cfun_debug_profile_stop(int32_t argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 0);
+    JanetTable *profile = janet_vm_profile;
+    if (NULL == profile) janet_panic("profiler is not running");
+    janet_profile_end();
+    int32_t count = 0;
+    Janet *keys = janet_smalloc(sizeof(Janet) * (profile->count + 1));
+    for (int32_t i = 0; i < profile->capacity; i++) {
+        if (!janet_checktype(profile->data[i].key, JANET_NIL)) {
+            keys[count++] = profile->data[i].key;
+        }
+    }
+    qsort(keys, count, sizeof(Janet), profile_compare);
+    JanetBuffer *out = janet_buffer(64 * count);
+    for (int32_t i = 0; i < count; i++) {
+        janet_buffer_push_string(out, janet_unwrap_string(keys[i]));
+        janet_buffer_push_u8(out, ' ');
+        janet_buffer_push_cstring(out, (const char *) janet_to_string(janet_table_get(profile, keys[i])));
+        janet_buffer_push_u8(out, '\n');
+    }
+    janet_sfree(keys);
+    return janet_wrap_buffer(out);
+}
+
+#ifdef JANET_PROFILE_OPCODES
+
+static Janet cfun_debug_opcode_stats(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+    int reset = argc > 0 && janet_truthy(argv[0]);
+    JanetTable *stats = janet_table(0);
+    for (int op = 0; op < JOP_INSTRUCTION_COUNT; op++) {
+        if (!janet_vm_opcode_counts[op]) continue;
+        Janet key = janet_wrap_integer(op);
+#ifdef JANET_ASSEMBLER
+        const char *name = janet_opcode_name(op);
+        if (name) key = janet_ckeywordv(name);
+#endif
+        janet_table_put(stats, key, janet_wrap_number((double) janet_vm_opcode_counts[op]));
+        if (reset) janet_vm_opcode_counts[op] = 0;
+    }
+    return janet_wrap_table(stats);
+}
+
+static int func_stats_compare(const void *a, const void *b) {
+    uint64_t x = (*(JanetFuncDef * const *)a)->calls;
+    uint64_t y = (*(JanetFuncDef * const *)b)->calls;
+    return (x < y) - (x > y);
+}
+
+static Janet cfun_debug_func_stats(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+    int reset = argc > 0 && janet_truthy(argv[0]);
+    /* Find all called definitions before allocating */
+    JanetFuncDef **defs = NULL;
+    janet_sweep_finish();
+    JanetGCObject *current = janet_vm_blocks;
+    int scanned_old = 0;
+    while (NULL != current || !scanned_old) {
+        if (NULL == current) {
+            current = janet_vm_old_blocks;
+            scanned_old = 1;
+            continue;
+        }
+        if ((current->flags & JANET_MEM_TYPEBITS) == JANET_MEMORY_FUNCDEF) {
+            JanetFuncDef *def = (JanetFuncDef *)(current);
+            if (def->calls) janet_v_push(defs, def);
+        }
+        current = current->next;
+    }
+    int32_t count = janet_v_count(defs);
+    if (count) qsort(defs, count, sizeof(JanetFuncDef *), func_stats_compare);
+    JanetArray *array = janet_array(count);
+    for (int32_t i = 0; i < count; i++) {
+        JanetFuncDef *def = defs[i];
+        JanetTable *t = janet_table(4);
+        if (def->name) {
+            janet_table_put(t, janet_ckeywordv("name"), janet_wrap_string(def->name));
+        }
+        if (def->source) {
+            janet_table_put(t, janet_ckeywordv("source"), janet_wrap_string(def->source));
+        }
+        if (def->sourcemap && def->bytecode_length) {
+            janet_table_put(t, janet_ckeywordv("source-line"), janet_wrap_integer(def->sourcemap[0].line));
+        }
+        janet_table_put(t, janet_ckeywordv("calls"), janet_wrap_number((double) def->calls));
+        janet_array_push(array, janet_wrap_table(t));
+        if (reset) def->calls = 0;
+    }
+    janet_v_free(defs);
+    return janet_wrap_array(array);
+}
+
+#endif
+
 static const JanetReg debug_cfuns[] = {
     {
         "debug/break", cfun_debug_break,
@@ -343,7 +629,8 @@ static const JanetReg debug_cfuns[] = {
         JDOC("(debug/fbreak fun &opt pc)\n\n"
         "Set a breakpoint in a given function. pc is an optional offset, which "
         "is in bytecode instructions. fun is a function value. Will throw an error "
-        "if the offset is too large or negative.")
+        "if the offset is too large or negative. Calls to the function that were "
+        "already inlined by the compiler do not stop at the breakpoint.")
     },
     {
         "debug/unfbreak", cfun_debug_unfbreak,
@@ -396,6 +683,39 @@ static const JanetReg debug_cfuns[] = {
         "pass in a value that will be passed as the resuming value. Returns the signal value, "
         "which will usually be nil, as breakpoints raise nil signals.")
     },
+    {
+        "debug/profile-start", cfun_debug_profile_start,
+        JDOC("(debug/profile-start &opt interval)\n\n"
+        "Start the sampling profiler. Every interval seconds of CPU time (default 0.001), "
+        "the stack of the running fiber is sampled at the next function call or loop "
+        "iteration. Only one profiler can run at a time, and it cannot be started while "
+        "other threads are running. Returns nil.")
+    },
+    {
+        "debug/profile-stop", cfun_debug_profile_stop,
+        JDOC("(debug/profile-stop)\n\n"
+        "Stop the sampling profiler and return the samples as a buffer in the folded "
+        "stack format used by flame graph tools. Each line is a stack, from the outer "
+        "most frame to the inner most separated by semicolons, and the number of samples "
+        "that were taken of it.")
+    },
+#ifdef JANET_PROFILE_OPCODES
+    {
+        "debug/opcode-stats", cfun_debug_opcode_stats,
+        JDOC("(debug/opcode-stats &opt reset)\n\n"
+        "Get the number of times each bytecode instruction has been executed on the current "
+        "thread, as a table from instruction names to counts. If reset is truthy, the counts "
+        "start again from zero. Only available when Janet is built with JANET_PROFILE_OPCODES.")
+    },
+    {
+        "debug/func-stats", cfun_debug_func_stats,
+        JDOC("(debug/func-stats &opt reset)\n\n"
+        "Get the number of calls to each function definition that is still alive, as an array "
+        "of tables sorted by the number of calls. Each table contains :calls, and when known, "
+        ":name, :source, and :source-line. If reset is truthy, the counts start again from zero. "
+        "Only available when Janet is built with JANET_PROFILE_OPCODES.")
+    },
+#endif
     {NULL, NULL, NULL}
 };
 
@@ -27,6 +27,8 @@
 #include "regalloc.h"
 #endif
 
+#include <math.h>
+
 /* Get a register */
 int32_t janetc_allocfar(JanetCompiler *c) {
     int32_t reg = janetc_regalloc_1(&c->scope->ra);
@@ -48,7 +50,7 @@ void janetc_emit(JanetCompiler *c, uint32_t instr) {
 }
 
 /* Add a constant to the current scope. Return the index of the constant. */
-static int32_t janetc_const(JanetCompiler *c, Janet x) {
+int32_t janetc_const(JanetCompiler *c, Janet x) {
     JanetScope *scope = c->scope;
     int32_t i, len;
     /* Get the topmost function scope */
@@ -60,7 +62,10 @@ static int32_t janetc_const(JanetCompiler *c, Janet x) {
     /* Check if already added */
     len = janet_v_count(scope->consts);
     for (i = 0; i < len; i++) {
-        if (janet_equals(x, scope->consts[i]))
+        /* -0 equals 0, but is not the same constant */
+        if (janet_equals(x, scope->consts[i]) &&
+                (!janet_checktype(x, JANET_NUMBER) ||
+                 signbit(janet_unwrap_number(x)) == signbit(janet_unwrap_number(scope->consts[i]))))
             return i;
     }
     /* Ensure not too many constants. */
@@ -87,7 +92,7 @@ static void janetc_loadconst(JanetCompiler *c, Janet k, int32_t reg) {
             if (dval < INT16_MIN || dval > INT16_MAX)
                 goto do_constant;
             int32_t i = (int32_t) dval;
-            if (dval != i)
+            if (dval != i || (dval == 0 && signbit(dval)))
                 goto do_constant;
             uint32_t iu = (uint32_t)i;
             janetc_emit(c,
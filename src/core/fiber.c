@@ -28,8 +28,13 @@
 #include "util.h"
 #endif
 
+JANET_THREAD_LOCAL JanetFiberPool janet_vm_fiber_pool[JANET_FIBER_POOL_SIZE];
+JANET_THREAD_LOCAL int32_t janet_vm_fiber_pool_count;
+
 static void fiber_reset(JanetFiber *fiber) {
     fiber->maxstack = JANET_STACK_MAX;
+    fiber->fuel = 0;
+    fiber->arenas = 0;
     fiber->frame = 0;
     fiber->stackstart = JANET_FRAME_SIZE;
     fiber->stacktop = JANET_FRAME_SIZE;
@@ -41,10 +46,20 @@ static void fiber_reset(JanetFiber *fiber) {
 
 static JanetFiber *fiber_alloc(int32_t capacity) {
     Janet *data;
-    JanetFiber *fiber = janet_gcalloc(JANET_MEMORY_FIBER, sizeof(JanetFiber));
+    JanetFiber *fiber;
     if (capacity < 32) {
         capacity = 32;
     }
+    if (janet_vm_fiber_pool_count) {
+        JanetFiberPool entry = janet_vm_fiber_pool[--janet_vm_fiber_pool_count];
+        janet_gcunroot_handle(entry.handle);
+        fiber = entry.fiber;
+        if (fiber->capacity < capacity) {
+            janet_fiber_setcapacity(fiber, capacity);
+        }
+        return fiber;
+    }
+    fiber = janet_gcalloc(JANET_MEMORY_FIBER, sizeof(JanetFiber));
     fiber->capacity = capacity;
     data = malloc(sizeof(Janet) * capacity);
     if (NULL == data) {
@@ -77,6 +92,23 @@ JanetFiber *janet_fiber(JanetFunction *callee, int32_t capacity, int32_t argc, c
     return janet_fiber_reset(fiber_alloc(capacity), callee, argc, argv);
 }
 
+/* Return a fiber made with janet_fiber to the pool once it has run to
+ * completion. Only call this when the caller holds the only reference to
+ * the fiber. A fiber that finished normally has no open stack frames, so
+ * no closure environments still point in to its stack. */
+void janet_fiber_release(JanetFiber *fiber) {
+    if (janet_fiber_status(fiber) != JANET_STATUS_DEAD) return;
+    if (fiber->flags & JANET_FIBER_FLAG_ESCAPED) return;
+    if (janet_vm_fiber_pool_count >= JANET_FIBER_POOL_SIZE) return;
+    if (fiber->capacity > JANET_FIBER_POOL_STACK) {
+        janet_fiber_setcapacity(fiber, JANET_FIBER_POOL_STACK);
+    }
+    fiber_reset(fiber);
+    JanetFiberPool *entry = janet_vm_fiber_pool + janet_vm_fiber_pool_count++;
+    entry->fiber = fiber;
+    entry->handle = janet_gcroot_handle(janet_wrap_fiber(fiber));
+}
+
 /* Ensure that the fiber has enough extra capacity */
 void janet_fiber_setcapacity(JanetFiber *fiber, int32_t n) {
     Janet *newData = realloc(fiber->data, sizeof(Janet) * n);
@@ -163,6 +195,10 @@ int janet_fiber_funcframe(JanetFiber *fiber, JanetFunction *func) {
     if (next_arity < func->def->min_arity) return 1;
     if (next_arity > func->def->max_arity) return 1;
 
+#ifdef JANET_PROFILE_OPCODES
+    func->def->calls++;
+#endif
+
     if (fiber->capacity < nextstacktop) {
         janet_fiber_setcapacity(fiber, 2 * nextstacktop);
     }
@@ -222,6 +258,26 @@ static void janet_env_detach(JanetFuncEnv *env) {
     }
 }
 
+/* Drop the environment of a frame whose closures never outlive it. A
+ * closure that is reached anyway, such as through debug/stack, finds no
+ * upvalues instead of a stale stack. */
+static void janet_env_kill(JanetFuncEnv *env) {
+    if (env) {
+        env->offset = 0;
+        env->length = 0;
+        env->as.values = NULL;
+    }
+}
+
+/* Release the environment of a frame that is being popped or replaced */
+static void janet_env_release(JanetFunction *func, JanetFuncEnv *env) {
+    if (func->def->flags & JANET_FUNCDEF_FLAG_LOCALENV) {
+        janet_env_kill(env);
+    } else {
+        janet_env_detach(env);
+    }
+}
+
 /* Create a tail frame for a function */
 int janet_fiber_funcframe_tail(JanetFiber *fiber, JanetFunction *func) {
     int32_t i;
@@ -234,6 +290,10 @@ int janet_fiber_funcframe_tail(JanetFiber *fiber, JanetFunction *func) {
     if (next_arity < func->def->min_arity) return 1;
     if (next_arity > func->def->max_arity) return 1;
 
+#ifdef JANET_PROFILE_OPCODES
+    func->def->calls++;
+#endif
+
     if (fiber->capacity < nextstacktop) {
         janet_fiber_setcapacity(fiber, 2 * nextstacktop);
     }
@@ -243,7 +303,7 @@ int janet_fiber_funcframe_tail(JanetFiber *fiber, JanetFunction *func) {
 
     /* Detach old function */
     if (NULL != janet_fiber_frame(fiber)->func)
-        janet_env_detach(janet_fiber_frame(fiber)->env);
+        janet_env_release(janet_fiber_frame(fiber)->func, janet_fiber_frame(fiber)->env);
     janet_fiber_frame(fiber)->env = NULL;
 
     /* Check varargs */
@@ -321,7 +381,7 @@ void janet_fiber_popframe(JanetFiber *fiber) {
 
     /* Clean up the frame (detach environments) */
     if (NULL != frame->func)
-        janet_env_detach(frame->env);
+        janet_env_release(frame->func, frame->env);
 
     /* Shrink stack */
     fiber->stacktop = fiber->stackstart = fiber->frame;
@@ -332,7 +392,26 @@ JanetFiberStatus janet_fiber_status(JanetFiber *f) {
     return ((f)->flags & JANET_FIBER_STATUS_MASK) >> JANET_FIBER_STATUS_OFFSET;
 }
 
+/* Give a fiber a budget of calls and backward jumps. When it runs out, the
+ * fiber is interrupted with JANET_SIGNAL_INTERRUPT and can be resumed after
+ * more fuel is added. A negative amount removes the budget. */
+void janet_fiber_setfuel(JanetFiber *fiber, int32_t fuel) {
+    if (fuel < 0) {
+        fiber->flags &= ~JANET_FIBER_FLAG_FUEL;
+        fiber->fuel = 0;
+    } else {
+        fiber->flags |= JANET_FIBER_FLAG_FUEL;
+        fiber->fuel = fuel;
+    }
+}
+
+/* Get the fuel left in a fiber, or -1 if it has no budget */
+int32_t janet_fiber_fuel(JanetFiber *fiber) {
+    return (fiber->flags & JANET_FIBER_FLAG_FUEL) ? fiber->fuel : -1;
+}
+
 JanetFiber *janet_current_fiber(void) {
+    if (janet_vm_fiber) janet_vm_fiber->flags |= JANET_FIBER_FLAG_ESCAPED;
     return janet_vm_fiber;
 }
 
@@ -376,12 +455,13 @@ static Janet cfun_fiber_new(int32_t argc, Janet *argv) {
             } else {
                 switch (view.bytes[i]) {
                     default:
-                        janet_panicf("invalid flag %c, expected a, d, e, u, or y", view.bytes[i]);
+                        janet_panicf("invalid flag %c, expected a, d, e, t, u, or y", view.bytes[i]);
                         break;
                     case 'a':
                         fiber->flags |=
                             JANET_FIBER_MASK_DEBUG |
                             JANET_FIBER_MASK_ERROR |
+                            JANET_FIBER_MASK_INTERRUPT |
                             JANET_FIBER_MASK_USER |
                             JANET_FIBER_MASK_YIELD;
                         break;
@@ -391,6 +471,9 @@ static Janet cfun_fiber_new(int32_t argc, Janet *argv) {
                     case 'e':
                         fiber->flags |= JANET_FIBER_MASK_ERROR;
                         break;
+                    case 't':
+                        fiber->flags |= JANET_FIBER_MASK_INTERRUPT;
+                        break;
                     case 'u':
                         fiber->flags |= JANET_FIBER_MASK_USER;
                         break;
@@ -427,6 +510,7 @@ static Janet cfun_fiber_status(int32_t argc, Janet *argv) {
 static Janet cfun_fiber_current(int32_t argc, Janet *argv) {
     (void) argv;
     janet_fixarity(argc, 0);
+    janet_vm_fiber->flags |= JANET_FIBER_FLAG_ESCAPED;
     return janet_wrap_fiber(janet_vm_fiber);
 }
 
@@ -447,6 +531,28 @@ static Janet cfun_fiber_setmaxstack(int32_t argc, Janet *argv) {
     return argv[0];
 }
 
+static Janet cfun_fiber_fuel(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    JanetFiber *fiber = janet_getfiber(argv, 0);
+    int32_t fuel = janet_fiber_fuel(fiber);
+    return fuel < 0 ? janet_wrap_nil() : janet_wrap_integer(fuel);
+}
+
+static Janet cfun_fiber_setfuel(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    JanetFiber *fiber = janet_getfiber(argv, 0);
+    if (janet_checktype(argv[1], JANET_NIL)) {
+        janet_fiber_setfuel(fiber, -1);
+    } else {
+        int32_t fuel = janet_getinteger(argv, 1);
+        if (fuel < 0) {
+            janet_panic("expected non-negative integer");
+        }
+        janet_fiber_setfuel(fiber, fuel);
+    }
+    return argv[0];
+}
+
 static const JanetReg fiber_cfuns[] = {
     {
         "fiber/new", cfun_fiber_new,
@@ -462,6 +568,7 @@ static const JanetReg fiber_cfuns[] = {
         "\ta - block all signals\n"
         "\td - block debug signals\n"
         "\te - block error signals\n"
+        "\tt - block interrupt signals\n"
         "\tu - block user signals\n"
         "\ty - block yield signals\n"
         "\t0-9 - block a specific user signal\n\n"
@@ -479,6 +586,7 @@ static const JanetReg fiber_cfuns[] = {
         "\t:debug - the fiber is suspended in debug mode\n"
         "\t:pending - the fiber has been yielded\n"
         "\t:user(0-9) - the fiber is suspended by a user signal\n"
+        "\t:interrupted - the fiber ran out of fuel and can be resumed\n"
         "\t:alive - the fiber is currently running and cannot be resumed\n"
         "\t:new - the fiber has just been created and not yet run")
     },
@@ -500,6 +608,21 @@ static const JanetReg fiber_cfuns[] = {
         "Sets the maximum stack size in janet values for a fiber. By default, the "
         "maximum stack size is usually 8192.")
     },
+    {
+        "fiber/fuel", cfun_fiber_fuel,
+        JDOC("(fiber/fuel fib)\n\n"
+        "Gets the fuel left in a fiber, or nil if the fiber has no fuel budget.")
+    },
+    {
+        "fiber/setfuel", cfun_fiber_setfuel,
+        JDOC("(fiber/setfuel fib fuel)\n\n"
+        "Sets the fuel budget of a fiber. Each call to a janet function and each backward jump "
+        "uses one unit of fuel, and a fiber with no fuel left is interrupted "
+        "before its next call or backward jump. Fibers resumed by a fiber with a budget "
+        "use fuel from that budget too. An interrupted fiber has status "
+        ":interrupted and can be resumed once it is given more fuel. Set to nil "
+        "to remove the budget.")
+    },
     {
         "fiber/getenv", cfun_fiber_getenv,
         JDOC("(fiber/getenv fiber)\n\n"
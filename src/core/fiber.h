@@ -34,6 +34,13 @@ extern JANET_THREAD_LOCAL JanetFiber *janet_vm_fiber;
     (f)->flags |= (s) << JANET_FIBER_STATUS_OFFSET;\
 } while (0)
 
+/* Set on fibers that may be referenced from janet code. Such fibers are
+ * never returned to the fiber pool. */
+#define JANET_FIBER_FLAG_ESCAPED 0x1000000
+
+/* Set on fibers with a fuel budget */
+#define JANET_FIBER_FLAG_FUEL 0x2000000
+
 #define janet_stack_frame(s) ((JanetStackFrame *)((s) - JANET_FRAME_SIZE))
 #define janet_fiber_frame(f) janet_stack_frame((f)->data + (f)->frame)
 void janet_fiber_setcapacity(JanetFiber *fiber, int32_t n);
@@ -45,5 +52,6 @@ int janet_fiber_funcframe(JanetFiber *fiber, JanetFunction *func);
 int janet_fiber_funcframe_tail(JanetFiber *fiber, JanetFunction *func);
 void janet_fiber_cframe(JanetFiber *fiber, JanetCFunction cfun);
 void janet_fiber_popframe(JanetFiber *fiber);
+void janet_fiber_release(JanetFiber *fiber);
 
 #endif
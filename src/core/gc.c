@@ -25,19 +25,66 @@
 #include "state.h"
 #include "symcache.h"
 #include "gc.h"
+#include "jit.h"
 #include "util.h"
 #endif
 
+#include <time.h>
+
+#ifdef JANET_GC_THREAD
+#ifdef JANET_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
 /* GC State */
 JANET_THREAD_LOCAL void *janet_vm_blocks;
+JANET_THREAD_LOCAL void *janet_vm_old_blocks;
+JANET_THREAD_LOCAL void *janet_vm_gc_unswept;
 JANET_THREAD_LOCAL uint32_t janet_vm_gc_interval;
 JANET_THREAD_LOCAL uint32_t janet_vm_next_collection;
 JANET_THREAD_LOCAL int janet_vm_gc_suspend = 0;
 
+/* Collection policy */
+JANET_THREAD_LOCAL JanetGCPolicy janet_vm_gc_policy;
+JANET_THREAD_LOCAL double janet_vm_gc_growth;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_min_interval;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_max_interval;
+
+/* Arena state */
+JANET_THREAD_LOCAL int32_t janet_vm_gc_arena;
+
+/* Generational state */
+JANET_THREAD_LOCAL JanetGCObject **janet_vm_gc_remembered;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_remembered_count;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_remembered_capacity;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_old_count;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_promoted;
+
+/* Incremental state */
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_step;
+JANET_THREAD_LOCAL int janet_vm_gc_marking;
+JANET_THREAD_LOCAL JanetGCObject **janet_vm_gc_gray;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_gray_count;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_gray_capacity;
+JANET_THREAD_LOCAL JanetGCObject **janet_vm_gc_rescan;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_rescan_count;
+JANET_THREAD_LOCAL uint32_t janet_vm_gc_rescan_capacity;
+
 /* Roots */
 JANET_THREAD_LOCAL Janet *janet_vm_roots;
 JANET_THREAD_LOCAL uint32_t janet_vm_root_count;
 JANET_THREAD_LOCAL uint32_t janet_vm_root_capacity;
+JANET_THREAD_LOCAL Janet *janet_vm_root_handle_values;
+JANET_THREAD_LOCAL int32_t *janet_vm_root_handle_owners;
+JANET_THREAD_LOCAL uint32_t janet_vm_root_handle_count;
+JANET_THREAD_LOCAL uint32_t janet_vm_root_handle_capacity;
+JANET_THREAD_LOCAL int32_t *janet_vm_root_handle_slots;
+JANET_THREAD_LOCAL uint32_t janet_vm_root_handle_slot_count;
+JANET_THREAD_LOCAL uint32_t janet_vm_root_handle_slot_capacity;
+JANET_THREAD_LOCAL int32_t janet_vm_root_handle_free;
 
 /* Scratch Memory */
 #ifdef JANET_64
@@ -51,211 +98,725 @@ JANET_THREAD_LOCAL void **janet_scratch_mem;
 JANET_THREAD_LOCAL size_t janet_scratch_cap;
 JANET_THREAD_LOCAL size_t janet_scratch_len;
 
-/* Helpers for marking the various gc types */
-static void janet_mark_funcenv(JanetFuncEnv *env);
-static void janet_mark_funcdef(JanetFuncDef *def);
-static void janet_mark_function(JanetFunction *func);
-static void janet_mark_array(JanetArray *array);
-static void janet_mark_table(JanetTable *table);
-static void janet_mark_struct(const JanetKV *st);
-static void janet_mark_tuple(const Janet *tuple);
-static void janet_mark_buffer(JanetBuffer *buffer);
-static void janet_mark_string(const uint8_t *str);
-static void janet_mark_fiber(JanetFiber *fiber);
-static void janet_mark_abstract(void *adata);
-
-/* Local state that is only temporary */
-static JANET_THREAD_LOCAL uint32_t depth = JANET_RECURSION_GUARD;
-static JANET_THREAD_LOCAL uint32_t orig_rootcount;
-
-/* Mark a value */
-void janet_mark(Janet x) {
-    if (depth) {
-        depth--;
-        switch (janet_type(x)) {
-            default:
-                break;
-            case JANET_STRING:
-            case JANET_KEYWORD:
-            case JANET_SYMBOL:
-                janet_mark_string(janet_unwrap_string(x));
-                break;
-            case JANET_FUNCTION:
-                janet_mark_function(janet_unwrap_function(x));
-                break;
-            case JANET_ARRAY:
-                janet_mark_array(janet_unwrap_array(x));
-                break;
-            case JANET_TABLE:
-                janet_mark_table(janet_unwrap_table(x));
-                break;
-            case JANET_STRUCT:
-                janet_mark_struct(janet_unwrap_struct(x));
-                break;
-            case JANET_TUPLE:
-                janet_mark_tuple(janet_unwrap_tuple(x));
-                break;
-            case JANET_BUFFER:
-                janet_mark_buffer(janet_unwrap_buffer(x));
-                break;
-            case JANET_FIBER:
-                janet_mark_fiber(janet_unwrap_fiber(x));
-                break;
-            case JANET_ABSTRACT:
-                janet_mark_abstract(janet_unwrap_abstract(x));
-                break;
-        }
-        depth++;
-    } else {
-        janet_gcroot(x);
+/* Weak tables reached during marking, to be cleaned up before sweeping */
+static JANET_THREAD_LOCAL JanetGCObject **janet_vm_gc_weak;
+static JANET_THREAD_LOCAL uint32_t janet_vm_gc_weak_count;
+static JANET_THREAD_LOCAL uint32_t janet_vm_gc_weak_capacity;
+
+/* Collection statistics */
+static JANET_THREAD_LOCAL JanetGCStats janet_vm_gc_stats;
+
+/* Names of the memory types, indexed by enum JanetMemoryType */
+const char *const janet_gc_type_names[JANET_GC_TYPE_COUNT] = {
+    "none",
+    "string",
+    "symbol",
+    "array",
+    "tuple",
+    "table",
+    "struct",
+    "fiber",
+    "buffer",
+    "function",
+    "abstract",
+    "funcenv",
+    "funcdef"
+};
+
+/* Flags that stop the marker from descending into an object. During a
+ * minor collection, old objects are treated as if they were already reached. */
+static JANET_THREAD_LOCAL int32_t skipmask = JANET_MEM_REACHABLE;
+
+static void janet_gc_shade(JanetGCObject *mem);
+static JanetGCObject *janet_gc_object(Janet x);
+static int32_t janet_gc_scan(JanetGCObject *mem);
+
+/* Hint that a block is about to be marked or scanned. */
+#ifdef __GNUC__
+#define janet_gc_prefetch(m) __builtin_prefetch((m), 1)
+#else
+#define janet_gc_prefetch(m) ((void) 0)
+#endif
+
+/* How many values ahead to prefetch when shading the contents of an object */
+#define JANET_GC_PREFETCH_DISTANCE 4
+
+/* Size class allocator for small blocks. Most gc objects are small and of
+ * only a few distinct sizes, so they are allocated from pages of equally sized
+ * cells instead of going through malloc one by one. Freed cells are threaded
+ * into a free list per size class through the header's next pointer. Pages are
+ * aligned to their size, so the page of a cell is found by masking its address,
+ * and count their live cells. Pages left empty once the old generation has
+ * been swept are returned to the system. */
+#define JANET_SLAB_CLASSES 8
+#define JANET_SLAB_PAGE_SIZE 0x4000
+#define JANET_SLAB_PAGE_HEADER 16
+#define JANET_SLAB_MAX 160
+
+typedef struct JanetSlabPage JanetSlabPage;
+struct JanetSlabPage {
+    JanetSlabPage *next;
+    int32_t live; /* Cells in use, or -1 while the page is being released */
+    int32_t sizeclass;
+};
+
+typedef struct {
+    JanetGCObject *free;
+    JanetSlabPage *page;
+    char *bump;
+    char *end;
+} JanetSlabClass;
+
+static const uint32_t janet_slab_sizes[JANET_SLAB_CLASSES] = {
+    0, 32, 48, 64, 80, 96, 128, 160
+};
+
+/* Size class indexed by size in 16 byte units, rounded up */
+static const uint8_t janet_slab_lookup[(JANET_SLAB_MAX >> 4) + 1] = {
+    1, 1, 1, 2, 3, 4, 5, 6, 6, 7, 7
+};
+
+static JANET_THREAD_LOCAL JanetSlabClass janet_vm_slabs[JANET_SLAB_CLASSES];
+static JANET_THREAD_LOCAL JanetSlabPage *janet_vm_slab_pages;
+static JANET_THREAD_LOCAL size_t janet_vm_slab_page_count;
+
+#define janet_slab_page(mem) \
+    ((JanetSlabPage *)((uintptr_t)(mem) & ~(uintptr_t)(JANET_SLAB_PAGE_SIZE - 1)))
+
+static JanetSlabPage *janet_slab_page_alloc(void) {
+    void *page;
+#ifdef JANET_WINDOWS
+    page = _aligned_malloc(JANET_SLAB_PAGE_SIZE, JANET_SLAB_PAGE_SIZE);
+#else
+    if (posix_memalign(&page, JANET_SLAB_PAGE_SIZE, JANET_SLAB_PAGE_SIZE)) page = NULL;
+#endif
+    if (NULL == page) {
+        JANET_OUT_OF_MEMORY;
     }
+    janet_vm_slab_page_count++;
+    return (JanetSlabPage *) page;
 }
 
-static void janet_mark_string(const uint8_t *str) {
-    janet_gc_mark(janet_string_head(str));
+static void janet_slab_page_free(JanetSlabPage *page) {
+    janet_vm_slab_page_count--;
+#ifdef JANET_WINDOWS
+    _aligned_free(page);
+#else
+    free(page);
+#endif
 }
 
-static void janet_mark_buffer(JanetBuffer *buffer) {
-    janet_gc_mark(buffer);
+/* Get a cell of the given size class */
+static JanetGCObject *janet_slab_alloc(int sizeclass) {
+    JanetSlabClass *slab = janet_vm_slabs + sizeclass;
+    JanetGCObject *mem = slab->free;
+    if (NULL != mem) {
+        slab->free = mem->next;
+        janet_slab_page(mem)->live++;
+        return mem;
+    }
+    if (slab->bump == slab->end) {
+        uint32_t cellsize = janet_slab_sizes[sizeclass];
+        uint32_t ncells = (JANET_SLAB_PAGE_SIZE - JANET_SLAB_PAGE_HEADER) / cellsize;
+        JanetSlabPage *page = janet_slab_page_alloc();
+        page->next = janet_vm_slab_pages;
+        page->live = 0;
+        page->sizeclass = sizeclass;
+        janet_vm_slab_pages = page;
+        slab->page = page;
+        slab->bump = (char *) page + JANET_SLAB_PAGE_HEADER;
+        slab->end = slab->bump + ncells * cellsize;
+    }
+    mem = (JanetGCObject *) slab->bump;
+    slab->bump += janet_slab_sizes[sizeclass];
+    slab->page->live++;
+    return mem;
 }
 
-static void janet_mark_abstract(void *adata) {
-    if (janet_gc_reachable(janet_abstract_head(adata)))
-        return;
-    janet_gc_mark(janet_abstract_head(adata));
-    if (janet_abstract_head(adata)->type->gcmark) {
-        janet_abstract_head(adata)->type->gcmark(adata, janet_abstract_size(adata));
+/* Release the pages with no live cells, except the pages still being
+ * carved up. Their cells are taken out of the free lists first. */
+static void janet_slab_trim(void) {
+    JanetSlabPage *page;
+    JanetSlabPage **link;
+    int any = 0;
+    for (page = janet_vm_slab_pages; NULL != page; page = page->next) {
+        if (page->live == 0 && page != janet_vm_slabs[page->sizeclass].page) {
+            page->live = -1;
+            any = 1;
+        }
+    }
+    if (!any) return;
+    for (int i = 1; i < JANET_SLAB_CLASSES; i++) {
+        JanetGCObject **cell = &janet_vm_slabs[i].free;
+        while (NULL != *cell) {
+            if (janet_slab_page(*cell)->live < 0) {
+                *cell = (*cell)->next;
+            } else {
+                cell = &(*cell)->next;
+            }
+        }
+    }
+    link = &janet_vm_slab_pages;
+    while (NULL != (page = *link)) {
+        if (page->live < 0) {
+            *link = page->next;
+            janet_slab_page_free(page);
+        } else {
+            link = &page->next;
+        }
     }
 }
 
-/* Mark a bunch of items in memory */
-static void janet_mark_many(const Janet *values, int32_t n) {
-    const Janet *end = values + n;
-    while (values < end) {
-        janet_mark(*values);
-        values += 1;
+/* Free all size class pages */
+static void janet_slab_clear(void) {
+    JanetSlabPage *page = janet_vm_slab_pages;
+    while (NULL != page) {
+        JanetSlabPage *next = page->next;
+        janet_slab_page_free(page);
+        page = next;
     }
+    janet_vm_slab_pages = NULL;
+    memset(janet_vm_slabs, 0, sizeof(janet_vm_slabs));
 }
 
-/* Mark a bunch of key values items in memory */
-static void janet_mark_kvs(const JanetKV *kvs, int32_t n) {
-    const JanetKV *end = kvs + n;
-    while (kvs < end) {
-        janet_mark(kvs->key);
-        janet_mark(kvs->value);
-        kvs++;
+#ifdef JANET_GC_THREAD
+
+/* Memory released by the sweeper is handed off in batches to a helper
+ * thread that frees it, so the mutator does not wait on free. Only raw
+ * memory goes through the helper. Finalizers of abstract types, symbol
+ * deinitialization and size class cells stay on the owning thread. */
+#define JANET_GC_RELEASE_BATCH 256
+
+typedef struct JanetReleaseBatch JanetReleaseBatch;
+struct JanetReleaseBatch {
+    JanetReleaseBatch *next;
+    int32_t count;
+    void *ptrs[JANET_GC_RELEASE_BATCH];
+};
+
+typedef struct {
+#ifdef JANET_WINDOWS
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE cond;
+    HANDLE handle;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t handle;
+#endif
+    JanetReleaseBatch *queue;
+    int closed;
+} JanetGCThread;
+
+static JANET_THREAD_LOCAL JanetGCThread *janet_vm_gc_thread;
+static JANET_THREAD_LOCAL JanetReleaseBatch *janet_vm_gc_batch;
+
+static void janet_gc_thread_lock(JanetGCThread *gct) {
+#ifdef JANET_WINDOWS
+    EnterCriticalSection(&gct->lock);
+#else
+    pthread_mutex_lock(&gct->lock);
+#endif
+}
+
+static void janet_gc_thread_unlock(JanetGCThread *gct) {
+#ifdef JANET_WINDOWS
+    LeaveCriticalSection(&gct->lock);
+#else
+    pthread_mutex_unlock(&gct->lock);
+#endif
+}
+
+static void janet_gc_thread_signal(JanetGCThread *gct) {
+#ifdef JANET_WINDOWS
+    WakeConditionVariable(&gct->cond);
+#else
+    pthread_cond_signal(&gct->cond);
+#endif
+}
+
+/* Free batches until the owning thread closes the queue */
+static void janet_gc_thread_main(JanetGCThread *gct) {
+    for (;;) {
+        JanetReleaseBatch *batch;
+        janet_gc_thread_lock(gct);
+        while (NULL == gct->queue && !gct->closed) {
+#ifdef JANET_WINDOWS
+            SleepConditionVariableCS(&gct->cond, &gct->lock, INFINITE);
+#else
+            pthread_cond_wait(&gct->cond, &gct->lock);
+#endif
+        }
+        batch = gct->queue;
+        gct->queue = NULL;
+        janet_gc_thread_unlock(gct);
+        if (NULL == batch) return;
+        while (NULL != batch) {
+            JanetReleaseBatch *next = batch->next;
+            for (int32_t i = 0; i < batch->count; i++)
+                free(batch->ptrs[i]);
+            free(batch);
+            batch = next;
+        }
     }
 }
 
-static void janet_mark_array(JanetArray *array) {
-    if (janet_gc_reachable(array))
-        return;
-    janet_gc_mark(array);
-    janet_mark_many(array->data, array->count);
+#ifdef JANET_WINDOWS
+static DWORD WINAPI janet_gc_thread_wrapper(LPVOID param) {
+    janet_gc_thread_main((JanetGCThread *) param);
+    return 0;
 }
+#else
+static void *janet_gc_thread_wrapper(void *param) {
+    janet_gc_thread_main((JanetGCThread *) param);
+    return NULL;
+}
+#endif
 
-static void janet_mark_table(JanetTable *table) {
-recur: /* Manual tail recursion */
-    if (janet_gc_reachable(table))
-        return;
-    janet_gc_mark(table);
-    janet_mark_kvs(table->data, table->capacity);
-    if (table->proto) {
-        table = table->proto;
-        goto recur;
+/* Start the helper thread. Returns NULL if it could not be started,
+ * in which case memory is freed on the owning thread. */
+static JanetGCThread *janet_gc_thread_start(void) {
+    JanetGCThread *gct = malloc(sizeof(JanetGCThread));
+    if (NULL == gct) {
+        JANET_OUT_OF_MEMORY;
+    }
+    gct->queue = NULL;
+    gct->closed = 0;
+#ifdef JANET_WINDOWS
+    InitializeCriticalSection(&gct->lock);
+    InitializeConditionVariable(&gct->cond);
+    gct->handle = CreateThread(NULL, 0, janet_gc_thread_wrapper, gct, 0, NULL);
+    if (NULL == gct->handle) {
+        DeleteCriticalSection(&gct->lock);
+        free(gct);
+        return NULL;
+    }
+#else
+    pthread_mutex_init(&gct->lock, NULL);
+    pthread_cond_init(&gct->cond, NULL);
+    if (pthread_create(&gct->handle, NULL, janet_gc_thread_wrapper, gct)) {
+        pthread_mutex_destroy(&gct->lock);
+        pthread_cond_destroy(&gct->cond);
+        free(gct);
+        return NULL;
     }
+#endif
+    return gct;
 }
 
-static void janet_mark_struct(const JanetKV *st) {
-    if (janet_gc_reachable(janet_struct_head(st)))
+/* Hand the current batch off to the helper thread */
+static void janet_gc_flush_batch(void) {
+    JanetReleaseBatch *batch = janet_vm_gc_batch;
+    if (NULL == batch) return;
+    janet_vm_gc_batch = NULL;
+    if (NULL == janet_vm_gc_thread)
+        janet_vm_gc_thread = janet_gc_thread_start();
+    if (NULL == janet_vm_gc_thread) {
+        for (int32_t i = 0; i < batch->count; i++)
+            free(batch->ptrs[i]);
+        free(batch);
         return;
-    janet_gc_mark(janet_struct_head(st));
-    janet_mark_kvs(st, janet_struct_capacity(st));
+    }
+    janet_gc_thread_lock(janet_vm_gc_thread);
+    batch->next = janet_vm_gc_thread->queue;
+    janet_vm_gc_thread->queue = batch;
+    janet_gc_thread_signal(janet_vm_gc_thread);
+    janet_gc_thread_unlock(janet_vm_gc_thread);
 }
 
-static void janet_mark_tuple(const Janet *tuple) {
-    if (janet_gc_reachable(janet_tuple_head(tuple)))
-        return;
-    janet_gc_mark(janet_tuple_head(tuple));
-    janet_mark_many(tuple, janet_tuple_length(tuple));
+/* Queue memory to be freed by the helper thread */
+static void janet_gc_release(void *ptr) {
+    JanetReleaseBatch *batch = janet_vm_gc_batch;
+    if (NULL == ptr) return;
+    if (NULL == batch) {
+        batch = malloc(sizeof(JanetReleaseBatch));
+        if (NULL == batch) {
+            free(ptr);
+            return;
+        }
+        batch->count = 0;
+        janet_vm_gc_batch = batch;
+    }
+    batch->ptrs[batch->count++] = ptr;
+    if (batch->count == JANET_GC_RELEASE_BATCH)
+        janet_gc_flush_batch();
 }
 
-/* Helper to mark function environments */
-static void janet_mark_funcenv(JanetFuncEnv *env) {
-    if (janet_gc_reachable(env))
-        return;
-    janet_gc_mark(env);
-    if (env->offset) {
-        /* On stack */
-        janet_mark_fiber(env->as.fiber);
+/* Free everything still queued and stop the helper thread */
+static void janet_gc_thread_stop(void) {
+    JanetGCThread *gct;
+    janet_gc_flush_batch();
+    gct = janet_vm_gc_thread;
+    if (NULL == gct) return;
+    janet_vm_gc_thread = NULL;
+    janet_gc_thread_lock(gct);
+    gct->closed = 1;
+    janet_gc_thread_signal(gct);
+    janet_gc_thread_unlock(gct);
+#ifdef JANET_WINDOWS
+    WaitForSingleObject(gct->handle, INFINITE);
+    CloseHandle(gct->handle);
+    DeleteCriticalSection(&gct->lock);
+#else
+    pthread_join(gct->handle, NULL);
+    pthread_mutex_destroy(&gct->lock);
+    pthread_cond_destroy(&gct->cond);
+#endif
+    free(gct);
+}
+
+#else
+
+#define janet_gc_release(p) free(p)
+
+#endif
+
+/* Release the memory of a block. Does not deinitialize it. */
+static void janet_gc_free(JanetGCObject *mem) {
+    int sizeclass = (mem->flags & JANET_MEM_SIZECLASS) >> JANET_MEM_SIZECLASS_SHIFT;
+    if (sizeclass) {
+        JanetSlabClass *slab = janet_vm_slabs + sizeclass;
+        janet_slab_page(mem)->live--;
+        mem->next = slab->free;
+        slab->free = mem;
     } else {
-        /* Not on stack */
-        janet_mark_many(env->as.values, env->length);
+        janet_gc_release(mem);
     }
 }
 
-/* GC helper to mark a FuncDef */
-static void janet_mark_funcdef(JanetFuncDef *def) {
-    int32_t i;
-    if (janet_gc_reachable(def))
-        return;
-    janet_gc_mark(def);
-    janet_mark_many(def->constants, def->constants_length);
-    for (i = 0; i < def->defs_length; ++i) {
-        janet_mark_funcdef(def->defs[i]);
+/* Mark a value. Objects are shaded gray and pushed on to the gray stack instead
+ * of being marked recursively, so marking uses a constant amount of C stack
+ * whatever the shape of the object graph. */
+void janet_mark(Janet x) {
+    JanetGCObject *mem = janet_gc_object(x);
+    if (NULL != mem) janet_gc_shade(mem);
+}
+
+/* Check if an old object must always be scanned during minor collections. These
+ * types are mutated in too many places to put a write barrier on each of them. */
+static int janet_gc_always_remembered(JanetGCObject *mem) {
+    switch (mem->flags & JANET_MEM_TYPEBITS) {
+        default:
+            return 0;
+        case JANET_MEMORY_ARRAY:
+        case JANET_MEMORY_FIBER:
+        case JANET_MEMORY_FUNCENV:
+            return 1;
+        case JANET_MEMORY_ABSTRACT:
+            return NULL != ((JanetAbstractHead *) mem)->type->gcmark;
     }
-    if (def->source)
-        janet_mark_string(def->source);
-    if (def->name)
-        janet_mark_string(def->name);
 }
 
-static void janet_mark_function(JanetFunction *func) {
-    int32_t i;
-    int32_t numenvs;
-    if (janet_gc_reachable(func))
-        return;
-    janet_gc_mark(func);
-    numenvs = func->def->environments_length;
-    for (i = 0; i < numenvs; ++i) {
-        janet_mark_funcenv(func->envs[i]);
+/* Add an old object to the remembered set */
+static void janet_gc_remember(JanetGCObject *mem) {
+    if (janet_vm_gc_remembered_count == janet_vm_gc_remembered_capacity) {
+        uint32_t newcap = 2 * janet_vm_gc_remembered_capacity + 16;
+        JanetGCObject **newmem = realloc(janet_vm_gc_remembered, sizeof(JanetGCObject *) * newcap);
+        if (NULL == newmem) {
+            JANET_OUT_OF_MEMORY;
+        }
+        janet_vm_gc_remembered = newmem;
+        janet_vm_gc_remembered_capacity = newcap;
     }
-    janet_mark_funcdef(func->def);
+    mem->flags |= JANET_MEM_REMEMBERED;
+    janet_vm_gc_remembered[janet_vm_gc_remembered_count++] = mem;
 }
 
-static void janet_mark_fiber(JanetFiber *fiber) {
-    int32_t i, j;
-    JanetStackFrame *frame;
-recur:
-    if (janet_gc_reachable(fiber))
+/* Push an object on to one of the gray stack or the rescan list */
+static void janet_gc_push(JanetGCObject ***stack, uint32_t *count, uint32_t *capacity,
+                          JanetGCObject *mem) {
+    if (*count == *capacity) {
+        uint32_t newcap = 2 * *capacity + 64;
+        JanetGCObject **newmem = realloc(*stack, sizeof(JanetGCObject *) * newcap);
+        if (NULL == newmem) {
+            JANET_OUT_OF_MEMORY;
+        }
+        *stack = newmem;
+        *capacity = newcap;
+    }
+    (*stack)[(*count)++] = mem;
+}
+
+/* Get the gc header of a value, or NULL if the value is not garbage collected */
+static JanetGCObject *janet_gc_object(Janet x) {
+    switch (janet_type(x)) {
+        default:
+            return NULL;
+        case JANET_STRING:
+        case JANET_KEYWORD:
+        case JANET_SYMBOL:
+            return janet_gc_header(janet_string_head(janet_unwrap_string(x)));
+        case JANET_STRUCT:
+            return janet_gc_header(janet_struct_head(janet_unwrap_struct(x)));
+        case JANET_TUPLE:
+            return janet_gc_header(janet_tuple_head(janet_unwrap_tuple(x)));
+        case JANET_ABSTRACT:
+            return janet_gc_header(janet_abstract_head(janet_unwrap_abstract(x)));
+        case JANET_FUNCTION:
+        case JANET_ARRAY:
+        case JANET_TABLE:
+        case JANET_BUFFER:
+        case JANET_FIBER:
+            return janet_gc_header(janet_unwrap_pointer(x));
+    }
+}
+
+/* Shade a white object gray. Objects without references go straight to black. */
+static void janet_gc_shade(JanetGCObject *mem) {
+    if (mem->flags & skipmask)
         return;
-    janet_gc_mark(fiber);
+    mem->flags |= JANET_MEM_REACHABLE;
+    switch (mem->flags & JANET_MEM_TYPEBITS) {
+        default:
+            break;
+        case JANET_MEMORY_STRING:
+        case JANET_MEMORY_SYMBOL:
+        case JANET_MEMORY_BUFFER:
+            return;
+        case JANET_MEMORY_ABSTRACT:
+            if (NULL == ((JanetAbstractHead *) mem)->type->gcmark)
+                return;
+            break;
+    }
+    mem->flags |= JANET_MEM_GRAY;
+    janet_gc_push(&janet_vm_gc_gray, &janet_vm_gc_gray_count, &janet_vm_gc_gray_capacity, mem);
+}
 
-    /* Mark values on the argument stack */
-    janet_mark_many(fiber->data + fiber->stackstart,
-                    fiber->stacktop - fiber->stackstart);
+/* Prefetch the gc header of a value, if it has one */
+static void janet_gc_prefetch_value(Janet x) {
+    JanetGCObject *mem = janet_gc_object(x);
+    if (NULL != mem) janet_gc_prefetch(mem);
+}
 
-    i = fiber->frame;
-    j = fiber->stackstart - JANET_FRAME_SIZE;
-    while (i > 0) {
-        frame = (JanetStackFrame *)(fiber->data + i - JANET_FRAME_SIZE);
-        if (NULL != frame->func)
-            janet_mark_function(frame->func);
-        if (NULL != frame->env)
-            janet_mark_funcenv(frame->env);
-        /* Mark all values in the stack frame */
-        janet_mark_many(fiber->data + i, j - i);
-        j = i - JANET_FRAME_SIZE;
-        i = frame->prevframe;
+static void janet_gc_shade_many(const Janet *values, int32_t n) {
+    for (int32_t i = 0; i < n; i++) {
+        if (i + JANET_GC_PREFETCH_DISTANCE < n)
+            janet_gc_prefetch_value(values[i + JANET_GC_PREFETCH_DISTANCE]);
+        janet_mark(values[i]);
+    }
+}
+
+static void janet_gc_shade_kvs(const JanetKV *kvs, int32_t n) {
+    for (int32_t i = 0; i < n; i++) {
+        if (i + JANET_GC_PREFETCH_DISTANCE < n) {
+            janet_gc_prefetch_value(kvs[i + JANET_GC_PREFETCH_DISTANCE].key);
+            janet_gc_prefetch_value(kvs[i + JANET_GC_PREFETCH_DISTANCE].value);
+        }
+        janet_mark(kvs[i].key);
+        janet_mark(kvs[i].value);
+    }
+}
+
+/* Scan gray objects until the gray stack is empty, or until about budget units
+ * of work have been done. The object below the top of the stack is prefetched
+ * while the top one is scanned. */
+static void janet_gc_drain(int64_t budget) {
+    int64_t work = 0;
+    while (janet_vm_gc_gray_count && work < budget) {
+        JanetGCObject *mem = janet_vm_gc_gray[--janet_vm_gc_gray_count];
+        if (janet_vm_gc_gray_count)
+            janet_gc_prefetch(janet_vm_gc_gray[janet_vm_gc_gray_count - 1]);
+        work += janet_gc_scan(mem);
+    }
+}
+
+/* Add an object to the rescan list of the current incremental cycle */
+static void janet_gc_rescan(JanetGCObject *mem) {
+    if (janet_vm_gc_marking)
+        janet_gc_push(&janet_vm_gc_rescan, &janet_vm_gc_rescan_count, &janet_vm_gc_rescan_capacity, mem);
+}
+
+/* Check if a value can be held weakly. Only values compared by identity
+ * can be, as any other value could be recreated after being collected. */
+static int janet_gc_weakref(Janet x) {
+    switch (janet_type(x)) {
+        default:
+            return 0;
+        case JANET_ARRAY:
+        case JANET_TABLE:
+        case JANET_BUFFER:
+        case JANET_FIBER:
+        case JANET_FUNCTION:
+        case JANET_ABSTRACT:
+            return 1;
+    }
+}
+
+/* Check if a weakly held value was not reached by the marker */
+static int janet_gc_weakdead(Janet x) {
+    return janet_gc_weakref(x) &&
+           !(janet_gc_object(x)->flags & (skipmask | JANET_MEM_DISABLED));
+}
+
+/* Check if the value of a weak table entry must be marked. A weakly held key
+ * keeps its value alive only once the key itself has been reached, so a value
+ * that refers back to its own key does not keep the entry alive. */
+static int janet_gc_weakmark(int32_t weak, const JanetKV *kv) {
+    if ((weak & JANET_TABLE_WEAK_VALUES) && janet_gc_weakref(kv->value)) return 0;
+    return !(weak & JANET_TABLE_WEAK_KEYS) || !janet_gc_weakdead(kv->key);
+}
+
+/* Mark the values of the weak key tables reached during marking whose keys
+ * have since been reached. Marking a value may reach more keys, so repeat
+ * until no more values are marked. */
+static void janet_gc_mark_ephemerons(void) {
+    int progress;
+    do {
+        progress = 0;
+        for (uint32_t i = 0; i < janet_vm_gc_weak_count; i++) {
+            JanetTable *table = (JanetTable *) janet_vm_gc_weak[i];
+            int32_t weak = table->gc.flags & (JANET_TABLE_WEAK_KEYS | JANET_TABLE_WEAK_VALUES);
+            if (!(weak & JANET_TABLE_WEAK_KEYS)) continue;
+            for (int32_t j = 0; j < table->capacity; j++) {
+                JanetKV *kv = table->data + j;
+                JanetGCObject *mem = janet_gc_object(kv->value);
+                if (NULL == mem || (mem->flags & skipmask)) continue;
+                if (janet_checktype(kv->key, JANET_NIL) || !janet_gc_weakmark(weak, kv)) continue;
+                janet_gc_shade(mem);
+                progress = 1;
+            }
+        }
+        janet_gc_drain(INT64_MAX);
+    } while (progress);
+}
+
+/* Remove the entries of the weak tables reached during marking
+ * whose weakly held keys or values were not reached. */
+static void janet_gc_clear_weak(void) {
+    janet_gc_mark_ephemerons();
+    for (uint32_t i = 0; i < janet_vm_gc_weak_count; i++) {
+        JanetTable *table = (JanetTable *) janet_vm_gc_weak[i];
+        int32_t weak = table->gc.flags & (JANET_TABLE_WEAK_KEYS | JANET_TABLE_WEAK_VALUES);
+        for (int32_t j = 0; j < table->capacity; j++) {
+            JanetKV *kv = table->data + j;
+            if (janet_checktype(kv->key, JANET_NIL)) continue;
+            if (((weak & JANET_TABLE_WEAK_KEYS) && janet_gc_weakdead(kv->key)) ||
+                    ((weak & JANET_TABLE_WEAK_VALUES) && janet_gc_weakdead(kv->value))) {
+                janet_icache_touch(table);
+                kv->key = janet_wrap_nil();
+                kv->value = janet_wrap_false();
+                table->count--;
+                table->deleted++;
+            }
+        }
     }
+    janet_vm_gc_weak_count = 0;
+}
 
-    if (fiber->env)
-        janet_mark_table(fiber->env);
+/* Blacken a gray object by shading everything it references. Fibers, function
+ * environments and abstract types are mutated without a write barrier, so during
+ * an incremental cycle they are also added to the rescan list to be scanned again
+ * before sweeping. Returns a rough measure of the work done. */
+static int32_t janet_gc_scan(JanetGCObject *mem) {
+    mem->flags &= ~JANET_MEM_GRAY;
+    switch (mem->flags & JANET_MEM_TYPEBITS) {
+        default:
+            return 1;
+        case JANET_MEMORY_ARRAY: {
+            JanetArray *array = (JanetArray *) mem;
+            janet_gc_shade_many(array->data, array->count);
+            return 1 + array->count;
+        }
+        case JANET_MEMORY_TUPLE: {
+            JanetTupleHead *head = (JanetTupleHead *) mem;
+            janet_gc_shade_many(head->data, head->length);
+            return 1 + head->length;
+        }
+        case JANET_MEMORY_TABLE: {
+            JanetTable *table = (JanetTable *) mem;
+            int32_t weak = mem->flags & (JANET_TABLE_WEAK_KEYS | JANET_TABLE_WEAK_VALUES);
+            if (weak) {
+                janet_gc_push(&janet_vm_gc_weak, &janet_vm_gc_weak_count, &janet_vm_gc_weak_capacity, mem);
+                for (int32_t i = 0; i < table->capacity; i++) {
+                    JanetKV *kv = table->data + i;
+                    if (!(weak & JANET_TABLE_WEAK_KEYS) || !janet_gc_weakref(kv->key))
+                        janet_mark(kv->key);
+                    if (janet_gc_weakmark(weak, kv))
+                        janet_mark(kv->value);
+                }
+            } else {
+                janet_gc_shade_kvs(table->data, table->capacity);
+            }
+            if (table->proto)
+                janet_gc_shade(janet_gc_header(table->proto));
+            return 1 + table->capacity;
+        }
+        case JANET_MEMORY_STRUCT: {
+            JanetStructHead *head = (JanetStructHead *) mem;
+            janet_gc_shade_kvs(head->data, head->capacity);
+            return 1 + head->capacity;
+        }
+        case JANET_MEMORY_FUNCTION: {
+            JanetFunction *func = (JanetFunction *) mem;
+            int32_t numenvs = func->def->environments_length;
+            for (int32_t i = 0; i < numenvs; i++)
+                janet_gc_shade(janet_gc_header(func->envs[i]));
+            janet_gc_shade(janet_gc_header(func->def));
+            return 1 + numenvs;
+        }
+        case JANET_MEMORY_FUNCDEF: {
+            JanetFuncDef *def = (JanetFuncDef *) mem;
+            janet_gc_shade_many(def->constants, def->constants_length);
+            for (int32_t i = 0; i < def->defs_length; i++)
+                janet_gc_shade(janet_gc_header(def->defs[i]));
+            if (def->source)
+                janet_gc_shade(janet_gc_header(janet_string_head(def->source)));
+            if (def->name)
+                janet_gc_shade(janet_gc_header(janet_string_head(def->name)));
+            return 1 + def->constants_length + def->defs_length;
+        }
+        case JANET_MEMORY_FUNCENV: {
+            JanetFuncEnv *env = (JanetFuncEnv *) mem;
+            janet_gc_rescan(mem);
+            if (env->offset) {
+                janet_gc_shade(janet_gc_header(env->as.fiber));
+                return 1;
+            }
+            janet_gc_shade_many(env->as.values, env->length);
+            return 1 + env->length;
+        }
+        case JANET_MEMORY_FIBER: {
+            JanetFiber *fiber = (JanetFiber *) mem;
+            int32_t i = fiber->frame;
+            int32_t j = fiber->stackstart - JANET_FRAME_SIZE;
+            janet_gc_rescan(mem);
+            janet_gc_shade_many(fiber->data + fiber->stackstart,
+                                fiber->stacktop - fiber->stackstart);
+            while (i > 0) {
+                JanetStackFrame *frame = (JanetStackFrame *)(fiber->data + i - JANET_FRAME_SIZE);
+                if (NULL != frame->func)
+                    janet_gc_shade(janet_gc_header(frame->func));
+                if (NULL != frame->env)
+                    janet_gc_shade(janet_gc_header(frame->env));
+                janet_gc_shade_many(fiber->data + i, j - i);
+                j = i - JANET_FRAME_SIZE;
+                i = frame->prevframe;
+            }
+            if (fiber->env)
+                janet_gc_shade(janet_gc_header(fiber->env));
+            if (fiber->child)
+                janet_gc_shade(janet_gc_header(fiber->child));
+            return 1 + fiber->stacktop;
+        }
+        case JANET_MEMORY_ABSTRACT: {
+            JanetAbstractHead *head = (JanetAbstractHead *) mem;
+            janet_gc_rescan(mem);
+            head->type->gcmark(head->data, head->size);
+            return 1;
+        }
+    }
+}
 
-    /* Explicit tail recursion */
-    if (fiber->child) {
-        fiber = fiber->child;
-        goto recur;
+/* Write barrier slow path. Old objects are added to the remembered set, and
+ * objects that have already been scanned in the current incremental cycle are
+ * shaded gray again so that they will be scanned a second time. */
+void janet_gc_barrier_slow(JanetGCObject *mem) {
+    if ((mem->flags & (JANET_MEM_OLD | JANET_MEM_REMEMBERED)) == JANET_MEM_OLD)
+        janet_gc_remember(mem);
+    if (janet_vm_gc_marking &&
+            (mem->flags & (JANET_MEM_REACHABLE | JANET_MEM_GRAY)) == JANET_MEM_REACHABLE) {
+        mem->flags |= JANET_MEM_GRAY;
+        janet_gc_push(&janet_vm_gc_gray, &janet_vm_gc_gray_count, &janet_vm_gc_gray_capacity, mem);
     }
 }
 
@@ -269,16 +830,17 @@ static void janet_deinit_block(JanetGCObject *mem) {
             janet_symbol_deinit(((JanetStringHead *) mem)->data);
             break;
         case JANET_MEMORY_ARRAY:
-            free(((JanetArray *) mem)->data);
+            janet_gc_release(((JanetArray *) mem)->data);
             break;
         case JANET_MEMORY_TABLE:
-            free(((JanetTable *) mem)->data);
+            janet_icache_touch((JanetTable *) mem);
+            janet_gc_release(((JanetTable *) mem)->data);
             break;
         case JANET_MEMORY_FIBER:
-            free(((JanetFiber *)mem)->data);
+            janet_gc_release(((JanetFiber *)mem)->data);
             break;
         case JANET_MEMORY_BUFFER:
-            janet_buffer_deinit((JanetBuffer *) mem);
+            janet_gc_release(((JanetBuffer *) mem)->data);
             break;
         case JANET_MEMORY_ABSTRACT: {
             JanetAbstractHead *head = (JanetAbstractHead *)mem;
@@ -290,61 +852,213 @@ static void janet_deinit_block(JanetGCObject *mem) {
         case JANET_MEMORY_FUNCENV: {
             JanetFuncEnv *env = (JanetFuncEnv *)mem;
             if (0 == env->offset)
-                free(env->as.values);
+                janet_gc_release(env->as.values);
         }
         break;
         case JANET_MEMORY_FUNCDEF: {
             JanetFuncDef *def = (JanetFuncDef *)mem;
             /* TODO - get this all with one alloc and one free */
-            free(def->defs);
-            free(def->environments);
-            free(def->constants);
-            free(def->bytecode);
-            free(def->sourcemap);
+            janet_gc_release(def->defs);
+            janet_gc_release(def->environments);
+            janet_gc_release(def->constants);
+            janet_gc_release(def->bytecode);
+            janet_gc_release(def->sourcemap);
+#ifdef JANET_JIT
+            janet_jit_free(def);
+#endif
         }
         break;
     }
 }
 
-/* Iterate over all allocated memory, and free memory that is not
- * marked as reachable. Flip the gc color flag for next sweep. */
-void janet_sweep() {
-    JanetGCObject *previous = NULL;
+/* Get the number of bytes used by a block, including memory it owns */
+static size_t janet_gc_blocksize(JanetGCObject *mem) {
+    switch (mem->flags & JANET_MEM_TYPEBITS) {
+        default:
+            return sizeof(JanetGCObject);
+        case JANET_MEMORY_STRING:
+        case JANET_MEMORY_SYMBOL:
+            return sizeof(JanetStringHead) + ((JanetStringHead *) mem)->length + 1;
+        case JANET_MEMORY_ARRAY:
+            return sizeof(JanetArray) + ((JanetArray *) mem)->capacity * sizeof(Janet);
+        case JANET_MEMORY_TUPLE:
+            return sizeof(JanetTupleHead) + ((JanetTupleHead *) mem)->length * sizeof(Janet);
+        case JANET_MEMORY_TABLE:
+            return sizeof(JanetTable) + ((JanetTable *) mem)->capacity * sizeof(JanetKV);
+        case JANET_MEMORY_STRUCT:
+            return sizeof(JanetStructHead) + ((JanetStructHead *) mem)->capacity * sizeof(JanetKV);
+        case JANET_MEMORY_FIBER:
+            return sizeof(JanetFiber) + ((JanetFiber *) mem)->capacity * sizeof(Janet);
+        case JANET_MEMORY_BUFFER:
+            return sizeof(JanetBuffer) + ((JanetBuffer *) mem)->capacity;
+        case JANET_MEMORY_FUNCTION:
+            return sizeof(JanetFunction) +
+                   ((JanetFunction *) mem)->def->environments_length * sizeof(JanetFuncEnv *);
+        case JANET_MEMORY_ABSTRACT:
+            return sizeof(JanetAbstractHead) + ((JanetAbstractHead *) mem)->size;
+        case JANET_MEMORY_FUNCENV: {
+            JanetFuncEnv *env = (JanetFuncEnv *) mem;
+            return sizeof(JanetFuncEnv) + (env->offset ? 0 : env->length * sizeof(Janet));
+        }
+        case JANET_MEMORY_FUNCDEF: {
+            JanetFuncDef *def = (JanetFuncDef *) mem;
+            size_t size = sizeof(JanetFuncDef) +
+                          def->bytecode_length * sizeof(uint32_t) +
+                          def->constants_length * sizeof(Janet) +
+                          def->defs_length * sizeof(JanetFuncDef *) +
+                          def->environments_length * sizeof(int32_t);
+            if (def->sourcemap)
+                size += def->bytecode_length * sizeof(JanetSourceMapping);
+            return size;
+        }
+    }
+}
+
+/* Count a block that survived a collection in the statistics */
+static void janet_gc_count_live(JanetGCObject *mem) {
+    int type = mem->flags & JANET_MEM_TYPEBITS;
+    size_t size = janet_gc_blocksize(mem);
+    janet_vm_gc_stats.live_count++;
+    janet_vm_gc_stats.live_bytes += size;
+    janet_vm_gc_stats.type_counts[type]++;
+    janet_vm_gc_stats.type_bytes[type] += size;
+}
+
+/* Move a surviving young block into the old generation. */
+static void janet_gc_promote(JanetGCObject *mem) {
+    janet_gc_count_live(mem);
+    mem->flags |= JANET_MEM_OLD;
+    mem->next = janet_vm_old_blocks;
+    janet_vm_old_blocks = mem;
+    janet_vm_gc_promoted++;
+    if (janet_gc_always_remembered(mem))
+        janet_gc_remember(mem);
+}
+
+/* Free all young memory that is not marked as reachable, and promote
+ * the rest to the old generation. */
+static void janet_sweep_young(void) {
     JanetGCObject *current = janet_vm_blocks;
     JanetGCObject *next;
     while (NULL != current) {
         next = current->next;
         if (current->flags & (JANET_MEM_REACHABLE | JANET_MEM_DISABLED)) {
-            previous = current;
             current->flags &= ~JANET_MEM_REACHABLE;
+            janet_gc_promote(current);
         } else {
             janet_deinit_block(current);
-            if (NULL != previous) {
-                previous->next = next;
-            } else {
-                janet_vm_blocks = next;
-            }
-            free(current);
+            janet_gc_free(current);
         }
         current = next;
     }
+    janet_vm_blocks = NULL;
+}
+
+/* With the adaptive policy, collect again once the program has allocated
+ * a fraction of the live heap, within the configured bounds. The live heap is
+ * only known once the old generation has been swept. */
+static void janet_gc_adapt(void) {
+    double interval;
+    if (janet_vm_gc_policy != JANET_GC_POLICY_ADAPTIVE) return;
+    if (NULL != janet_vm_gc_unswept) return;
+    interval = janet_vm_gc_growth * (double) janet_vm_gc_stats.live_bytes;
+    if (interval < janet_vm_gc_min_interval) interval = janet_vm_gc_min_interval;
+    if (interval > janet_vm_gc_max_interval) interval = janet_vm_gc_max_interval;
+    janet_vm_gc_interval = (uint32_t) interval;
 }
 
+/* Sweep up to n of the old blocks left over from the last full collection.
+ * Live blocks go back to the old generation and dead ones are freed. The
+ * unswept list is advanced before each block is deinitialized, as finalizers
+ * may allocate and so sweep again. */
+static void janet_sweep_lazy(uint32_t n) {
+    JanetGCObject *current;
+    int swept = NULL != janet_vm_gc_unswept;
+    while (n-- && NULL != (current = janet_vm_gc_unswept)) {
+        janet_vm_gc_unswept = current->next;
+        if (current->flags & (JANET_MEM_REACHABLE | JANET_MEM_DISABLED)) {
+            current->flags &= ~JANET_MEM_REACHABLE;
+            current->next = janet_vm_old_blocks;
+            janet_vm_old_blocks = current;
+            janet_vm_gc_old_count++;
+            janet_gc_count_live(current);
+        } else {
+            janet_deinit_block(current);
+            janet_gc_free(current);
+        }
+    }
+    if (NULL == janet_vm_gc_unswept) {
+        janet_gc_adapt();
+        if (swept) janet_slab_trim();
+    }
+}
+
+/* Sweep the old generation completely */
+void janet_sweep_finish(void) {
+    janet_sweep_lazy(UINT32_MAX);
+}
+
+/* Start sweeping after a full collection. The young generation is swept
+ * right away, but old blocks are only swept a few at a time as memory is
+ * allocated, so the mutator does not wait on the whole heap. */
+void janet_sweep() {
+    uint32_t i, j;
+    janet_sweep_finish();
+    /* Drop dead objects from the remembered set. Everything young is
+     * promoted below, so tables no longer need to be remembered either. */
+    for (i = 0, j = 0; i < janet_vm_gc_remembered_count; i++) {
+        JanetGCObject *mem = janet_vm_gc_remembered[i];
+        if ((mem->flags & (JANET_MEM_REACHABLE | JANET_MEM_DISABLED)) &&
+                janet_gc_always_remembered(mem)) {
+            janet_vm_gc_remembered[j++] = mem;
+        } else {
+            mem->flags &= ~JANET_MEM_REMEMBERED;
+        }
+    }
+    janet_vm_gc_remembered_count = j;
+    janet_vm_gc_stats.collections++;
+    janet_vm_gc_stats.live_count = 0;
+    janet_vm_gc_stats.live_bytes = 0;
+    memset(janet_vm_gc_stats.type_counts, 0, sizeof(janet_vm_gc_stats.type_counts));
+    memset(janet_vm_gc_stats.type_bytes, 0, sizeof(janet_vm_gc_stats.type_bytes));
+    janet_vm_gc_unswept = janet_vm_old_blocks;
+    janet_vm_old_blocks = NULL;
+    janet_vm_gc_promoted = 0;
+    janet_sweep_young();
+    janet_vm_gc_old_count = janet_vm_gc_promoted;
+    janet_vm_gc_promoted = 0;
+    if (NULL == janet_vm_gc_unswept) janet_slab_trim();
+}
+
+/* Number of old blocks swept per allocation while a sweep is pending */
+#define JANET_GC_SWEEP_STEP 8
+
 /* Allocate some memory that is tracked for garbage collection */
 void *janet_gcalloc(enum JanetMemoryType type, size_t size) {
     JanetGCObject *mem;
 
     /* Make sure everything is inited */
     janet_assert(NULL != janet_vm_cache, "please initialize janet before use");
-    mem = malloc(size);
 
-    /* Check for bad malloc */
-    if (NULL == mem) {
-        JANET_OUT_OF_MEMORY;
-    }
+    /* Pay for the allocation by sweeping a few old blocks */
+    if (NULL != janet_vm_gc_unswept)
+        janet_sweep_lazy(JANET_GC_SWEEP_STEP);
+
+    if (size <= JANET_SLAB_MAX) {
+        int sizeclass = janet_slab_lookup[(size + 15) >> 4];
+        mem = janet_slab_alloc(sizeclass);
+        mem->flags = type | (sizeclass << JANET_MEM_SIZECLASS_SHIFT);
+    } else {
+        mem = malloc(size);
+
+        /* Check for bad malloc */
+        if (NULL == mem) {
+            JANET_OUT_OF_MEMORY;
+        }
 
-    /* Configure block */
-    mem->flags = type;
+        /* Configure block */
+        mem->flags = type;
+    }
 
     /* Prepend block to heap list */
     janet_vm_next_collection += (int32_t) size;
@@ -369,23 +1083,204 @@ static void janet_free_all_scratch(void) {
     janet_scratch_len = 0;
 }
 
-/* Run garbage collection */
-void janet_collect(void) {
+/* Mark all gc roots */
+static void janet_mark_roots(void) {
     uint32_t i;
-    if (janet_vm_gc_suspend) return;
-    depth = JANET_RECURSION_GUARD;
-    orig_rootcount = janet_vm_root_count;
-    for (i = 0; i < orig_rootcount; i++)
+    for (i = 0; i < janet_vm_root_count; i++)
         janet_mark(janet_vm_roots[i]);
-    while (orig_rootcount < janet_vm_root_count) {
-        Janet x = janet_vm_roots[--janet_vm_root_count];
-        janet_mark(x);
+    for (i = 0; i < janet_vm_root_handle_count; i++)
+        janet_mark(janet_vm_root_handle_values[i]);
+}
+
+/* Finish an incremental cycle atomically. The roots and the objects on the
+ * rescan list may have changed since they were scanned, so scan them again
+ * before sweeping. */
+static void janet_gc_finish(void) {
+    uint32_t i, n = janet_vm_gc_rescan_count;
+    janet_mark_roots();
+    for (i = 0; i < n; i++)
+        janet_gc_scan(janet_vm_gc_rescan[i]);
+    janet_gc_drain(INT64_MAX);
+    janet_gc_clear_weak();
+    janet_vm_gc_rescan_count = 0;
+    janet_vm_gc_marking = 0;
+    janet_sweep();
+    janet_gc_adapt();
+    janet_vm_next_collection = 0;
+    janet_free_all_scratch();
+}
+
+/* Do one bounded step of incremental marking, and finish the cycle
+ * once there are no gray objects left. */
+static void janet_gc_markstep(void) {
+    janet_gc_drain(janet_vm_gc_step);
+    if (janet_vm_gc_gray_count) {
+        janet_vm_next_collection = 0;
+    } else {
+        janet_gc_finish();
+    }
+}
+
+/* Get the time in seconds, for measuring pauses */
+static double janet_gc_clock(void) {
+    struct timespec tv;
+    if (janet_gettime(&tv)) return 0;
+    return tv.tv_sec + (tv.tv_nsec / 1E9);
+}
+
+/* Record a pause of the mutator that started at the given time */
+static void janet_gc_pause(double start) {
+    double pause = janet_gc_clock() - start;
+    janet_vm_gc_stats.pause_total += pause;
+    if (pause > janet_vm_gc_stats.pause_max)
+        janet_vm_gc_stats.pause_max = pause;
+}
+
+/* Mark and sweep everything */
+static void janet_collect_full(void) {
+    if (janet_vm_gc_marking) {
+        janet_gc_finish();
+        return;
     }
+    janet_sweep_finish();
+    janet_mark_roots();
+    janet_gc_drain(INT64_MAX);
+    janet_gc_clear_weak();
     janet_sweep();
+    janet_gc_adapt();
     janet_vm_next_collection = 0;
     janet_free_all_scratch();
 }
 
+/* Mark and sweep the young generation */
+static void janet_collect_young(void) {
+    uint32_t i, j;
+    if (janet_vm_gc_marking) {
+        janet_gc_finish();
+        return;
+    }
+    skipmask = JANET_MEM_REACHABLE | JANET_MEM_OLD;
+    janet_mark_roots();
+    /* Old objects in the remembered set are scanned, but not marked, as
+     * they are not swept by minor collections. */
+    for (i = 0; i < janet_vm_gc_remembered_count; i++)
+        janet_gc_scan(janet_vm_gc_remembered[i]);
+    janet_gc_drain(INT64_MAX);
+    janet_gc_clear_weak();
+    skipmask = JANET_MEM_REACHABLE;
+    /* Tables that went through the write barrier only need to stay
+     * remembered until the young objects they reference are promoted. */
+    for (i = 0, j = 0; i < janet_vm_gc_remembered_count; i++) {
+        JanetGCObject *mem = janet_vm_gc_remembered[i];
+        if (janet_gc_always_remembered(mem)) {
+            janet_vm_gc_remembered[j++] = mem;
+        } else {
+            mem->flags &= ~JANET_MEM_REMEMBERED;
+        }
+    }
+    janet_vm_gc_remembered_count = j;
+    janet_sweep_young();
+    janet_vm_gc_stats.minor_collections++;
+    janet_gc_adapt();
+    janet_vm_next_collection = 0;
+    janet_free_all_scratch();
+}
+
+/* Run garbage collection */
+void janet_collect(void) {
+    double start;
+    if (janet_vm_gc_suspend) return;
+    start = janet_gc_clock();
+    janet_collect_full();
+    janet_gc_pause(start);
+}
+
+/* Run a minor collection. Only the young generation is marked and swept,
+ * starting from the roots and the remembered set. */
+void janet_collect_minor(void) {
+    double start;
+    if (janet_vm_gc_suspend) return;
+    start = janet_gc_clock();
+    janet_collect_young();
+    janet_gc_pause(start);
+}
+
+/* Do a full collection once the old generation has roughly doubled
+ * in size since the last one, otherwise only collect young objects. In
+ * incremental mode, full collections are spread over many steps. */
+void janet_gcstep(void) {
+    double start;
+    if (janet_vm_gc_suspend) return;
+    /* Inside an arena, young objects are left for janet_arena_end to
+     * collect all at once, unless the arena grows too large. */
+    if (*janet_arena_depth() && janet_vm_next_collection < janet_vm_gc_max_interval) return;
+    start = janet_gc_clock();
+    if (janet_vm_gc_marking) {
+        janet_gc_markstep();
+    } else if (NULL == janet_vm_gc_unswept &&
+               janet_vm_gc_promoted > janet_vm_gc_old_count) {
+        if (janet_vm_gc_step) {
+            janet_vm_gc_marking = 1;
+            janet_mark_roots();
+            janet_gc_markstep();
+        } else {
+            janet_collect_full();
+        }
+    } else {
+        janet_collect_young();
+    }
+    janet_gc_pause(start);
+}
+
+/* Get the depth of the arenas open in the running fiber. Each fiber keeps
+ * its own, so fibers that take turns can each be inside an arena. */
+int32_t *janet_arena_depth(void) {
+    return janet_vm_fiber ? &janet_vm_fiber->arenas : &janet_vm_gc_arena;
+}
+
+/* Begin an arena. Objects allocated until the matching janet_arena_end are
+ * kept in the young generation, and whatever is not reachable by then is
+ * freed in one minor collection, while the rest is promoted to the old
+ * generation. A minor collection is also run here so that the arena starts
+ * out empty. Only the running fiber holds off automatic collections; other
+ * fibers still collect, which promotes the arena's objects early but frees
+ * nothing still in use. Like janet_collect, both must only be called when
+ * everything live is reachable from the gc roots. Returns a handle for
+ * janet_arena_end, which must be called from the same fiber. */
+int janet_arena_begin(void) {
+    janet_collect_minor();
+    return (*janet_arena_depth())++;
+}
+
+/* End an arena started with janet_arena_begin */
+void janet_arena_end(int handle) {
+    *janet_arena_depth() = handle;
+    janet_collect_minor();
+}
+
+/* Choose how the collection interval is set. With the fixed policy, the interval
+ * is whatever was set with gcsetinterval. With the adaptive policy, it is the
+ * growth fraction of the live heap after each collection, clamped between
+ * min_interval and max_interval. */
+void janet_gcsetpolicy(JanetGCPolicy policy, double growth,
+                       uint32_t min_interval, uint32_t max_interval) {
+    janet_vm_gc_policy = policy;
+    janet_vm_gc_growth = growth;
+    janet_vm_gc_min_interval = min_interval;
+    janet_vm_gc_max_interval = max_interval;
+    janet_gc_adapt();
+}
+
+/* Get statistics about the garbage collector. Finishes any pending sweep
+ * so that the live counts are up to date. */
+void janet_gcstats(JanetGCStats *stats) {
+    janet_sweep_finish();
+    *stats = janet_vm_gc_stats;
+    stats->bytes_since_collection = janet_vm_next_collection;
+    stats->root_count = janet_vm_root_count + janet_vm_root_handle_count;
+    stats->page_count = janet_vm_slab_page_count;
+}
+
 /* Add a root value to the GC. This prevents the GC from removing a value
  * and all of its children. If gcroot is called on a value n times, unroot
  * must also be called n times to remove it as a gc root. */
@@ -447,16 +1342,116 @@ int janet_gcunrootall(Janet root) {
     return ret;
 }
 
-/* Free all allocated memory */
-void janet_clear_memory(void) {
-    JanetGCObject *current = janet_vm_blocks;
+/* Add a root value to the GC, and return a handle to remove it with
+ * janet_gcunroot_handle. Unlike janet_gcunroot, removing a root by handle
+ * takes constant time however many roots there are. Root values are kept
+ * densely packed so that marking only touches roots in use, and each handle
+ * maps to the index of its value. Free handles are linked together, and
+ * stored as negative numbers. */
+int32_t janet_gcroot_handle(Janet root) {
+    int32_t handle;
+    uint32_t index = janet_vm_root_handle_count;
+    if (index == janet_vm_root_handle_capacity) {
+        uint32_t newcap = 2 * index + 16;
+        Janet *values = realloc(janet_vm_root_handle_values, sizeof(Janet) * newcap);
+        int32_t *owners = realloc(janet_vm_root_handle_owners, sizeof(int32_t) * newcap);
+        if (NULL == values || NULL == owners) {
+            JANET_OUT_OF_MEMORY;
+        }
+        janet_vm_root_handle_values = values;
+        janet_vm_root_handle_owners = owners;
+        janet_vm_root_handle_capacity = newcap;
+    }
+    if (janet_vm_root_handle_free >= 0) {
+        handle = janet_vm_root_handle_free;
+        janet_vm_root_handle_free = -2 - janet_vm_root_handle_slots[handle];
+    } else {
+        if (janet_vm_root_handle_slot_count == janet_vm_root_handle_slot_capacity) {
+            uint32_t newcap = 2 * janet_vm_root_handle_slot_capacity + 16;
+            int32_t *slots = realloc(janet_vm_root_handle_slots, sizeof(int32_t) * newcap);
+            if (NULL == slots) {
+                JANET_OUT_OF_MEMORY;
+            }
+            janet_vm_root_handle_slots = slots;
+            janet_vm_root_handle_slot_capacity = newcap;
+        }
+        handle = (int32_t) janet_vm_root_handle_slot_count++;
+    }
+    janet_vm_root_handle_values[index] = root;
+    janet_vm_root_handle_owners[index] = handle;
+    janet_vm_root_handle_slots[handle] = (int32_t) index;
+    janet_vm_root_handle_count++;
+    return handle;
+}
+
+/* Remove a root added with janet_gcroot_handle. Returns 0 if the
+ * handle was not in use, 1 otherwise. */
+int janet_gcunroot_handle(int32_t handle) {
+    int32_t index, last;
+    if (handle < 0 || (uint32_t) handle >= janet_vm_root_handle_slot_count) return 0;
+    index = janet_vm_root_handle_slots[handle];
+    if (index < 0) return 0;
+    last = (int32_t) --janet_vm_root_handle_count;
+    janet_vm_root_handle_values[index] = janet_vm_root_handle_values[last];
+    janet_vm_root_handle_owners[index] = janet_vm_root_handle_owners[last];
+    janet_vm_root_handle_slots[janet_vm_root_handle_owners[index]] = index;
+    janet_vm_root_handle_slots[handle] = -2 - janet_vm_root_handle_free;
+    janet_vm_root_handle_free = handle;
+    return 1;
+}
+
+/* Free a list of blocks */
+static void janet_free_blocks(JanetGCObject *current) {
     while (NULL != current) {
         janet_deinit_block(current);
         JanetGCObject *next = current->next;
-        free(current);
+        janet_gc_free(current);
         current = next;
     }
+}
+
+/* Free all allocated memory */
+void janet_clear_memory(void) {
+    janet_free_blocks(janet_vm_blocks);
+    janet_free_blocks(janet_vm_old_blocks);
+    janet_free_blocks(janet_vm_gc_unswept);
     janet_vm_blocks = NULL;
+    janet_vm_old_blocks = NULL;
+    janet_vm_gc_unswept = NULL;
+    janet_slab_clear();
+#ifdef JANET_GC_THREAD
+    janet_gc_thread_stop();
+#endif
+    free(janet_vm_gc_remembered);
+    janet_vm_gc_remembered = NULL;
+    janet_vm_gc_remembered_count = 0;
+    janet_vm_gc_remembered_capacity = 0;
+    free(janet_vm_gc_gray);
+    janet_vm_gc_gray = NULL;
+    janet_vm_gc_gray_count = 0;
+    janet_vm_gc_gray_capacity = 0;
+    free(janet_vm_gc_rescan);
+    janet_vm_gc_rescan = NULL;
+    janet_vm_gc_rescan_count = 0;
+    janet_vm_gc_rescan_capacity = 0;
+    free(janet_vm_root_handle_values);
+    free(janet_vm_root_handle_owners);
+    free(janet_vm_root_handle_slots);
+    janet_vm_root_handle_values = NULL;
+    janet_vm_root_handle_owners = NULL;
+    janet_vm_root_handle_slots = NULL;
+    janet_vm_root_handle_count = 0;
+    janet_vm_root_handle_capacity = 0;
+    janet_vm_root_handle_slot_count = 0;
+    janet_vm_root_handle_slot_capacity = 0;
+    janet_vm_root_handle_free = -1;
+    free(janet_vm_gc_weak);
+    janet_vm_gc_weak = NULL;
+    janet_vm_gc_weak_count = 0;
+    janet_vm_gc_weak_capacity = 0;
+    janet_vm_gc_marking = 0;
+    janet_vm_gc_arena = 0;
+    memset(&janet_vm_gc_stats, 0, sizeof(janet_vm_gc_stats));
     janet_free_all_scratch();
     free(janet_scratch_mem);
 }
@@ -33,6 +33,14 @@
 #define JANET_MEM_TYPEBITS 0xFF
 #define JANET_MEM_REACHABLE 0x100
 #define JANET_MEM_DISABLED 0x200
+#define JANET_MEM_OLD 0x400
+#define JANET_MEM_REMEMBERED 0x800
+#define JANET_MEM_GRAY 0x1000
+
+/* Small blocks are carved out of per size class pages. The size class
+ * of a block is kept in its flags, 0 meaning the block came from malloc. */
+#define JANET_MEM_SIZECLASS 0xE000
+#define JANET_MEM_SIZECLASS_SHIFT 13
 
 #define janet_gc_settype(m, t) ((janet_gc_header(m)->flags |= (0xFF & (t))))
 #define janet_gc_type(m) (janet_gc_header(m)->flags & 0xFF)
@@ -40,6 +48,17 @@
 #define janet_gc_mark(m) (janet_gc_header(m)->flags |= JANET_MEM_REACHABLE)
 #define janet_gc_reachable(m) (janet_gc_header(m)->flags & JANET_MEM_REACHABLE)
 
+/* Write barrier. Must be called when a reference to another gc object is stored
+ * in an existing table or array. This keeps the remembered set of the generational
+ * collector and the invariants of incremental marking intact. Fibers, function
+ * environments and abstract types are always rescanned, and so do not need it. */
+#define janet_gc_barrier(m) do { \
+    int32_t _flags = janet_gc_header(m)->flags; \
+    if ((_flags & (JANET_MEM_OLD | JANET_MEM_REMEMBERED)) == JANET_MEM_OLD || \
+            (_flags & (JANET_MEM_REACHABLE | JANET_MEM_GRAY)) == JANET_MEM_REACHABLE) \
+        janet_gc_barrier_slow(janet_gc_header(m)); \
+} while (0)
+
 /* Memory types for the GC. Different from JanetType to include funcenv and funcdef. */
 enum JanetMemoryType {
     JANET_MEMORY_NONE,
@@ -61,4 +80,18 @@ enum JanetMemoryType {
  * and then call when janet_enablegc when it is initailize and reachable by the gc (on the JANET stack) */
 void *janet_gcalloc(enum JanetMemoryType type, size_t size);
 
+/* Slow path of the write barrier. Use janet_gc_barrier instead. */
+void janet_gc_barrier_slow(JanetGCObject *mem);
+
+/* Run whatever collection work is due. Called from safe points in the vm
+ * once enough memory has been allocated since the last collection. */
+void janet_gcstep(void);
+
+/* Sweep all old blocks still waiting to be swept after a full collection.
+ * Needed before walking the heap, as unswept blocks may be dead. */
+void janet_sweep_finish(void);
+
+/* Depth of the gc arenas open in the running fiber */
+int32_t *janet_arena_depth(void);
+
 #endif
@@ -0,0 +1,689 @@
+/*
+* Copyright (c) 2019 Calvin Rose
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef JANET_AMALG
+#include <janet.h>
+#include "jit.h"
+#include "util.h"
+#endif
+
+/* Conditional compilation */
+#ifdef JANET_JIT
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * A baseline, template based compiler from bytecode to x86-64 machine code.
+ *
+ * Each bytecode instruction is translated to a fixed sequence of machine
+ * instructions, and values stay in their stack slots between instructions.
+ * Only instructions that can never allocate memory, call back into the vm,
+ * or raise an error are compiled. Everything else, as well as any operand
+ * that fails a type check, leaves native code and hands control back to the
+ * interpreter at that instruction. Native code never needs to be unwound,
+ * so the interpreter can enter and leave it at any instruction boundary.
+ *
+ * Native code is entered as
+ *
+ *     int32_t code(Janet *stack, void *target);
+ *
+ * and returns the index of the instruction the interpreter should resume at.
+ * While running, rdi holds the stack and r8 holds the smallest bit pattern
+ * that is not a number, so that a type check is a single unsigned compare.
+ */
+
+typedef int32_t (*JanetJitEntry)(Janet *stack, const void *target);
+
+/* Native code from all functions is packed into shared chunks of executable
+ * memory, rather than each function getting pages of its own. Chunks are
+ * only writable while code is copied in. Freed code leaves a hole that later
+ * code of the same size or smaller can reuse, and a chunk is released once
+ * nothing in it is in use. */
+#define JIT_CHUNK_SIZE 0x40000
+#define JIT_ALIGN 16
+
+typedef struct {
+    size_t offset;
+    size_t size;
+} JanetJitHole;
+
+typedef struct JanetJitChunk JanetJitChunk;
+struct JanetJitChunk {
+    JanetJitChunk *next;
+    uint8_t *mem;
+    size_t size;
+    size_t used;
+    size_t live;
+    JanetJitHole *holes;
+    int32_t hole_count;
+    int32_t hole_capacity;
+};
+
+static JANET_THREAD_LOCAL JanetJitChunk *janet_vm_jit_chunks;
+static JANET_THREAD_LOCAL size_t janet_vm_jit_memory;
+
+typedef struct {
+    uint8_t *code;
+    size_t size;
+    JanetJitChunk *chunk;
+    /* Offset of the native code for each instruction, or -1 if the
+     * instruction is always left to the interpreter */
+    int32_t entries[];
+} JanetJitCode;
+
+/* A rel32 field in the code buffer to point at a label once all code is emitted */
+typedef struct {
+    int32_t at;
+    int32_t index;
+    int is_exit;
+} JanetJitFixup;
+
+typedef struct {
+    JanetBuffer buf;
+    JanetJitFixup *fixups;
+    int32_t fixup_count;
+    int32_t fixup_capacity;
+    int32_t *labels;
+    int32_t *exits;
+} JanetJitState;
+
+/* Smallest nanboxed value that is not a number */
+#define JIT_NUMBER_LIMIT 0xFFF8800000000000llu
+
+/* Condition codes, as used in the low nibble of jcc and setcc */
+#define JIT_CC_P  0xA
+#define JIT_CC_E  0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_AE 0x3
+#define JIT_CC_A  0x7
+
+/* Copy code into a chunk, making the pages it touches writable meanwhile */
+static int jit_write(JanetJitChunk *chunk, uint8_t *dest, const uint8_t *src, size_t n) {
+    size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)(dest - chunk->mem) & ~(pagesize - 1);
+    size_t end = ((size_t)(dest - chunk->mem) + n + pagesize - 1) & ~(pagesize - 1);
+    if (mprotect(chunk->mem + start, end - start, PROT_READ | PROT_WRITE)) return 1;
+    memcpy(dest, src, n);
+    return mprotect(chunk->mem + start, end - start, PROT_READ | PROT_EXEC);
+}
+
+/* Get size bytes of executable memory, or NULL if the memory cap is reached */
+static uint8_t *jit_alloc(size_t size, JanetJitChunk **out) {
+    JanetJitChunk *chunk;
+    for (chunk = janet_vm_jit_chunks; NULL != chunk; chunk = chunk->next) {
+        for (int32_t i = 0; i < chunk->hole_count; i++) {
+            JanetJitHole *hole = chunk->holes + i;
+            if (hole->size < size) continue;
+            uint8_t *mem = chunk->mem + hole->offset;
+            hole->offset += size;
+            hole->size -= size;
+            if (hole->size == 0) *hole = chunk->holes[--chunk->hole_count];
+            chunk->live += size;
+            *out = chunk;
+            return mem;
+        }
+        if (chunk->size - chunk->used >= size) {
+            uint8_t *mem = chunk->mem + chunk->used;
+            chunk->used += size;
+            chunk->live += size;
+            *out = chunk;
+            return mem;
+        }
+    }
+
+    /* New chunk */
+    size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t chunksize = (size + pagesize - 1) & ~(pagesize - 1);
+    if (chunksize < JIT_CHUNK_SIZE) chunksize = JIT_CHUNK_SIZE;
+    if (janet_vm_jit_memory + chunksize > JANET_JIT_MAX_MEMORY) return NULL;
+    void *mem = NULL;
+    chunk = malloc(sizeof(JanetJitChunk));
+    if (NULL == chunk) {
+        JANET_OUT_OF_MEMORY;
+    }
+    if (posix_memalign(&mem, pagesize, chunksize)) {
+        free(chunk);
+        return NULL;
+    }
+    if (mprotect(mem, chunksize, PROT_READ | PROT_EXEC)) {
+        free(mem);
+        free(chunk);
+        return NULL;
+    }
+    chunk->mem = mem;
+    chunk->size = chunksize;
+    chunk->used = size;
+    chunk->live = size;
+    chunk->holes = NULL;
+    chunk->hole_count = 0;
+    chunk->hole_capacity = 0;
+    chunk->next = janet_vm_jit_chunks;
+    janet_vm_jit_chunks = chunk;
+    janet_vm_jit_memory += chunksize;
+    *out = chunk;
+    return chunk->mem;
+}
+
+/* Give back memory from jit_alloc, releasing its chunk if nothing else uses it */
+static void jit_release(JanetJitChunk *chunk, uint8_t *mem, size_t size) {
+    chunk->live -= size;
+    if (chunk->live == 0) {
+        JanetJitChunk **link = &janet_vm_jit_chunks;
+        while (*link != chunk) link = &(*link)->next;
+        *link = chunk->next;
+        janet_vm_jit_memory -= chunk->size;
+        mprotect(chunk->mem, chunk->size, PROT_READ | PROT_WRITE);
+        free(chunk->mem);
+        free(chunk->holes);
+        free(chunk);
+        return;
+    }
+    if (chunk->hole_count >= chunk->hole_capacity) {
+        int32_t newcap = 2 * chunk->hole_capacity + 4;
+        JanetJitHole *holes = realloc(chunk->holes, newcap * sizeof(JanetJitHole));
+        if (NULL == holes) {
+            JANET_OUT_OF_MEMORY;
+        }
+        chunk->holes = holes;
+        chunk->hole_capacity = newcap;
+    }
+    chunk->holes[chunk->hole_count].offset = (size_t)(mem - chunk->mem);
+    chunk->holes[chunk->hole_count].size = size;
+    chunk->hole_count++;
+}
+
+static void jit_emit_bytes(JanetJitState *st, const uint8_t *bytes, int32_t n) {
+    janet_buffer_push_bytes(&st->buf, bytes, n);
+}
+
+#define JIT_EMIT(...) do { \
+    static const uint8_t bytes_[] = { __VA_ARGS__ }; \
+    jit_emit_bytes(st, bytes_, (int32_t) sizeof(bytes_)); \
+} while (0)
+
+static void jit_emit_u32(JanetJitState *st, uint32_t x) {
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++) bytes[i] = (uint8_t)(x >> (8 * i));
+    jit_emit_bytes(st, bytes, 4);
+}
+
+static void jit_emit_u64(JanetJitState *st, uint64_t x) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) bytes[i] = (uint8_t)(x >> (8 * i));
+    jit_emit_bytes(st, bytes, 8);
+}
+
+/* Leave a rel32 hole to be patched to point at an instruction or its exit */
+static void jit_emit_rel32(JanetJitState *st, int32_t index, int is_exit) {
+    if (st->fixup_count >= st->fixup_capacity) {
+        int32_t newcap = 2 * st->fixup_capacity + 16;
+        JanetJitFixup *fixups = realloc(st->fixups, newcap * sizeof(JanetJitFixup));
+        if (NULL == fixups) {
+            JANET_OUT_OF_MEMORY;
+        }
+        st->fixups = fixups;
+        st->fixup_capacity = newcap;
+    }
+    JanetJitFixup *f = st->fixups + st->fixup_count++;
+    f->at = st->buf.count;
+    f->index = index;
+    f->is_exit = is_exit;
+    jit_emit_u32(st, 0);
+}
+
+/* mov rax/rcx, [rdi + 8 * slot] */
+static void jit_emit_load(JanetJitState *st, int rcx, int32_t slot) {
+    if (rcx) {
+        JIT_EMIT(0x48, 0x8B, 0x8F);
+    } else {
+        JIT_EMIT(0x48, 0x8B, 0x87);
+    }
+    jit_emit_u32(st, (uint32_t) slot * 8);
+}
+
+/* mov [rdi + 8 * slot], rax */
+static void jit_emit_store(JanetJitState *st, int32_t slot) {
+    JIT_EMIT(0x48, 0x89, 0x87);
+    jit_emit_u32(st, (uint32_t) slot * 8);
+}
+
+/* movabs rax/rcx, imm64 */
+static void jit_emit_imm(JanetJitState *st, int rcx, uint64_t x) {
+    if (rcx) {
+        JIT_EMIT(0x48, 0xB9);
+    } else {
+        JIT_EMIT(0x48, 0xB8);
+    }
+    jit_emit_u64(st, x);
+}
+
+static void jit_emit_jcc(JanetJitState *st, int cc, int32_t index, int is_exit) {
+    uint8_t bytes[2] = {0x0F, (uint8_t)(0x80 | cc)};
+    jit_emit_bytes(st, bytes, 2);
+    jit_emit_rel32(st, index, is_exit);
+}
+
+static void jit_emit_jmp(JanetJitState *st, int32_t index, int is_exit) {
+    JIT_EMIT(0xE9);
+    jit_emit_rel32(st, index, is_exit);
+}
+
+/* Leave native code unless rax/rcx holds a number */
+static void jit_emit_checknum(JanetJitState *st, int rcx, int32_t i) {
+    if (rcx) {
+        JIT_EMIT(0x4C, 0x39, 0xC1); /* cmp rcx, r8 */
+    } else {
+        JIT_EMIT(0x4C, 0x39, 0xC0); /* cmp rax, r8 */
+    }
+    jit_emit_jcc(st, JIT_CC_AE, i, 1);
+}
+
+/* Load two numbers into xmm0 and xmm1. The second operand comes from
+ * a slot, or is the immediate imm if slot is negative. */
+static void jit_emit_numbers(JanetJitState *st, int32_t i, int32_t slot1, int32_t slot2, double imm) {
+    jit_emit_load(st, 0, slot1);
+    jit_emit_checknum(st, 0, i);
+    if (slot2 >= 0) {
+        jit_emit_load(st, 1, slot2);
+        jit_emit_checknum(st, 1, i);
+    } else {
+        Janet x = janet_wrap_number(imm);
+        jit_emit_imm(st, 1, x.u64);
+    }
+    JIT_EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC0); /* movq xmm0, rax */
+    JIT_EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC9); /* movq xmm1, rcx */
+}
+
+/* Arithmetic on two numbers. op is the second opcode byte of the sse2 instruction. */
+static void jit_emit_arith(JanetJitState *st, int32_t i, uint8_t op,
+                       int32_t dest, int32_t slot1, int32_t slot2, double imm) {
+    jit_emit_numbers(st, i, slot1, slot2, imm);
+    uint8_t bytes[4] = {0xF2, 0x0F, op, 0xC1}; /* op xmm0, xmm1 */
+    jit_emit_bytes(st, bytes, 4);
+    JIT_EMIT(0x66, 0x48, 0x0F, 0x7E, 0xC0); /* movq rax, xmm0 */
+    jit_emit_store(st, dest);
+}
+
+/* Short forward jumps inside the code for one instruction */
+static int32_t jit_emit_jcc_short(JanetJitState *st, int cc) {
+    uint8_t bytes[2] = {(uint8_t)(0x70 | cc), 0};
+    jit_emit_bytes(st, bytes, 2);
+    return st->buf.count - 1;
+}
+
+static void jit_patch_short(JanetJitState *st, int32_t at) {
+    st->buf.data[at] = (uint8_t)(st->buf.count - at - 1);
+}
+
+/* Comparison kinds */
+#define JIT_CMP_LT 0
+#define JIT_CMP_LTE 1
+#define JIT_CMP_GT 2
+#define JIT_CMP_GTE 3
+#define JIT_CMP_EQ 4
+
+/* Compare xmm0 with xmm1 and return the condition code that holds when the
+ * comparison is true. Unordered operands (nan) set every flag ucomisd touches,
+ * so they compare false for all kinds but JIT_CMP_EQ, which must also check
+ * that the parity flag is clear. */
+static int jit_emit_compare(JanetJitState *st, int kind) {
+    if (kind == JIT_CMP_LT || kind == JIT_CMP_LTE) {
+        JIT_EMIT(0x66, 0x0F, 0x2E, 0xC8); /* ucomisd xmm1, xmm0 */
+    } else {
+        JIT_EMIT(0x66, 0x0F, 0x2E, 0xC1); /* ucomisd xmm0, xmm1 */
+    }
+    switch (kind) {
+        case JIT_CMP_LT:
+        case JIT_CMP_GT:
+            return JIT_CC_A;
+        case JIT_CMP_LTE:
+        case JIT_CMP_GTE:
+            return JIT_CC_AE;
+        default:
+            return JIT_CC_E;
+    }
+}
+
+/* Store the result of a numeric comparison as a boolean */
+static void jit_emit_compare_store(JanetJitState *st, int32_t i, int kind,
+                               int32_t dest, int32_t slot1, int32_t slot2) {
+    jit_emit_numbers(st, i, slot1, slot2, 0.0);
+    int cc = jit_emit_compare(st, kind);
+    uint8_t setcc[3] = {0x0F, (uint8_t)(0x90 | cc), 0xC0};
+    jit_emit_bytes(st, setcc, 3); /* setcc al */
+    if (kind == JIT_CMP_EQ) {
+        JIT_EMIT(0x0F, 0x9B, 0xC1); /* setnp cl */
+        JIT_EMIT(0x20, 0xC8); /* and al, cl */
+    }
+    JIT_EMIT(0x0F, 0xB6, 0xC0); /* movzx eax, al */
+    jit_emit_imm(st, 1, janet_wrap_false().u64);
+    JIT_EMIT(0x48, 0x09, 0xC8); /* or rax, rcx */
+    jit_emit_store(st, dest);
+}
+
+/* Jump to yes if xmm0 and xmm1 are equal, else to no */
+static void jit_emit_numeq_jump(JanetJitState *st, int32_t yes, int32_t no) {
+    jit_emit_compare(st, JIT_CMP_EQ);
+    jit_emit_jcc(st, JIT_CC_NE, no, 0);
+    jit_emit_jcc(st, JIT_CC_P, no, 0);
+    jit_emit_jmp(st, yes, 0);
+}
+
+/* Jump to target if rax is truthy (or falsey if negate is set) */
+static void jit_emit_truthy_jump(JanetJitState *st, int negate, int32_t target, int32_t next) {
+    int32_t falsey = negate ? target : next;
+    int32_t truthy = negate ? next : target;
+    JIT_EMIT(0x48, 0x89, 0xC1); /* mov rcx, rax */
+    JIT_EMIT(0x48, 0xC1, 0xE9, 0x2F); /* shr rcx, 47 */
+    JIT_EMIT(0x81, 0xF9); /* cmp ecx, imm32 */
+    jit_emit_u32(st, (uint32_t) janet_nanbox_lowtag(JANET_NIL));
+    jit_emit_jcc(st, JIT_CC_E, falsey, 0);
+    JIT_EMIT(0x81, 0xF9); /* cmp ecx, imm32 */
+    jit_emit_u32(st, (uint32_t) janet_nanbox_lowtag(JANET_BOOLEAN));
+    jit_emit_jcc(st, JIT_CC_NE, truthy, 0);
+    JIT_EMIT(0xA8, 0x01); /* test al, 1 */
+    jit_emit_jcc(st, JIT_CC_E, falsey, 0);
+    jit_emit_jmp(st, truthy, 0);
+}
+
+/* Generic equality between two slots. Numbers compare numerically, identical
+ * values are equal, and values of different types are not. Anything else
+ * needs structural comparison or a closer look, and is left to the interpreter. */
+static void jit_emit_equal_jump(JanetJitState *st, int32_t i, int32_t slot1, int32_t slot2,
+                            int32_t yes, int32_t no) {
+    jit_emit_load(st, 0, slot1);
+    jit_emit_load(st, 1, slot2);
+    JIT_EMIT(0x4C, 0x39, 0xC0); /* cmp rax, r8 */
+    int32_t notnum = jit_emit_jcc_short(st, JIT_CC_AE);
+    JIT_EMIT(0x4C, 0x39, 0xC1); /* cmp rcx, r8 */
+    jit_emit_jcc(st, JIT_CC_AE, no, 0);
+    JIT_EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC0); /* movq xmm0, rax */
+    JIT_EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC9); /* movq xmm1, rcx */
+    jit_emit_numeq_jump(st, yes, no);
+    jit_patch_short(st, notnum);
+    JIT_EMIT(0x48, 0x39, 0xC8); /* cmp rax, rcx */
+    jit_emit_jcc(st, JIT_CC_E, yes, 0);
+    JIT_EMIT(0x48, 0x89, 0xC2); /* mov rdx, rax */
+    JIT_EMIT(0x48, 0xC1, 0xEA, 0x2F); /* shr rdx, 47 */
+    JIT_EMIT(0x48, 0xC1, 0xE9, 0x2F); /* shr rcx, 47 */
+    JIT_EMIT(0x48, 0x39, 0xCA); /* cmp rdx, rcx */
+    jit_emit_jcc(st, JIT_CC_NE, no, 0);
+    jit_emit_jmp(st, i, 1);
+}
+
+/* Equality between a slot and a small integer. Non-numbers are never equal. */
+static void jit_emit_equal_immediate_jump(JanetJitState *st, int32_t slot, int8_t imm,
+                                      int32_t yes, int32_t no) {
+    jit_emit_load(st, 0, slot);
+    JIT_EMIT(0x4C, 0x39, 0xC0); /* cmp rax, r8 */
+    jit_emit_jcc(st, JIT_CC_AE, no, 0);
+    jit_emit_imm(st, 1, janet_wrap_number((double) imm).u64);
+    JIT_EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC0); /* movq xmm0, rax */
+    JIT_EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC9); /* movq xmm1, rcx */
+    jit_emit_numeq_jump(st, yes, no);
+}
+
+/* Shared entry code. Jumps to the target instruction. */
+static void jit_emit_prologue(JanetJitState *st) {
+    JIT_EMIT(0x49, 0xB8); /* movabs r8, imm64 */
+    jit_emit_u64(st, JIT_NUMBER_LIMIT);
+    JIT_EMIT(0xFF, 0xE6); /* jmp rsi */
+}
+
+/* Return to the interpreter at instruction i */
+static void jit_emit_exit(JanetJitState *st, int32_t i) {
+    JIT_EMIT(0xB8); /* mov eax, imm32 */
+    jit_emit_u32(st, (uint32_t) i);
+    JIT_EMIT(0xC3); /* ret */
+}
+
+/* Emit code for one instruction. Returns 0 if the instruction is not
+ * supported, in which case nothing was emitted. */
+static int jit_emit_instruction(JanetJitState *st, JanetFuncDef *def, int32_t i) {
+    uint32_t instr = def->bytecode[i];
+    int32_t a = (instr >> 8) & 0xFF;
+    int32_t b = (instr >> 16) & 0xFF;
+    int32_t c = instr >> 24;
+    int32_t d = instr >> 8;
+    int32_t e = instr >> 16;
+    int32_t cs = (int32_t) instr >> 24;
+    int32_t ds = (int32_t) instr >> 8;
+    int32_t es = (int32_t) instr >> 16;
+    switch (instr & 0xFF) {
+        default:
+            return 0;
+        case JOP_NOOP:
+            break;
+        case JOP_MOVE_NEAR:
+            jit_emit_load(st, 0, e);
+            jit_emit_store(st, a);
+            break;
+        case JOP_MOVE_FAR:
+            jit_emit_load(st, 0, a);
+            jit_emit_store(st, e);
+            break;
+        case JOP_LOAD_NIL:
+            jit_emit_imm(st, 0, janet_wrap_nil().u64);
+            jit_emit_store(st, d);
+            break;
+        case JOP_LOAD_TRUE:
+            jit_emit_imm(st, 0, janet_wrap_true().u64);
+            jit_emit_store(st, d);
+            break;
+        case JOP_LOAD_FALSE:
+            jit_emit_imm(st, 0, janet_wrap_false().u64);
+            jit_emit_store(st, d);
+            break;
+        case JOP_LOAD_INTEGER:
+            jit_emit_imm(st, 0, janet_wrap_integer(es).u64);
+            jit_emit_store(st, a);
+            break;
+        case JOP_LOAD_CONSTANT:
+            /* Constants never change, so they can be baked into the code */
+            if (e >= def->constants_length) return 0;
+            jit_emit_imm(st, 0, def->constants[e].u64);
+            jit_emit_store(st, a);
+            break;
+        case JOP_ADD:
+            jit_emit_arith(st, i, 0x58, a, b, c, 0.0);
+            break;
+        case JOP_SUBTRACT:
+            jit_emit_arith(st, i, 0x5C, a, b, c, 0.0);
+            break;
+        case JOP_MULTIPLY:
+            jit_emit_arith(st, i, 0x59, a, b, c, 0.0);
+            break;
+        case JOP_DIVIDE:
+            jit_emit_arith(st, i, 0x5E, a, b, c, 0.0);
+            break;
+        case JOP_ADD_IMMEDIATE:
+            jit_emit_arith(st, i, 0x58, a, b, -1, (double) cs);
+            break;
+        case JOP_MULTIPLY_IMMEDIATE:
+            jit_emit_arith(st, i, 0x59, a, b, -1, (double) cs);
+            break;
+        case JOP_DIVIDE_IMMEDIATE:
+            jit_emit_arith(st, i, 0x5E, a, b, -1, (double) cs);
+            break;
+        case JOP_NUMERIC_LESS_THAN:
+            jit_emit_compare_store(st, i, JIT_CMP_LT, a, b, c);
+            break;
+        case JOP_NUMERIC_LESS_THAN_EQUAL:
+            jit_emit_compare_store(st, i, JIT_CMP_LTE, a, b, c);
+            break;
+        case JOP_NUMERIC_GREATER_THAN:
+            jit_emit_compare_store(st, i, JIT_CMP_GT, a, b, c);
+            break;
+        case JOP_NUMERIC_GREATER_THAN_EQUAL:
+            jit_emit_compare_store(st, i, JIT_CMP_GTE, a, b, c);
+            break;
+        case JOP_NUMERIC_EQUAL:
+            jit_emit_compare_store(st, i, JIT_CMP_EQ, a, b, c);
+            break;
+        case JOP_JUMP:
+            jit_emit_jmp(st, i + ds, 0);
+            break;
+        case JOP_JUMP_IF:
+            jit_emit_load(st, 0, a);
+            jit_emit_truthy_jump(st, 0, i + es, i + 1);
+            break;
+        case JOP_JUMP_IF_NOT:
+            jit_emit_load(st, 0, a);
+            jit_emit_truthy_jump(st, 1, i + es, i + 1);
+            break;
+        case JOP_JUMP_IF_LT:
+        case JOP_JUMP_IF_LTE:
+        case JOP_JUMP_IF_GT:
+        case JOP_JUMP_IF_GTE:
+            /* The comparison kinds follow the opcode order */
+            jit_emit_numbers(st, i, a, b, 0.0);
+            jit_emit_jcc(st, jit_emit_compare(st, (instr & 0xFF) - JOP_JUMP_IF_LT), i + cs, 0);
+            break;
+        case JOP_JUMP_IF_LT_IMMEDIATE:
+        case JOP_JUMP_IF_LTE_IMMEDIATE:
+        case JOP_JUMP_IF_GT_IMMEDIATE:
+        case JOP_JUMP_IF_GTE_IMMEDIATE:
+            jit_emit_numbers(st, i, a, -1, (double)(int8_t) b);
+            jit_emit_jcc(st, jit_emit_compare(st, (instr & 0xFF) - JOP_JUMP_IF_LT_IMMEDIATE), i + cs, 0);
+            break;
+        case JOP_JUMP_IF_EQUAL:
+            jit_emit_equal_jump(st, i, a, b, i + cs, i + 1);
+            break;
+        case JOP_JUMP_IF_NOT_EQUAL:
+            jit_emit_equal_jump(st, i, a, b, i + 1, i + cs);
+            break;
+        case JOP_JUMP_IF_EQUAL_IMMEDIATE:
+            jit_emit_equal_immediate_jump(st, a, (int8_t) b, i + cs, i + 1);
+            break;
+        case JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE:
+            jit_emit_equal_immediate_jump(st, a, (int8_t) b, i + 1, i + cs);
+            break;
+    }
+    return 1;
+}
+
+void janet_jit_compile(JanetFuncDef *def) {
+    int32_t n = def->bytecode_length;
+    def->flags |= JANET_FUNCDEF_FLAG_NOJIT;
+    if (n == 0) return;
+
+    /* Breakpoints must trap in the interpreter */
+    for (int32_t i = 0; i < n; i++) {
+        if (def->bytecode[i] & 0x80) return;
+    }
+
+    JanetJitCode *jit = malloc(sizeof(JanetJitCode) + n * sizeof(int32_t));
+    JanetJitState st;
+    st.fixups = NULL;
+    st.fixup_count = 0;
+    st.fixup_capacity = 0;
+    st.labels = malloc(2 * n * sizeof(int32_t));
+    if (NULL == jit || NULL == st.labels) {
+        JANET_OUT_OF_MEMORY;
+    }
+    st.exits = st.labels + n;
+    janet_buffer_init(&st.buf, 32 * n);
+
+    jit_emit_prologue(&st);
+
+    /* Instructions, in bytecode order so that falling through works.
+     * Unsupported instructions are just their exit. */
+    int32_t supported = 0;
+    for (int32_t i = 0; i < n; i++) {
+        st.labels[i] = st.buf.count;
+        if (jit_emit_instruction(&st, def, i)) {
+            jit->entries[i] = st.labels[i];
+            st.exits[i] = -1;
+            supported++;
+        } else {
+            jit->entries[i] = -1;
+            st.exits[i] = st.buf.count;
+            jit_emit_exit(&st, i);
+        }
+    }
+
+    /* Out of line exits for failed type checks */
+    for (int32_t i = 0; i < n; i++) {
+        if (st.exits[i] < 0) {
+            st.exits[i] = st.buf.count;
+            jit_emit_exit(&st, i);
+        }
+    }
+
+    /* Resolve jumps */
+    for (int32_t k = 0; k < st.fixup_count; k++) {
+        JanetJitFixup *f = st.fixups + k;
+        int32_t dest = f->is_exit ? st.exits[f->index] : st.labels[f->index];
+        uint32_t rel = (uint32_t)(dest - (f->at + 4));
+        for (int b = 0; b < 4; b++) st.buf.data[f->at + b] = (uint8_t)(rel >> (8 * b));
+    }
+
+    /* Nothing worth running natively */
+    if (supported == 0) {
+        free(jit);
+        goto done;
+    }
+
+    /* Copy to executable memory */
+    jit->size = ((size_t) st.buf.count + JIT_ALIGN - 1) & ~(size_t)(JIT_ALIGN - 1);
+    jit->code = jit_alloc(jit->size, &jit->chunk);
+    if (NULL == jit->code) {
+        free(jit);
+        goto done;
+    }
+    if (jit_write(jit->chunk, jit->code, st.buf.data, st.buf.count)) {
+        jit_release(jit->chunk, jit->code, jit->size);
+        free(jit);
+        goto done;
+    }
+    def->jit = jit;
+    def->flags = (def->flags & ~JANET_FUNCDEF_FLAG_NOJIT) | JANET_FUNCDEF_FLAG_JIT;
+
+done:
+    janet_buffer_deinit(&st.buf);
+    free(st.fixups);
+    free(st.labels);
+}
+
+uint32_t *janet_jit_run(JanetFuncDef *def, Janet *stack, uint32_t *pc) {
+    JanetJitCode *jit = def->jit;
+    int32_t offset = jit->entries[pc - def->bytecode];
+    if (offset < 0) return pc;
+    JanetJitEntry entry;
+    void *start = jit->code;
+    memcpy(&entry, &start, sizeof(entry));
+    return def->bytecode + entry(stack, jit->code + offset);
+}
+
+void janet_jit_free(JanetFuncDef *def) {
+    if (def->flags & JANET_FUNCDEF_FLAG_JIT) {
+        JanetJitCode *jit = def->jit;
+        jit_release(jit->chunk, jit->code, jit->size);
+        free(jit);
+        def->jit = NULL;
+        def->flags &= ~JANET_FUNCDEF_FLAG_JIT;
+    }
+}
+
+#endif
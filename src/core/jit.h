@@ -0,0 +1,54 @@
+/*
+* Copyright (c) 2019 Calvin Rose
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef JANET_JIT_H_defined
+#define JANET_JIT_H_defined
+
+#ifndef JANET_AMALG
+#include <janet.h>
+#endif
+
+#ifdef JANET_JIT
+
+/* Number of times a function is entered (or loops) before it is compiled */
+#define JANET_JIT_THRESHOLD 100
+
+/* Most bytes of executable memory each thread uses for native code. Functions
+ * that do not fit once this is reached are left to the interpreter. */
+#ifndef JANET_JIT_MAX_MEMORY
+#define JANET_JIT_MAX_MEMORY 0x4000000
+#endif
+
+/* Compile a function definition to native code. On failure, the definition
+ * is marked so that compilation is not attempted again. */
+void janet_jit_compile(JanetFuncDef *def);
+
+/* Run native code from the bytecode instruction at pc until an instruction
+ * the JIT does not handle is reached. Returns the pc to resume interpreting at. */
+uint32_t *janet_jit_run(JanetFuncDef *def, Janet *stack, uint32_t *pc);
+
+/* Release native code for a definition */
+void janet_jit_free(JanetFuncDef *def);
+
+#endif
+
+#endif
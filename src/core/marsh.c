@@ -202,6 +202,7 @@ static void janet_func_addflags(JanetFuncDef *def) {
     if (def->defs) def->flags |= JANET_FUNCDEF_FLAG_HASDEFS;
     if (def->environments) def->flags |= JANET_FUNCDEF_FLAG_HASENVS;
     if (def->sourcemap) def->flags |= JANET_FUNCDEF_FLAG_HASSOURCEMAP;
+    if (def->noescape) def->flags |= JANET_FUNCDEF_FLAG_HASNOESCAPE;
 }
 
 /* Marshal a function def */
@@ -217,7 +218,7 @@ static void marshal_one_def(MarshalState *st, JanetFuncDef *def, int flags) {
     janet_func_addflags(def);
     /* Add to lookup */
     janet_v_push(st->seen_defs, def);
-    pushint(st, def->flags);
+    pushint(st, def->flags & ~(JANET_FUNCDEF_FLAG_JIT | JANET_FUNCDEF_FLAG_NOJIT));
     pushint(st, def->slotcount);
     pushint(st, def->arity);
     pushint(st, def->min_arity);
@@ -228,6 +229,8 @@ static void marshal_one_def(MarshalState *st, JanetFuncDef *def, int flags) {
         pushint(st, def->environments_length);
     if (def->flags & JANET_FUNCDEF_FLAG_HASDEFS)
         pushint(st, def->defs_length);
+    if (def->flags & JANET_FUNCDEF_FLAG_HASNOESCAPE)
+        pushint(st, def->noescape);
     if (def->flags & JANET_FUNCDEF_FLAG_HASNAME)
         marshal_one(st, janet_wrap_string(def->name), flags);
     if (def->flags & JANET_FUNCDEF_FLAG_HASSOURCE)
@@ -282,6 +285,7 @@ static void marshal_one_fiber(MarshalState *st, JanetFiber *fiber, int flags) {
     pushint(st, fiber->stackstart);
     pushint(st, fiber->stacktop);
     pushint(st, fiber->maxstack);
+    if (fiber->flags & JANET_FIBER_FLAG_FUEL) pushint(st, fiber->fuel);
     /* Do frames */
     int32_t i = fiber->frame;
     int32_t j = fiber->stackstart - JANET_FRAME_SIZE;
@@ -729,6 +733,14 @@ static const uint8_t *unmarshal_one_def(
         def->bytecode_length = 0;
         def->name = NULL;
         def->source = NULL;
+        def->noescape = 0;
+#ifdef JANET_JIT
+        def->jit = NULL;
+        def->jit_heat = 0;
+#endif
+#ifdef JANET_PROFILE_OPCODES
+        def->calls = 0;
+#endif
         janet_v_push(st->lookup_defs, def);
 
         /* Set default lengths to zero */
@@ -738,7 +750,7 @@ static const uint8_t *unmarshal_one_def(
         int32_t defs_length = 0;
 
         /* Read flags and other fixed values */
-        def->flags = readint(st, &data);
+        def->flags = readint(st, &data) & ~(JANET_FUNCDEF_FLAG_JIT | JANET_FUNCDEF_FLAG_NOJIT);
         def->slotcount = readint(st, &data);
         def->arity = readint(st, &data);
         def->min_arity = readint(st, &data);
@@ -751,6 +763,8 @@ static const uint8_t *unmarshal_one_def(
             environments_length = readint(st, &data);
         if (def->flags & JANET_FUNCDEF_FLAG_HASDEFS)
             defs_length = readint(st, &data);
+        if (def->flags & JANET_FUNCDEF_FLAG_HASNOESCAPE)
+            def->noescape = readint(st, &data);
 
         /* Check name and source (optional) */
         if (def->flags & JANET_FUNCDEF_FLAG_HASNAME) {
@@ -867,6 +881,8 @@ static const uint8_t *unmarshal_one_fiber(
     fiber->data = NULL;
     fiber->child = NULL;
     fiber->env = NULL;
+    fiber->fuel = 0;
+    fiber->arenas = 0;
 
     /* Push fiber to seen stack */
     janet_v_push(st->lookup, janet_wrap_fiber(fiber));
@@ -882,6 +898,7 @@ static const uint8_t *unmarshal_one_fiber(
     fiber->stackstart = readint(st, &data);
     fiber->stacktop = readint(st, &data);
     fiber->maxstack = readint(st, &data);
+    if (fiber->flags & JANET_FIBER_FLAG_FUEL) fiber->fuel = readint(st, &data);
 
     /* Check for bad flags and ints */
     if ((int32_t)(frame + JANET_FRAME_SIZE) > fiber->stackstart ||
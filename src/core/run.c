@@ -23,6 +23,7 @@
 #ifndef JANET_AMALG
 #include <janet.h>
 #include "state.h"
+#include "fiber.h"
 #endif
 
 /* Run a string */
@@ -53,6 +54,8 @@ int janet_dobytes(JanetTable *env, const uint8_t *bytes, int32_t len, const char
                     janet_stacktrace(fiber, ret);
                     errflags |= 0x01;
                     done = 1;
+                } else {
+                    janet_fiber_release(fiber);
                 }
             } else {
                 if (cres.macrofiber) {
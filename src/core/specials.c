@@ -209,6 +209,11 @@ static JanetSlot janetc_varset(JanetFopts opts, int32_t argn, const Janet *argv)
         subopts.hint = dest;
         JanetSlot ret = janetc_value(subopts, argv[1]);
         janetc_copy(opts.compiler, dest, ret);
+        /* A var stays an integer only if the value assigned is one, and
+         * relies on no other vars than the var itself does */
+        if ((dest.flags & JANET_SLOT_INT) &&
+                (!janetc_isint(opts.compiler, ret) || (ret.intdeps & ~dest.intdeps)))
+            janetc_nointegers(opts.compiler, opts.compiler->scope, dest.intdeps);
         return ret;
     } else if (janet_checktype(argv[0], JANET_TUPLE)) {
         /* Set a field (setf behavior) - (set (tab :key) 2) */
@@ -225,7 +230,11 @@ static JanetSlot janetc_varset(JanetFopts opts, int32_t argn, const Janet *argv)
         opts.flags &= ~(JANET_FOPTS_TAIL | JANET_FOPTS_DROP);
         JanetSlot rvalue = janetc_value(opts, argv[1]);
         /* Emit the PUT instruction */
-        janetc_emit_sss(opts.compiler, JOP_PUT, ds, key, rvalue, 0);
+        int32_t start = janet_v_count(opts.compiler->buffer);
+        janetc_emit_sss(opts.compiler,
+                        janetc_isint(opts.compiler, key) ? JOP_PUT_INT : JOP_PUT,
+                        ds, key, rvalue, 0);
+        janetc_intsite(opts.compiler, start, key);
         return rvalue;
     } else {
         /* Error */
@@ -271,15 +280,33 @@ static JanetSlot dohead(JanetCompiler *c, JanetFopts opts, Janet *head, int32_t
 
 /* Def or var a symbol in a local scope */
 static int namelocal(JanetCompiler *c, const uint8_t *head, int32_t flags, JanetSlot ret) {
+    /* A def of a constant is replaced by the constant wherever it is used */
+    if ((ret.flags & JANET_SLOT_CONSTANT) && !(flags & JANET_SLOT_MUTABLE)) {
+        janetc_nameslot(c, head, ret);
+        return 1;
+    }
     int isUnnamedRegister = !(ret.flags & JANET_SLOT_NAMED) &&
                             ret.index > 0 &&
                             ret.envindex >= 0;
+    int isint = janetc_isint(c, ret);
     if (!isUnnamedRegister) {
         /* Slot is not able to be named */
         JanetSlot localslot = janetc_farslot(c);
         janetc_copy(c, localslot, ret);
+        localslot.intdeps = ret.intdeps;
         ret = localslot;
     }
+    ret.flags &= ~JANET_SLOT_INT;
+    if (isint && (flags & JANET_SLOT_MUTABLE)) {
+        /* A var also relies on its own assignments */
+        uint32_t bit = janetc_intvar(c);
+        if (bit) {
+            ret.flags |= JANET_SLOT_INT;
+            ret.intdeps |= bit;
+        }
+    } else if (isint) {
+        ret.flags |= JANET_SLOT_INT;
+    }
     ret.flags |= flags;
     janetc_nameslot(c, head, ret);
     return !isUnnamedRegister;
@@ -352,6 +379,22 @@ static JanetSlot janetc_def(JanetFopts opts, int32_t argn, const Janet *argv) {
     return ret;
 }
 
+/* Emit a jump taken when cond is false, and return its label. A fused
+ * compare and branch has already emitted its jump. */
+static int32_t janetc_jump_if_not(JanetCompiler *c, JanetSlot cond) {
+    if (cond.flags & JANET_SLOT_BRANCH) return cond.index;
+    return janetc_emit_si(c, JOP_JUMP_IF_NOT, cond, 0, 0);
+}
+
+/* Point a jump from janetc_jump_if_not at dest */
+static void janetc_patch_jump(JanetCompiler *c, int32_t label, int32_t dest) {
+    if ((c->buffer[label] & 0x7F) == JOP_JUMP) {
+        c->buffer[label] |= (uint32_t)(dest - label) << 8;
+    } else {
+        c->buffer[label] |= (uint32_t)(dest - label) << 16;
+    }
+}
+
 /*
  * :condition
  * ...
@@ -392,6 +435,7 @@ static JanetSlot janetc_if(JanetFopts opts, int32_t argn, const Janet *argv) {
              : janetc_gettarget(opts);
 
     /* Compile condition */
+    condopts.flags |= JANET_FOPTS_BRANCH;
     janetc_scope(&condscope, c, 0, "if");
     cond = janetc_value(condopts, argv[0]);
 
@@ -414,7 +458,7 @@ static JanetSlot janetc_if(JanetFopts opts, int32_t argn, const Janet *argv) {
     }
 
     /* Compile jump to right */
-    labeljr = janetc_emit_si(c, JOP_JUMP_IF_NOT, cond, 0, 0);
+    labeljr = janetc_jump_if_not(c, cond);
 
     /* Condition left body */
     janetc_scope(&tempscope, c, 0, "if-true");
@@ -438,7 +482,7 @@ static JanetSlot janetc_if(JanetFopts opts, int32_t argn, const Janet *argv) {
 
     /* Write jumps - only add jump lengths if jump actually emitted */
     labeld = janet_v_count(c->buffer);
-    c->buffer[labeljr] |= (labelr - labeljr) << 16;
+    janetc_patch_jump(c, labeljr, labelr);
     if (!tail) c->buffer[labeljd] |= (labeld - labeljd) << 8;
 
     if (tail) target.flags |= JANET_SLOT_RETURNED;
@@ -564,7 +608,9 @@ static JanetSlot janetc_while(JanetFopts opts, int32_t argn, const Janet *argv)
     janetc_scope(&tempscope, c, JANET_SCOPE_WHILE, "while");
 
     /* Compile condition */
+    subopts.flags |= JANET_FOPTS_BRANCH;
     cond = janetc_value(subopts, argv[0]);
+    subopts.flags &= ~JANET_FOPTS_BRANCH;
 
     /* Check for constant condition */
     if (cond.flags & JANET_SLOT_CONSTANT) {
@@ -580,7 +626,7 @@ static JanetSlot janetc_while(JanetFopts opts, int32_t argn, const Janet *argv)
     /* Infinite loop does not need to check condition */
     labelc = infinite
              ? 0
-             : janetc_emit_si(c, JOP_JUMP_IF_NOT, cond, 0, 0);
+             : janetc_jump_if_not(c, cond);
 
     /* Compile body */
     for (i = 1; i < argn; i++) {
@@ -617,6 +663,7 @@ static JanetSlot janetc_while(JanetFopts opts, int32_t argn, const Janet *argv)
         /* Compile function */
         JanetFuncDef *def = janetc_pop_funcdef(c);
         def->name = janet_cstring("_while");
+        janetc_escape(def);
         int32_t defindex = janetc_addfuncdef(c, def);
         /* And then load the closure and call it. */
         int32_t cloreg = janetc_regalloc_temp(&c->scope->ra, JANETC_REGTEMP_0);
@@ -633,7 +680,7 @@ static JanetSlot janetc_while(JanetFopts opts, int32_t argn, const Janet *argv)
 
     /* Calculate jumps */
     labeld = janet_v_count(c->buffer);
-    if (!infinite) c->buffer[labelc] |= (uint32_t)(labeld - labelc) << 16;
+    if (!infinite) janetc_patch_jump(c, labelc, labeld);
     c->buffer[labeljt] |= (uint32_t)(labelwt - labeljt) << 8;
 
     /* Calculate breaks */
@@ -795,6 +842,7 @@ static JanetSlot janetc_fn(JanetFopts opts, int32_t argn, const Janet *argv) {
 
     /* Ensure enough slots for vararg function. */
     if (arity + vararg > def->slotcount) def->slotcount = arity + vararg;
+    janetc_escape(def);
 
     /* Instantiate closure */
     ret = janetc_gettarget(opts);
@@ -24,6 +24,7 @@
 #define JANET_STATE_H_defined
 
 #include <stdint.h>
+#include <signal.h>
 
 /* The VM state. Rather than a struct that is passed
  * around, the vm state is global for simplicity. If
@@ -57,17 +58,130 @@ extern JANET_THREAD_LOCAL uint32_t janet_vm_cache_capacity;
 extern JANET_THREAD_LOCAL uint32_t janet_vm_cache_count;
 extern JANET_THREAD_LOCAL uint32_t janet_vm_cache_deleted;
 
+/* Inline caches for JOP_GET and JOP_IN on tables with keyword keys. Each
+ * instruction hashes to an entry by its address, and the entry remembers
+ * the table, and the table and slot the key was found in. A hit in the table
+ * itself is checked against the slot, so it needs no invalidation. A hit in a
+ * prototype is only valid until the epoch changes, which happens whenever a
+ * key is added to or removed from a table marked with JANET_TABLE_FLAG_CACHED,
+ * its prototype changes, or it is freed. */
+#define JANET_ICACHE_SIZE 256
+#define JANET_TABLE_FLAG_CACHED 0x80000
+typedef struct {
+    JanetTable *table;
+    JanetTable *holder;
+    const uint8_t *key;
+    int32_t capacity;
+    int32_t slot;
+    uint32_t epoch;
+} JanetTableCache;
+extern JANET_THREAD_LOCAL JanetTableCache janet_vm_icache[JANET_ICACHE_SIZE];
+extern JANET_THREAD_LOCAL uint32_t janet_vm_icache_epoch;
+void janet_icache_invalidate(void);
+#define janet_icache_touch(t) do { \
+    if ((t)->gc.flags & JANET_TABLE_FLAG_CACHED) janet_icache_invalidate(); \
+} while (0)
+
+/* C functions registered as leaves, and a cache of which functions are
+ * leaves indexed by function address. The VM calls leaves without a stack
+ * frame. While one runs, janet_vm_leaf holds it, so that its frame can be
+ * pushed after the fact if it raises an error. */
+#define JANET_LEAF_CACHE_SIZE 64
+typedef struct {
+    JanetCFunction cfun;
+    int leaf;
+} JanetLeafCache;
+extern JANET_THREAD_LOCAL JanetTable *janet_vm_leaves;
+extern JANET_THREAD_LOCAL JanetLeafCache janet_vm_leaf_cache[JANET_LEAF_CACHE_SIZE];
+extern JANET_THREAD_LOCAL JanetCFunction janet_vm_leaf;
+
+/* Sampling profiler. A timer signal sets janet_vm_profile_pending, and the
+ * interpreter takes a sample of the running fiber's stack at the next call
+ * or backward jump on the thread that started the profiler. Samples are
+ * counted in janet_vm_profile, keyed by folded stack. The timer is per
+ * process, so the profiler refuses to start while more than one vm thread
+ * is running. */
+extern volatile sig_atomic_t janet_vm_profile_pending;
+extern JANET_THREAD_LOCAL JanetTable *janet_vm_profile;
+void janet_profile_sample(JanetFiber *fiber);
+void janet_profile_end(void);
+void janet_profile_init(void);
+void janet_profile_deinit(void);
+
+/* Fibers that ran to completion, kept for reuse by janet_fiber. Pooled
+ * fibers are rooted by handle, and their stacks are shrunk to at most
+ * JANET_FIBER_POOL_STACK values. */
+#define JANET_FIBER_POOL_SIZE 16
+#define JANET_FIBER_POOL_STACK 256
+typedef struct {
+    JanetFiber *fiber;
+    int32_t handle;
+} JanetFiberPool;
+extern JANET_THREAD_LOCAL JanetFiberPool janet_vm_fiber_pool[JANET_FIBER_POOL_SIZE];
+extern JANET_THREAD_LOCAL int32_t janet_vm_fiber_pool_count;
+
+/* Number of times each instruction was executed */
+#ifdef JANET_PROFILE_OPCODES
+extern JANET_THREAD_LOCAL uint64_t janet_vm_opcode_counts[JOP_INSTRUCTION_COUNT];
+#endif
+
 /* Garbage collection */
 extern JANET_THREAD_LOCAL void *janet_vm_blocks;
+extern JANET_THREAD_LOCAL void *janet_vm_old_blocks;
+/* Old blocks that have not yet been swept since the last full collection */
+extern JANET_THREAD_LOCAL void *janet_vm_gc_unswept;
 extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_interval;
 extern JANET_THREAD_LOCAL uint32_t janet_vm_next_collection;
 extern JANET_THREAD_LOCAL int janet_vm_gc_suspend;
 
+/* Collection policy. With the adaptive policy, janet_vm_gc_interval is
+ * recomputed after each collection from the size of the live heap. */
+extern JANET_THREAD_LOCAL JanetGCPolicy janet_vm_gc_policy;
+extern JANET_THREAD_LOCAL double janet_vm_gc_growth;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_min_interval;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_max_interval;
+
+/* Depth of nested arenas opened outside of any fiber. Arenas opened in a
+ * fiber are counted in the fiber. Automatic collections are held off while
+ * the running fiber is inside an arena. */
+extern JANET_THREAD_LOCAL int32_t janet_vm_gc_arena;
+
+/* Generational collection. The young generation is janet_vm_blocks, and
+ * objects that survive a collection are moved to janet_vm_old_blocks. */
+extern JANET_THREAD_LOCAL JanetGCObject **janet_vm_gc_remembered;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_remembered_count;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_remembered_capacity;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_old_count;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_promoted;
+
+/* Incremental marking. When janet_vm_gc_step is non-zero, full collections
+ * are done in steps of at most that much marking work. */
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_step;
+extern JANET_THREAD_LOCAL int janet_vm_gc_marking;
+extern JANET_THREAD_LOCAL JanetGCObject **janet_vm_gc_gray;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_gray_count;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_gray_capacity;
+extern JANET_THREAD_LOCAL JanetGCObject **janet_vm_gc_rescan;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_rescan_count;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_gc_rescan_capacity;
+
 /* GC roots */
 extern JANET_THREAD_LOCAL Janet *janet_vm_roots;
 extern JANET_THREAD_LOCAL uint32_t janet_vm_root_count;
 extern JANET_THREAD_LOCAL uint32_t janet_vm_root_capacity;
 
+/* GC roots added by handle. janet_vm_root_handle_values holds the rooted
+ * values densely, and janet_vm_root_handle_owners the handle of each. The
+ * slots map each handle to the index of its value, or link free handles. */
+extern JANET_THREAD_LOCAL Janet *janet_vm_root_handle_values;
+extern JANET_THREAD_LOCAL int32_t *janet_vm_root_handle_owners;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_root_handle_count;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_root_handle_capacity;
+extern JANET_THREAD_LOCAL int32_t *janet_vm_root_handle_slots;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_root_handle_slot_count;
+extern JANET_THREAD_LOCAL uint32_t janet_vm_root_handle_slot_capacity;
+extern JANET_THREAD_LOCAL int32_t janet_vm_root_handle_free;
+
 /* Scratch memory */
 extern JANET_THREAD_LOCAL void **janet_scratch_mem;
 extern JANET_THREAD_LOCAL size_t janet_scratch_cap;
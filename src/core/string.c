@@ -653,4 +653,5 @@ static const JanetReg string_cfuns[] = {
 /* Module entry point */
 void janet_lib_string(JanetTable *env) {
     janet_core_cfuns(env, NULL, string_cfuns);
+    janet_register_leaf(cfun_string_slice);
 }
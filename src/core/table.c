@@ -23,6 +23,7 @@
 #ifndef JANET_AMALG
 #include <janet.h>
 #include "gc.h"
+#include "state.h"
 #include "util.h"
 #include <math.h>
 #endif
@@ -73,6 +74,7 @@ JanetTable *janet_table_init(JanetTable *table, int32_t capacity) {
 
 /* Deinitialize a table */
 void janet_table_deinit(JanetTable *table) {
+    janet_icache_touch(table);
     janet_sfree(table->data);
 }
 
@@ -82,6 +84,17 @@ JanetTable *janet_table(int32_t capacity) {
     return janet_table_init_impl(table, capacity, 0);
 }
 
+/* Create a new table that holds its keys, values or both weakly, as given
+ * by JANET_TABLE_WEAK_KEYS and JANET_TABLE_WEAK_VALUES. Entries are removed
+ * by the garbage collector once a weakly held array, table, buffer, fiber,
+ * function or abstract value is otherwise unreachable. Other values are
+ * compared by value, so they are always held strongly. */
+JanetTable *janet_table_weak(int32_t capacity, int32_t flags) {
+    JanetTable *table = janet_table(capacity);
+    table->gc.flags |= flags & (JANET_TABLE_WEAK_KEYS | JANET_TABLE_WEAK_VALUES);
+    return table;
+}
+
 /* Find the bucket that contains the given key. Will also return
  * bucket where key should go if not in the table. */
 JanetKV *janet_table_find(JanetTable *t, Janet key) {
@@ -173,6 +186,7 @@ Janet janet_table_remove(JanetTable *t, Janet key) {
     JanetKV *bucket = janet_table_find(t, key);
     if (NULL != bucket && !janet_checktype(bucket->key, JANET_NIL)) {
         Janet ret = bucket->key;
+        janet_icache_touch(t);
         t->count--;
         t->deleted++;
         bucket->key = janet_wrap_nil();
@@ -191,12 +205,14 @@ void janet_table_put(JanetTable *t, Janet key, Janet value) {
         janet_table_remove(t, key);
     } else {
         JanetKV *bucket = janet_table_find(t, key);
+        janet_gc_barrier(t);
         if (NULL != bucket && !janet_checktype(bucket->key, JANET_NIL)) {
             bucket->value = value;
         } else {
             if (NULL == bucket || 2 * (t->count + t->deleted + 1) > t->capacity) {
                 janet_table_rehash(t, janet_tablen(2 * t->count + 2));
             }
+            janet_icache_touch(t);
             bucket = janet_table_find(t, key);
             if (janet_checktype(bucket->value, JANET_BOOLEAN))
                 --t->deleted;
@@ -211,6 +227,7 @@ void janet_table_put(JanetTable *t, Janet key, Janet value) {
 void janet_table_clear(JanetTable *t) {
     int32_t capacity = t->capacity;
     JanetKV *data = t->data;
+    janet_icache_touch(t);
     janet_memempty(data, capacity);
     t->count = 0;
     t->deleted = 0;
@@ -236,6 +253,7 @@ JanetTable *janet_table_clone(JanetTable *table) {
     newTable->capacity = table->capacity;
     newTable->deleted = table->deleted;
     newTable->proto = table->proto;
+    newTable->gc.flags |= table->gc.flags & (JANET_TABLE_WEAK_KEYS | JANET_TABLE_WEAK_VALUES);
     newTable->data = malloc(newTable->capacity * sizeof(JanetKV));
     if (NULL == newTable->data) {
         JANET_OUT_OF_MEMORY;
@@ -273,6 +291,24 @@ static Janet cfun_table_new(int32_t argc, Janet *argv) {
     return janet_wrap_table(janet_table(cap));
 }
 
+static Janet cfun_table_weak(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    int32_t cap = janet_getinteger(argv, 0);
+    return janet_wrap_table(janet_table_weak(cap, JANET_TABLE_WEAK_KEYS | JANET_TABLE_WEAK_VALUES));
+}
+
+static Janet cfun_table_weak_keys(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    int32_t cap = janet_getinteger(argv, 0);
+    return janet_wrap_table(janet_table_weak(cap, JANET_TABLE_WEAK_KEYS));
+}
+
+static Janet cfun_table_weak_values(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    int32_t cap = janet_getinteger(argv, 0);
+    return janet_wrap_table(janet_table_weak(cap, JANET_TABLE_WEAK_VALUES));
+}
+
 static Janet cfun_table_getproto(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
     JanetTable *t = janet_gettable(argv, 0);
@@ -288,6 +324,8 @@ static Janet cfun_table_setproto(int32_t argc, Janet *argv) {
     if (!janet_checktype(argv[1], JANET_NIL)) {
         proto = janet_gettable(argv, 1);
     }
+    janet_gc_barrier(table);
+    janet_icache_touch(table);
     table->proto = proto;
     return argv[0];
 }
@@ -319,6 +357,29 @@ static const JanetReg table_cfuns[] = {
         "entries going to go in a table on creation, extra memory allocation "
         "can be avoided. Returns the new table.")
     },
+    {
+        "table/weak", cfun_table_weak,
+        JDOC("(table/weak capacity)\n\n"
+        "Creates a new empty table that holds both its keys and values weakly. "
+        "An entry is removed by the garbage collector once its key or value is "
+        "an array, table, buffer, fiber, function or abstract value that is not "
+        "reachable in any other way. Other values, such as numbers, strings, "
+        "keywords, tuples and structs, are always held strongly. Returns the new table.")
+    },
+    {
+        "table/weak-keys", cfun_table_weak_keys,
+        JDOC("(table/weak-keys capacity)\n\n"
+        "Creates a new empty table that holds its keys weakly. An entry is removed by "
+        "the garbage collector once its key is not reachable in any other way. "
+        "See table/weak. Returns the new table.")
+    },
+    {
+        "table/weak-values", cfun_table_weak_values,
+        JDOC("(table/weak-values capacity)\n\n"
+        "Creates a new empty table that holds its values weakly. An entry is removed by "
+        "the garbage collector once its value is not reachable in any other way. "
+        "See table/weak. Returns the new table.")
+    },
     {
         "table/to-struct", cfun_table_tostruct,
         JDOC("(table/to-struct tab)\n\n"
@@ -176,4 +176,5 @@ static const JanetReg tuple_cfuns[] = {
 /* Load the tuple module */
 void janet_lib_tuple(JanetTable *env) {
     janet_core_cfuns(env, NULL, tuple_cfuns);
+    janet_register_leaf(cfun_tuple_slice);
 }
@@ -20,8 +20,6 @@
 * IN THE SOFTWARE.
 */
 
-#include <inttypes.h>
-
 #ifndef JANET_AMALG
 #include <janet.h>
 #include "util.h"
@@ -29,6 +27,19 @@
 #include "gc.h"
 #endif
 
+#include <inttypes.h>
+#include <time.h>
+
+#ifdef JANET_WINDOWS
+#include <windows.h>
+#endif
+
+/* For macos */
+#ifdef __MACH__
+#include <mach/clock.h>
+#include <mach/mach.h>
+#endif
+
 /* Base 64 lookup table for digits */
 const char janet_base64[65] =
     "0123456789"
@@ -57,7 +68,7 @@ const char *const janet_type_names[16] = {
     "pointer"
 };
 
-const char *const janet_signal_names[14] = {
+const char *const janet_signal_names[15] = {
     "ok",
     "error",
     "debug",
@@ -71,10 +82,11 @@ const char *const janet_signal_names[14] = {
     "user6",
     "user7",
     "user8",
-    "user9"
+    "user9",
+    "interrupt"
 };
 
-const char *const janet_status_names[16] = {
+const char *const janet_status_names[17] = {
     "dead",
     "error",
     "debug",
@@ -89,6 +101,7 @@ const char *const janet_status_names[16] = {
     "user7",
     "user8",
     "user9",
+    "interrupted",
     "new",
     "alive"
 };
@@ -240,6 +253,22 @@ void janet_register(const char *name, JanetCFunction cfun) {
     janet_table_put(janet_vm_registry, key, value);
 }
 
+/* Mark a C function as a leaf. Leaves never call back into the VM or
+ * signal, other than by raising errors, so the VM can call them without
+ * pushing a stack frame. */
+void janet_register_leaf(JanetCFunction cfun) {
+    janet_table_put(janet_vm_leaves, janet_wrap_cfunction(cfun), janet_wrap_true());
+    memset(janet_vm_leaf_cache, 0, sizeof(janet_vm_leaf_cache));
+}
+
+/* Mark all functions in a list of cfuns as leaves */
+void janet_core_leaves(const JanetReg *cfuns) {
+    while (cfuns->name) {
+        janet_register_leaf(cfuns->cfun);
+        cfuns++;
+    }
+}
+
 /* Add a def to an environment */
 void janet_def(JanetTable *env, const char *name, Janet val, const char *doc) {
     JanetTable *subt = janet_table(2);
@@ -347,6 +376,36 @@ void janet_core_cfuns(JanetTable *env, const char *regprefix, const JanetReg *cf
 }
 #endif
 
+/* Clock shims */
+#ifdef JANET_WINDOWS
+int janet_gettime(struct timespec *spec) {
+    FILETIME ftime;
+    GetSystemTimeAsFileTime(&ftime);
+    int64_t wintime = (int64_t)(ftime.dwLowDateTime) | ((int64_t)(ftime.dwHighDateTime) << 32);
+    /* Windows epoch is January 1, 1601 apparently */
+    wintime -= 116444736000000000LL;
+    spec->tv_sec  = wintime / 10000000LL;
+    /* Resolution is 100 nanoseconds. */
+    spec->tv_nsec = wintime % 10000000LL * 100;
+    return 0;
+}
+#elif defined(__MACH__)
+int janet_gettime(struct timespec *spec) {
+    clock_serv_t cclock;
+    mach_timespec_t mts;
+    host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
+    clock_get_time(cclock, &mts);
+    mach_port_deallocate(mach_task_self(), cclock);
+    spec->tv_sec = mts.tv_sec;
+    spec->tv_nsec = mts.tv_nsec;
+    return 0;
+}
+#else
+int janet_gettime(struct timespec *spec) {
+    return clock_gettime(CLOCK_MONOTONIC, spec);
+}
+#endif
+
 /* Resolve a symbol in the environment */
 JanetBindingType janet_resolve(JanetTable *env, const uint8_t *sym, Janet *out) {
     Janet ref;
@@ -84,6 +84,8 @@ void janet_buffer_format(
     int32_t argstart,
     int32_t argc,
     Janet *argv);
+struct timespec;
+int janet_gettime(struct timespec *spec);
 
 /* Inside the janet core, defining globals is different
  * at bootstrap time and normal runtime */
@@ -94,6 +96,7 @@ void janet_buffer_format(
 void janet_core_def(JanetTable *env, const char *name, Janet x, const void *p);
 void janet_core_cfuns(JanetTable *env, const char *regprefix, const JanetReg *cfuns);
 #endif
+void janet_core_leaves(const JanetReg *cfuns);
 
 /* Initialize builtin libraries */
 void janet_lib_io(JanetTable *env);
@@ -109,6 +112,7 @@ void janet_lib_marsh(JanetTable *env);
 void janet_lib_parse(JanetTable *env);
 #ifdef JANET_ASSEMBLER
 void janet_lib_asm(JanetTable *env);
+const char *janet_opcode_name(int opcode);
 #endif
 void janet_lib_compile(JanetTable *env);
 void janet_lib_debug(JanetTable *env);
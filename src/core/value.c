@@ -22,6 +22,7 @@
 
 #ifndef JANET_AMALG
 #include <janet.h>
+#include "gc.h"
 #endif
 
 /*
@@ -383,6 +384,7 @@ void janet_putindex(Janet ds, int32_t index, Janet value) {
                 janet_array_ensure(array, index + 1, 2);
                 array->count = index + 1;
             }
+            janet_gc_barrier(array);
             array->data[index] = value;
             break;
         }
@@ -425,6 +427,7 @@ void janet_put(Janet ds, Janet key, Janet value) {
             if (index >= array->count) {
                 janet_array_setcount(array, index + 1);
             }
+            janet_gc_barrier(array);
             array->data[index] = value;
             break;
         }
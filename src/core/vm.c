@@ -26,6 +26,7 @@
 #include "fiber.h"
 #include "gc.h"
 #include "symcache.h"
+#include "jit.h"
 #include "util.h"
 #endif
 
@@ -36,6 +37,64 @@ JANET_THREAD_LOCAL int janet_vm_stackn = 0;
 JANET_THREAD_LOCAL JanetFiber *janet_vm_fiber = NULL;
 JANET_THREAD_LOCAL Janet *janet_vm_return_reg = NULL;
 JANET_THREAD_LOCAL jmp_buf *janet_vm_jmp_buf = NULL;
+JANET_THREAD_LOCAL JanetTableCache janet_vm_icache[JANET_ICACHE_SIZE];
+JANET_THREAD_LOCAL uint32_t janet_vm_icache_epoch;
+JANET_THREAD_LOCAL JanetTable *janet_vm_leaves;
+JANET_THREAD_LOCAL JanetLeafCache janet_vm_leaf_cache[JANET_LEAF_CACHE_SIZE];
+JANET_THREAD_LOCAL JanetCFunction janet_vm_leaf = NULL;
+#ifdef JANET_PROFILE_OPCODES
+JANET_THREAD_LOCAL uint64_t janet_vm_opcode_counts[JOP_INSTRUCTION_COUNT];
+#endif
+
+/* Invalidate all inline cache entries that were resolved through a prototype.
+ * Epoch 0 marks entries for keys found in the table itself, so skip it. */
+void janet_icache_invalidate(void) {
+    if (++janet_vm_icache_epoch == 0) {
+        memset(janet_vm_icache, 0, sizeof(janet_vm_icache));
+        janet_vm_icache_epoch = 1;
+    }
+}
+
+/* Look up a keyword in a table and its prototypes, using the inline
+ * cache entry for the instruction at pc. */
+static Janet janet_table_get_cached(const uint32_t *pc, JanetTable *t, Janet key) {
+    JanetTableCache *cache = janet_vm_icache + (((uintptr_t) pc >> 2) & (JANET_ICACHE_SIZE - 1));
+    const uint8_t *kw = janet_unwrap_keyword(key);
+    JanetTable *holder;
+    int i;
+    if (cache->table == t && cache->key == kw &&
+            (cache->epoch == 0 || cache->epoch == janet_vm_icache_epoch)) {
+        holder = cache->holder;
+        if (holder->capacity == cache->capacity) {
+            JanetKV *kv = holder->data + cache->slot;
+            if (janet_checktype(kv->key, JANET_KEYWORD) && janet_unwrap_keyword(kv->key) == kw)
+                return kv->value;
+        }
+    }
+    /* Miss - resolve the key and refill the entry */
+    for (i = JANET_MAX_PROTO_DEPTH + 1, holder = t; holder && i; holder = holder->proto, --i) {
+        JanetKV *bucket = janet_table_find(holder, key);
+        if (NULL != bucket && !janet_checktype(bucket->key, JANET_NIL)) {
+            cache->table = t;
+            cache->holder = holder;
+            cache->key = kw;
+            cache->capacity = holder->capacity;
+            cache->slot = (int32_t)(bucket - holder->data);
+            if (holder == t) {
+                cache->epoch = 0;
+            } else {
+                /* Changes to any table on the way to holder must invalidate the entry */
+                JanetTable *link;
+                for (link = t; link != holder; link = link->proto)
+                    link->gc.flags |= JANET_TABLE_FLAG_CACHED;
+                holder->gc.flags |= JANET_TABLE_FLAG_CACHED;
+                cache->epoch = janet_vm_icache_epoch;
+            }
+            return bucket->value;
+        }
+    }
+    return janet_wrap_nil();
+}
 
 /* Virtual registers
  *
@@ -62,17 +121,25 @@ JANET_THREAD_LOCAL jmp_buf *janet_vm_jmp_buf = NULL;
 #define JANET_USE_COMPUTED_GOTOS
 #endif
 
+/* Count each instruction as it is dispatched. Labels that fall through
+ * to the next label must not be counted twice. */
+#ifdef JANET_PROFILE_OPCODES
+#define vm_count(op) janet_vm_opcode_counts[op] += ((*pc & 0x7F) == (op));
+#else
+#define vm_count(op)
+#endif
+
 #ifdef JANET_USE_COMPUTED_GOTOS
 #define VM_START() { goto *op_lookup[first_opcode];
 #define VM_END() }
-#define VM_OP(op) label_##op :
+#define VM_OP(op) label_##op : vm_count(op)
 #define VM_DEFAULT() label_unknown_op:
 #define vm_next() goto *op_lookup[*pc & 0xFF]
 #define opcode (*pc & 0xFF)
 #else
 #define VM_START() uint8_t opcode = first_opcode; for (;;) {switch(opcode) {
 #define VM_END() }}
-#define VM_OP(op) case op :
+#define VM_OP(op) case op : vm_count(op)
 #define VM_DEFAULT() default:
 #define vm_next() opcode = *pc & 0xFF; continue
 #endif
@@ -92,11 +159,61 @@ JANET_THREAD_LOCAL jmp_buf *janet_vm_jmp_buf = NULL;
 
 /* Next instruction variations */
 #define maybe_collect() do {\
-    if (janet_vm_next_collection >= janet_vm_gc_interval) janet_collect(); } while (0)
+    if (janet_vm_next_collection >= janet_vm_gc_interval) janet_gcstep(); } while (0)
 #define vm_checkgc_next() maybe_collect(); vm_next()
 #define vm_pcnext() pc++; vm_next()
 #define vm_checkgc_pcnext() maybe_collect(); vm_pcnext()
 
+/* Hand control to native code when available. Entering a function or
+ * looping warms it up for compilation; returning to it does not. */
+#ifdef JANET_JIT
+#define vm_jit_resume() do { \
+    if ((func->def->flags & JANET_FUNCDEF_FLAG_JIT) && \
+            !(fiber->flags & JANET_FIBER_FLAG_FUEL)) \
+        pc = janet_jit_run(func->def, stack, pc); \
+} while (0)
+#define vm_jit_enter() do { \
+    JanetFuncDef *jitdef_ = func->def; \
+    if (!(jitdef_->flags & (JANET_FUNCDEF_FLAG_JIT | JANET_FUNCDEF_FLAG_NOJIT)) && \
+            ++jitdef_->jit_heat >= JANET_JIT_THRESHOLD) \
+        janet_jit_compile(jitdef_); \
+    vm_jit_resume(); \
+} while (0)
+#else
+#define vm_jit_resume() do {} while (0)
+#define vm_jit_enter() do {} while (0)
+#endif
+
+/* Check if a C function is a leaf, caching the answer */
+static int janet_cfunction_isleaf(JanetCFunction cfun) {
+    JanetLeafCache *entry = janet_vm_leaf_cache +
+                            (((uintptr_t) cfun >> 4) & (JANET_LEAF_CACHE_SIZE - 1));
+    if (entry->cfun != cfun) {
+        entry->cfun = cfun;
+        entry->leaf = janet_truthy(janet_table_get(janet_vm_leaves, janet_wrap_cfunction(cfun)));
+    }
+    return entry->leaf;
+}
+
+/* Take a profiler sample if one is due */
+#define vm_maybe_sample() do { \
+    if (janet_vm_profile_pending) { \
+        vm_commit(); \
+        janet_profile_sample(fiber); \
+    } \
+} while (0)
+
+/* Spend one unit of fuel on a call or backward jump. A fiber that is out of
+ * fuel is interrupted before the instruction runs, and retries it when
+ * resumed. */
+#define vm_spend_fuel() do { \
+    if (fiber->flags & JANET_FIBER_FLAG_FUEL) { \
+        if (fiber->fuel <= 0) \
+            vm_return(JANET_SIGNAL_INTERRUPT, janet_wrap_nil()); \
+        fiber->fuel--; \
+    } \
+} while (0)
+
 /* Handle certain errors in main vm loop */
 #define vm_throw(e) do { vm_commit(); janet_panic(e); } while (0)
 #define vm_assert(cond, e) do {if (!(cond)) vm_throw((e)); } while (0)
@@ -113,11 +230,23 @@ JANET_THREAD_LOCAL jmp_buf *janet_vm_jmp_buf = NULL;
     } \
 } while (0)
 
+/* Take a conditional branch. Backward branches spend fuel like jumps. */
+#define vm_branch(cond, offset)\
+    {\
+        if (cond) {\
+            int32_t offset_ = (offset);\
+            if (offset_ <= 0) vm_spend_fuel();\
+            pc += offset_;\
+        } else {\
+            pc++;\
+        }\
+        vm_next();\
+    }
+
 /* Templates for certain patterns in opcodes */
 #define vm_binop_immediate(op)\
     {\
         Janet op1 = stack[B];\
-        vm_assert_type(op1, JANET_NUMBER);\
         if (!janet_checktype(op1, JANET_NUMBER)) {\
             vm_commit();\
             Janet _argv[2] = { op1, janet_wrap_number(CS) };\
@@ -159,6 +288,22 @@ JANET_THREAD_LOCAL jmp_buf *janet_vm_jmp_buf = NULL;
     }
 #define vm_binop(op) _vm_binop(op, janet_wrap_number)
 #define vm_numcomp(op) _vm_binop(op, janet_wrap_boolean)
+#define _vm_numcompjump(op, op2)\
+    {\
+        Janet op1 = stack[A];\
+        int cond;\
+        if (!janet_checktype(op1, JANET_NUMBER)) {\
+            vm_commit();\
+            Janet _argv[2] = { op1, op2 };\
+            cond = janet_truthy(janet_mcall(#op, 2, _argv));\
+        } else {\
+            vm_assert_type(op2, JANET_NUMBER);\
+            cond = janet_unwrap_number(op1) op janet_unwrap_number(op2);\
+        }\
+        vm_branch(cond, CS);\
+    }
+#define vm_numcompjump(op) _vm_numcompjump(op, stack[B])
+#define vm_numcompjump_immediate(op) _vm_numcompjump(op, janet_wrap_integer((int8_t) B))
 #define _vm_bitop(op, type1)\
     {\
         Janet op1 = stack[B];\
@@ -173,6 +318,59 @@ JANET_THREAD_LOCAL jmp_buf *janet_vm_jmp_buf = NULL;
 #define vm_bitop(op) _vm_bitop(op, int32_t)
 #define vm_bitopu(op) _vm_bitop(op, uint32_t)
 
+/* Index with a key the compiler knows to be an integer when finite, so
+ * an in range key needs no integer check. Anything else takes the
+ * generic path. */
+#define vm_getint(fallback)\
+    {\
+        Janet ds = stack[B];\
+        Janet key = stack[C];\
+        if (janet_checktype(key, JANET_NUMBER)) {\
+            double index = janet_unwrap_number(key);\
+            switch (janet_type(ds)) {\
+                default:\
+                    break;\
+                case JANET_ARRAY: {\
+                    JanetArray *array = janet_unwrap_array(ds);\
+                    if (index >= 0 && index < array->count) {\
+                        stack[A] = array->data[(int32_t) index];\
+                        vm_pcnext();\
+                    }\
+                    break;\
+                }\
+                case JANET_TUPLE: {\
+                    const Janet *tup = janet_unwrap_tuple(ds);\
+                    if (index >= 0 && index < janet_tuple_length(tup)) {\
+                        stack[A] = tup[(int32_t) index];\
+                        vm_pcnext();\
+                    }\
+                    break;\
+                }\
+                case JANET_BUFFER: {\
+                    JanetBuffer *buffer = janet_unwrap_buffer(ds);\
+                    if (index >= 0 && index < buffer->count) {\
+                        stack[A] = janet_wrap_integer(buffer->data[(int32_t) index]);\
+                        vm_pcnext();\
+                    }\
+                    break;\
+                }\
+                case JANET_STRING:\
+                case JANET_SYMBOL:\
+                case JANET_KEYWORD: {\
+                    const uint8_t *str = janet_unwrap_string(ds);\
+                    if (index >= 0 && index < janet_string_length(str)) {\
+                        stack[A] = janet_wrap_integer(str[(int32_t) index]);\
+                        vm_pcnext();\
+                    }\
+                    break;\
+                }\
+            }\
+        }\
+        vm_commit();\
+        stack[A] = fallback(ds, key);\
+        vm_pcnext();\
+    }
+
 /* Trace a function call */
 static void vm_do_trace(JanetFunction *func) {
     Janet *stack = janet_vm_fiber->data + janet_vm_fiber->stackstart;
@@ -293,21 +491,21 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
         &&label_JOP_NUMERIC_GREATER_THAN,
         &&label_JOP_NUMERIC_GREATER_THAN_EQUAL,
         &&label_JOP_NUMERIC_EQUAL,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
-        &&label_unknown_op,
+        &&label_JOP_JUMP_IF_LT,
+        &&label_JOP_JUMP_IF_LTE,
+        &&label_JOP_JUMP_IF_GT,
+        &&label_JOP_JUMP_IF_GTE,
+        &&label_JOP_JUMP_IF_EQUAL,
+        &&label_JOP_JUMP_IF_NOT_EQUAL,
+        &&label_JOP_JUMP_IF_LT_IMMEDIATE,
+        &&label_JOP_JUMP_IF_LTE_IMMEDIATE,
+        &&label_JOP_JUMP_IF_GT_IMMEDIATE,
+        &&label_JOP_JUMP_IF_GTE_IMMEDIATE,
+        &&label_JOP_JUMP_IF_EQUAL_IMMEDIATE,
+        &&label_JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE,
+        &&label_JOP_GET_INT,
+        &&label_JOP_IN_INT,
+        &&label_JOP_PUT_INT,
         &&label_unknown_op,
         &&label_unknown_op,
         &&label_unknown_op,
@@ -499,7 +697,7 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
         stack[A] = in;
         pc++;
         first_opcode = *pc & 0xFF;
-    } else if (status == JANET_STATUS_DEBUG) {
+    } else if (status == JANET_STATUS_DEBUG || status == JANET_STATUS_INTERRUPTED) {
         first_opcode = *pc & 0x7F;
     } else {
         first_opcode = *pc & 0xFF;
@@ -529,7 +727,9 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
         if (entrance_frame) vm_return(JANET_SIGNAL_OK, retval);
         vm_restore();
         stack[A] = retval;
-        vm_checkgc_pcnext();
+        pc++;
+        vm_jit_resume();
+        vm_checkgc_next();
     }
 
     VM_OP(JOP_RETURN_NIL) {
@@ -539,7 +739,9 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
         if (entrance_frame) vm_return(JANET_SIGNAL_OK, retval);
         vm_restore();
         stack[A] = retval;
-        vm_checkgc_pcnext();
+        pc++;
+        vm_jit_resume();
+        vm_checkgc_next();
     }
 
     VM_OP(JOP_ADD_IMMEDIATE)
@@ -572,6 +774,30 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
     VM_OP(JOP_NUMERIC_EQUAL)
     vm_numcomp( ==);
 
+    VM_OP(JOP_JUMP_IF_LT)
+    vm_numcompjump( <);
+
+    VM_OP(JOP_JUMP_IF_LTE)
+    vm_numcompjump( <=);
+
+    VM_OP(JOP_JUMP_IF_GT)
+    vm_numcompjump( >);
+
+    VM_OP(JOP_JUMP_IF_GTE)
+    vm_numcompjump( >=);
+
+    VM_OP(JOP_JUMP_IF_LT_IMMEDIATE)
+    vm_numcompjump_immediate( <);
+
+    VM_OP(JOP_JUMP_IF_LTE_IMMEDIATE)
+    vm_numcompjump_immediate( <=);
+
+    VM_OP(JOP_JUMP_IF_GT_IMMEDIATE)
+    vm_numcompjump_immediate( >);
+
+    VM_OP(JOP_JUMP_IF_GTE_IMMEDIATE)
+    vm_numcompjump_immediate( >=);
+
     VM_OP(JOP_DIVIDE_IMMEDIATE)
     vm_binop_immediate( /);
 
@@ -620,25 +846,38 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
     stack[E] = stack[A];
     vm_pcnext();
 
-    VM_OP(JOP_JUMP)
-    pc += DS;
-    vm_next();
+    VM_OP(JOP_JUMP) {
+        int32_t offset = DS;
+        if (offset <= 0) {
+            vm_spend_fuel();
+            pc += offset;
+            vm_maybe_sample();
+            vm_jit_enter();
+        } else {
+            pc += offset;
+        }
+        vm_next();
+    }
 
     VM_OP(JOP_JUMP_IF)
-    if (janet_truthy(stack[A])) {
-        pc += ES;
-    } else {
-        pc++;
-    }
-    vm_next();
+    vm_branch(janet_truthy(stack[A]), ES);
 
     VM_OP(JOP_JUMP_IF_NOT)
-    if (janet_truthy(stack[A])) {
-        pc++;
-    } else {
-        pc += ES;
-    }
-    vm_next();
+    vm_branch(!janet_truthy(stack[A]), ES);
+
+    VM_OP(JOP_JUMP_IF_EQUAL)
+    vm_branch(janet_equals(stack[A], stack[B]), CS);
+
+    VM_OP(JOP_JUMP_IF_NOT_EQUAL)
+    vm_branch(!janet_equals(stack[A], stack[B]), CS);
+
+    VM_OP(JOP_JUMP_IF_EQUAL_IMMEDIATE)
+    vm_branch(janet_checktype(stack[A], JANET_NUMBER) &&
+              janet_unwrap_number(stack[A]) == (int8_t) B, CS);
+
+    VM_OP(JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE)
+    vm_branch(!(janet_checktype(stack[A], JANET_NUMBER) &&
+                janet_unwrap_number(stack[A]) == (int8_t) B), CS);
 
     VM_OP(JOP_LESS_THAN)
     stack[A] = janet_wrap_boolean(janet_compare(stack[B], stack[C]) < 0);
@@ -798,6 +1037,7 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
             callee = resolve_method(callee, fiber);
         }
         if (janet_checktype(callee, JANET_FUNCTION)) {
+            vm_spend_fuel();
             func = janet_unwrap_function(callee);
             if (func->gc.flags & JANET_FUNCFLAG_TRACE) vm_do_trace(func);
             janet_stack_frame(stack)->pc = pc;
@@ -808,12 +1048,25 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
             }
             stack = fiber->data + fiber->frame;
             pc = func->def->bytecode;
+            vm_maybe_sample();
+            vm_jit_enter();
             vm_checkgc_next();
         } else if (janet_checktype(callee, JANET_CFUNCTION)) {
-            vm_commit();
+            JanetCFunction cfun = janet_unwrap_cfunction(callee);
             int32_t argc = fiber->stacktop - fiber->stackstart;
-            janet_fiber_cframe(fiber, janet_unwrap_cfunction(callee));
-            Janet ret = janet_unwrap_cfunction(callee)(argc, fiber->data + fiber->frame);
+            vm_commit();
+            if (janet_cfunction_isleaf(cfun)) {
+                /* Call on the argument stack without a frame */
+                janet_vm_leaf = cfun;
+                Janet ret = cfun(argc, fiber->data + fiber->stackstart);
+                janet_vm_leaf = NULL;
+                fiber->stacktop = fiber->stackstart;
+                stack = fiber->data + fiber->frame;
+                stack[A] = ret;
+                vm_checkgc_pcnext();
+            }
+            janet_fiber_cframe(fiber, cfun);
+            Janet ret = cfun(argc, fiber->data + fiber->frame);
             janet_fiber_popframe(fiber);
             stack = fiber->data + fiber->frame;
             stack[A] = ret;
@@ -835,6 +1088,7 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
             callee = resolve_method(callee, fiber);
         }
         if (janet_checktype(callee, JANET_FUNCTION)) {
+            vm_spend_fuel();
             func = janet_unwrap_function(callee);
             if (func->gc.flags & JANET_FUNCFLAG_TRACE) vm_do_trace(func);
             if (janet_fiber_funcframe_tail(fiber, func)) {
@@ -845,6 +1099,8 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
             }
             stack = fiber->data + fiber->frame;
             pc = func->def->bytecode;
+            vm_maybe_sample();
+            vm_jit_enter();
             vm_checkgc_next();
         } else {
             Janet retreg;
@@ -893,7 +1149,7 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
         vm_assert_type(fv, JANET_FIBER);
         JanetFiber *f = janet_unwrap_fiber(fv);
         JanetFiberStatus sub_status = janet_fiber_status(f);
-        if (sub_status > JANET_STATUS_USER9) {
+        if (sub_status > JANET_STATUS_INTERRUPTED) {
             vm_commit();
             janet_panicf("cannot propagate from fiber with status :%s",
                          janet_status_names[sub_status]);
@@ -913,11 +1169,19 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
     vm_checkgc_pcnext();
 
     VM_OP(JOP_IN)
+    if (janet_checktype(stack[B], JANET_TABLE) && janet_checktype(stack[C], JANET_KEYWORD)) {
+        stack[A] = janet_table_get_cached(pc, janet_unwrap_table(stack[B]), stack[C]);
+        vm_pcnext();
+    }
     vm_commit();
     stack[A] = janet_in(stack[B], stack[C]);
     vm_pcnext();
 
     VM_OP(JOP_GET)
+    if (janet_checktype(stack[B], JANET_TABLE) && janet_checktype(stack[C], JANET_KEYWORD)) {
+        stack[A] = janet_table_get_cached(pc, janet_unwrap_table(stack[B]), stack[C]);
+        vm_pcnext();
+    }
     vm_commit();
     stack[A] = janet_get(stack[B], stack[C]);
     vm_pcnext();
@@ -927,6 +1191,37 @@ static JanetSignal run_vm(JanetFiber *fiber, Janet in, JanetFiberStatus status)
     stack[A] = janet_getindex(stack[B], C);
     vm_pcnext();
 
+    VM_OP(JOP_GET_INT)
+    vm_getint(janet_get);
+
+    VM_OP(JOP_IN_INT)
+    vm_getint(janet_in);
+
+    VM_OP(JOP_PUT_INT) {
+        Janet ds = stack[A];
+        Janet key = stack[B];
+        if (janet_checktype(key, JANET_NUMBER)) {
+            double index = janet_unwrap_number(key);
+            if (janet_checktype(ds, JANET_ARRAY)) {
+                JanetArray *array = janet_unwrap_array(ds);
+                if (index >= 0 && index < array->count) {
+                    janet_gc_barrier(array);
+                    array->data[(int32_t) index] = stack[C];
+                    vm_pcnext();
+                }
+            } else if (janet_checktype(ds, JANET_BUFFER) && janet_checkint(stack[C])) {
+                JanetBuffer *buffer = janet_unwrap_buffer(ds);
+                if (index >= 0 && index < buffer->count) {
+                    buffer->data[(int32_t) index] = (uint8_t)(janet_unwrap_integer(stack[C]) & 0xFF);
+                    vm_pcnext();
+                }
+            }
+        }
+        vm_commit();
+        janet_put(ds, key, stack[C]);
+        vm_checkgc_pcnext();
+    }
+
     VM_OP(JOP_LENGTH)
     vm_commit();
     stack[A] = janet_lengthv(stack[E]);
@@ -1052,6 +1347,21 @@ JanetSignal janet_step(JanetFiber *fiber, Janet in, Janet *out) {
             nexta = pc + 1;
             nextb = pc + ES;
             break;
+        case JOP_JUMP_IF_LT:
+        case JOP_JUMP_IF_LTE:
+        case JOP_JUMP_IF_GT:
+        case JOP_JUMP_IF_GTE:
+        case JOP_JUMP_IF_EQUAL:
+        case JOP_JUMP_IF_NOT_EQUAL:
+        case JOP_JUMP_IF_LT_IMMEDIATE:
+        case JOP_JUMP_IF_LTE_IMMEDIATE:
+        case JOP_JUMP_IF_GT_IMMEDIATE:
+        case JOP_JUMP_IF_GTE_IMMEDIATE:
+        case JOP_JUMP_IF_EQUAL_IMMEDIATE:
+        case JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE:
+            nexta = pc + 1;
+            nextb = pc + CS;
+            break;
     }
     if (nexta) {
         olda = *nexta;
@@ -1062,12 +1372,23 @@ JanetSignal janet_step(JanetFiber *fiber, Janet in, Janet *out) {
         *nextb |= 0x80;
     }
 
+#ifdef JANET_JIT
+    /* Native code would run past the temporary breakpoints */
+    JanetFuncDef *def = janet_stack_frame(fiber->data + fiber->frame)->func->def;
+    int32_t nojit = def->flags & JANET_FUNCDEF_FLAG_NOJIT;
+    janet_jit_free(def);
+    def->flags |= JANET_FUNCDEF_FLAG_NOJIT;
+#endif
+
     /* Go */
     JanetSignal signal = janet_continue(fiber, in, out);
 
     /* Restore */
     if (nexta) *nexta = olda;
     if (nextb) *nextb = oldb;
+#ifdef JANET_JIT
+    def->flags = (def->flags & ~JANET_FUNCDEF_FLAG_NOJIT) | nojit;
+#endif
 
     return signal;
 }
@@ -1099,13 +1420,17 @@ Janet janet_call(JanetFunction *fun, int32_t argc, const Janet *argv) {
     janet_vm_stackn = oldn;
     janet_gcunlock(handle);
 
+    /* A fiber cannot be suspended inside of a C function */
+    if (signal == JANET_SIGNAL_INTERRUPT) janet_panic("fiber ran out of fuel in a C call");
     if (signal != JANET_SIGNAL_OK) janet_panicv(*janet_vm_return_reg);
 
     return *janet_vm_return_reg;
 }
 
+static JanetSignal janet_continue_from(JanetFiber *fiber, Janet in, Janet *out, JanetFiber *payer);
+
 /* Enter the main vm loop */
-JanetSignal janet_continue(JanetFiber *fiber, Janet in, Janet *out) {
+static JanetSignal janet_continue_fiber(JanetFiber *fiber, Janet in, Janet *out) {
     jmp_buf buf;
 
     /* Check conditions */
@@ -1128,7 +1453,7 @@ JanetSignal janet_continue(JanetFiber *fiber, Janet in, Janet *out) {
     if (fiber->child) {
         JanetFiber *child = fiber->child;
         janet_vm_stackn++;
-        JanetSignal sig = janet_continue(child, in, &in);
+        JanetSignal sig = janet_continue_from(child, in, &in, fiber);
         janet_vm_stackn--;
         if (sig != JANET_SIGNAL_OK && !(child->flags & (1 << sig))) {
             *out = in;
@@ -1146,7 +1471,7 @@ JanetSignal janet_continue(JanetFiber *fiber, Janet in, Janet *out) {
 
     /* Setup fiber */
     janet_vm_fiber = fiber;
-    janet_gcroot(janet_wrap_fiber(fiber));
+    int32_t roothandle = janet_gcroot_handle(janet_wrap_fiber(fiber));
     janet_fiber_set_status(fiber, JANET_STATUS_ALIVE);
     janet_vm_return_reg = out;
     janet_vm_jmp_buf = &buf;
@@ -1165,7 +1490,7 @@ JanetSignal janet_continue(JanetFiber *fiber, Janet in, Janet *out) {
 
     /* Tear down fiber */
     janet_fiber_set_status(fiber, signal);
-    janet_gcunroot(janet_wrap_fiber(fiber));
+    janet_gcunroot_handle(roothandle);
 
     /* Restore global state */
     janet_vm_gc_suspend = handle;
@@ -1177,6 +1502,31 @@ JanetSignal janet_continue(JanetFiber *fiber, Janet in, Janet *out) {
     return signal;
 }
 
+/* A fiber resumed from a fiber with a fuel budget runs on that budget, as
+ * well as its own if it has one, and what it uses is charged to both.
+ * Otherwise the fibers a budgeted fiber starts, such as the ones under try
+ * and generate, would run for free. */
+static JanetSignal janet_continue_from(JanetFiber *fiber, Janet in, Janet *out, JanetFiber *payer) {
+    if (NULL == payer || !(payer->flags & JANET_FIBER_FLAG_FUEL))
+        return janet_continue_fiber(fiber, in, out);
+    int32_t ownflags = fiber->flags & JANET_FIBER_FLAG_FUEL;
+    int32_t ownfuel = fiber->fuel;
+    int32_t startfuel = payer->fuel;
+    if (ownflags && ownfuel < startfuel) startfuel = ownfuel;
+    fiber->flags |= JANET_FIBER_FLAG_FUEL;
+    fiber->fuel = startfuel;
+    JanetSignal signal = janet_continue_fiber(fiber, in, out);
+    int32_t used = startfuel - fiber->fuel;
+    payer->fuel -= used;
+    fiber->fuel = ownflags ? ownfuel - used : 0;
+    fiber->flags = (fiber->flags & ~JANET_FIBER_FLAG_FUEL) | ownflags;
+    return signal;
+}
+
+JanetSignal janet_continue(JanetFiber *fiber, Janet in, Janet *out) {
+    return janet_continue_from(fiber, in, out, janet_vm_fiber);
+}
+
 JanetSignal janet_pcall(
     JanetFunction *fun,
     int32_t argc,
@@ -1194,7 +1544,9 @@ JanetSignal janet_pcall(
         *out = janet_cstringv("arity mismatch");
         return JANET_SIGNAL_ERROR;
     }
-    return janet_continue(fiber, janet_wrap_nil(), out);
+    JanetSignal signal = janet_continue(fiber, janet_wrap_nil(), out);
+    if (!f) janet_fiber_release(fiber);
+    return signal;
 }
 
 Janet janet_mcall(const char *name, int32_t argc, Janet *argv) {
@@ -1231,17 +1583,48 @@ Janet janet_mcall(const char *name, int32_t argc, Janet *argv) {
 int janet_init(void) {
     /* Garbage collection */
     janet_vm_blocks = NULL;
+    janet_vm_old_blocks = NULL;
+    janet_vm_gc_unswept = NULL;
     janet_vm_next_collection = 0;
+    janet_vm_gc_remembered = NULL;
+    janet_vm_gc_remembered_count = 0;
+    janet_vm_gc_remembered_capacity = 0;
+    janet_vm_gc_old_count = 0;
+    janet_vm_gc_promoted = 0;
+    janet_vm_gc_step = 0;
+    janet_vm_gc_marking = 0;
+    janet_vm_gc_gray = NULL;
+    janet_vm_gc_gray_count = 0;
+    janet_vm_gc_gray_capacity = 0;
+    janet_vm_gc_rescan = NULL;
+    janet_vm_gc_rescan_count = 0;
+    janet_vm_gc_rescan_capacity = 0;
     /* Setting memoryInterval to zero forces
      * a collection pretty much every cycle, which is
      * incredibly horrible for performance, but can help ensure
      * there are no memory bugs during development */
     janet_vm_gc_interval = 0x10000;
+    janet_vm_gc_policy = JANET_GC_POLICY_FIXED;
+    janet_vm_gc_growth = 0.5;
+    janet_vm_gc_min_interval = 0x10000;
+    janet_vm_gc_max_interval = 0x10000000;
+    janet_vm_gc_arena = 0;
     janet_symcache_init();
     /* Initialize gc roots */
     janet_vm_roots = NULL;
     janet_vm_root_count = 0;
     janet_vm_root_capacity = 0;
+    janet_vm_root_handle_values = NULL;
+    janet_vm_root_handle_owners = NULL;
+    janet_vm_root_handle_count = 0;
+    janet_vm_root_handle_capacity = 0;
+    janet_vm_root_handle_slots = NULL;
+    janet_vm_root_handle_slot_count = 0;
+    janet_vm_root_handle_slot_capacity = 0;
+    janet_vm_root_handle_free = -1;
+    /* Inline caches */
+    memset(janet_vm_icache, 0, sizeof(janet_vm_icache));
+    janet_vm_icache_epoch = 1;
     /* Scratch memory */
     janet_scratch_mem = NULL;
     janet_scratch_len = 0;
@@ -1249,10 +1632,16 @@ int janet_init(void) {
     /* Initialize registry */
     janet_vm_registry = janet_table(0);
     janet_gcroot(janet_wrap_table(janet_vm_registry));
+    janet_vm_leaves = janet_table(0);
+    janet_gcroot(janet_wrap_table(janet_vm_leaves));
+    memset(janet_vm_leaf_cache, 0, sizeof(janet_vm_leaf_cache));
+    janet_vm_leaf = NULL;
+    janet_vm_fiber_pool_count = 0;
     /* Core env */
     janet_vm_core_env = NULL;
     /* Seed RNG */
     janet_rng_seed(janet_default_rng(), 0);
+    janet_profile_init();
     /* Threads */
 #ifdef JANET_THREADS
     janet_threads_init();
@@ -1262,6 +1651,7 @@ int janet_init(void) {
 
 /* Clear all memory associated with the VM */
 void janet_deinit(void) {
+    janet_profile_deinit();
     janet_clear_memory();
     janet_symcache_deinit();
     free(janet_vm_roots);
@@ -1269,6 +1659,8 @@ void janet_deinit(void) {
     janet_vm_root_count = 0;
     janet_vm_root_capacity = 0;
     janet_vm_registry = NULL;
+    janet_vm_leaves = NULL;
+    janet_vm_fiber_pool_count = 0;
     janet_vm_core_env = NULL;
 #ifdef JANET_THREADS
     janet_threads_deinit();
@@ -134,6 +134,11 @@ extern "C" {
 #define JANET_THREAD_LOCAL
 #endif
 
+/* Freeing memory on a helper thread needs thread support */
+#ifndef JANET_THREADS
+#undef JANET_GC_THREAD
+#endif
+
 /* Enable or disable dynamic module loading. Enabled by default. */
 #ifndef JANET_NO_DYNAMIC_MODULES
 #define JANET_DYNAMIC_MODULES
@@ -208,6 +213,18 @@ extern "C" {
 #endif
 #endif
 
+/* The baseline JIT emits x86-64 code for the System V calling convention,
+ * and depends on the 64 bit nanboxed layout of values. */
+#if defined(JANET_JIT) && \
+    !(defined(JANET_NANBOX_64) && defined(__x86_64__) && !defined(_WIN32))
+#undef JANET_JIT
+#endif
+
+/* Counting executed instructions needs every instruction to be interpreted */
+#if defined(JANET_JIT) && defined(JANET_PROFILE_OPCODES)
+#undef JANET_JIT
+#endif
+
 /* Runtime config constants */
 #ifdef JANET_NO_NANBOX
 #define JANET_NANBOX_BIT 0
@@ -221,9 +238,23 @@ extern "C" {
 #define JANET_SINGLE_THREADED_BIT 0
 #endif
 
+#ifdef JANET_JIT
+#define JANET_JIT_BIT 0x4
+#else
+#define JANET_JIT_BIT 0
+#endif
+
+#ifdef JANET_PROFILE_OPCODES
+#define JANET_PROFILE_OPCODES_BIT 0x8
+#else
+#define JANET_PROFILE_OPCODES_BIT 0
+#endif
+
 #define JANET_CURRENT_CONFIG_BITS \
     (JANET_SINGLE_THREADED_BIT | \
-     JANET_NANBOX_BIT)
+     JANET_NANBOX_BIT | \
+     JANET_JIT_BIT | \
+     JANET_PROFILE_OPCODES_BIT)
 
 /* Represents the settings used to compile Janet, as well as the version */
 typedef struct {
@@ -258,8 +289,9 @@ typedef struct {
 
 /* Names of all of the types */
 JANET_API extern const char *const janet_type_names[16];
-JANET_API extern const char *const janet_signal_names[14];
-JANET_API extern const char *const janet_status_names[16];
+JANET_API extern const char *const janet_signal_names[15];
+JANET_API extern const char *const janet_status_names[17];
+JANET_API extern const char *const janet_gc_type_names[13];
 
 /* Fiber signals */
 typedef enum {
@@ -276,7 +308,8 @@ typedef enum {
     JANET_SIGNAL_USER6,
     JANET_SIGNAL_USER7,
     JANET_SIGNAL_USER8,
-    JANET_SIGNAL_USER9
+    JANET_SIGNAL_USER9,
+    JANET_SIGNAL_INTERRUPT
 } JanetSignal;
 
 /* Fiber statuses - mostly corresponds to signals. */
@@ -295,6 +328,7 @@ typedef enum {
     JANET_STATUS_USER7,
     JANET_STATUS_USER8,
     JANET_STATUS_USER9,
+    JANET_STATUS_INTERRUPTED,
     JANET_STATUS_NEW,
     JANET_STATUS_ALIVE
 } JanetFiberStatus;
@@ -712,6 +746,8 @@ struct JanetGCObject {
 #define JANET_FIBER_MASK_USERN(N) (16 << (N))
 #define JANET_FIBER_MASK_USER 0x3FF0
 
+#define JANET_FIBER_MASK_INTERRUPT 0x4000
+
 #define JANET_FIBER_STATUS_MASK 0xFF0000
 #define JANET_FIBER_STATUS_OFFSET 16
 
@@ -725,6 +761,8 @@ struct JanetFiber {
     int32_t stacktop; /* Top of stack. Where values are pushed and popped from. */
     int32_t capacity;
     int32_t maxstack; /* Arbitrary defined limit for stack overflow */
+    int32_t fuel; /* Calls and backward jumps left before an interrupt */
+    int32_t arenas; /* Depth of the garbage collection arenas open in this fiber */
     JanetTable *env; /* Dynamic bindings table (usually current environment). */
     Janet *data;
     JanetFiber *child; /* Keep linked list of fibers for restarting pending fibers */
@@ -818,12 +856,16 @@ struct JanetAbstractHead {
 /* Some function definition flags */
 #define JANET_FUNCDEF_FLAG_VARARG 0x10000
 #define JANET_FUNCDEF_FLAG_NEEDSENV 0x20000
+#define JANET_FUNCDEF_FLAG_LOCALENV 0x40000
 #define JANET_FUNCDEF_FLAG_HASNAME 0x80000
 #define JANET_FUNCDEF_FLAG_HASSOURCE 0x100000
 #define JANET_FUNCDEF_FLAG_HASDEFS 0x200000
 #define JANET_FUNCDEF_FLAG_HASENVS 0x400000
 #define JANET_FUNCDEF_FLAG_HASSOURCEMAP 0x800000
 #define JANET_FUNCDEF_FLAG_STRUCTARG 0x1000000
+#define JANET_FUNCDEF_FLAG_JIT 0x2000000
+#define JANET_FUNCDEF_FLAG_NOJIT 0x4000000
+#define JANET_FUNCDEF_FLAG_HASNOESCAPE 0x8000000
 #define JANET_FUNCDEF_FLAG_TAG 0xFFFF
 
 /* Source mapping structure for a bytecode instruction */
@@ -854,6 +896,18 @@ struct JanetFuncDef {
     int32_t bytecode_length;
     int32_t environments_length;
     int32_t defs_length;
+    int32_t noescape; /* Parameters (bits 0-29) and self references (bit 30) that are never kept */
+
+#ifdef JANET_JIT
+    /* Native code, and how often the function was entered before it was compiled */
+    void *jit;
+    int32_t jit_heat;
+#endif
+
+#ifdef JANET_PROFILE_OPCODES
+    /* Number of calls to functions with this definition */
+    uint64_t calls;
+#endif
 };
 
 /* A function environment */
@@ -973,6 +1027,30 @@ struct JanetThread {
 };
 #endif
 
+/* Garbage collector statistics. Live objects are those that survived
+ * collection so far, and are counted per memory type in the same order
+ * as janet_gc_type_names. */
+#define JANET_GC_TYPE_COUNT 13
+typedef struct {
+    uint64_t collections;
+    uint64_t minor_collections;
+    double pause_total;
+    double pause_max;
+    size_t bytes_since_collection;
+    size_t live_bytes;
+    size_t live_count;
+    size_t type_bytes[JANET_GC_TYPE_COUNT];
+    size_t type_counts[JANET_GC_TYPE_COUNT];
+    uint32_t root_count;
+    size_t page_count;
+} JanetGCStats;
+
+/* How the garbage collector decides when to run */
+typedef enum {
+    JANET_GC_POLICY_FIXED,
+    JANET_GC_POLICY_ADAPTIVE
+} JanetGCPolicy;
+
 
 /***** END SECTION TYPES *****/
 
@@ -1005,7 +1083,9 @@ enum JanetInstructionType {
     JINT_SSI, /* Slot(1), Slot(1), Immediate(1) */
     JINT_SSU, /* Slot(1), Slot(1), Unsigned Immediate(1) */
     JINT_SES, /* Slot(1), Environment(1), Far Slot(1) */
-    JINT_SC /* Slot(1), Constant(2) */
+    JINT_SC, /* Slot(1), Constant(2) */
+    JINT_SSL, /* Slot(1), Slot(1), Label(1) */
+    JINT_SIL /* Slot(1), Immediate(1), Label(1) */
 };
 
 /* All opcodes for the bytecode interpreter. */
@@ -1080,6 +1160,21 @@ enum JanetOpCode {
     JOP_NUMERIC_GREATER_THAN,
     JOP_NUMERIC_GREATER_THAN_EQUAL,
     JOP_NUMERIC_EQUAL,
+    JOP_JUMP_IF_LT,
+    JOP_JUMP_IF_LTE,
+    JOP_JUMP_IF_GT,
+    JOP_JUMP_IF_GTE,
+    JOP_JUMP_IF_EQUAL,
+    JOP_JUMP_IF_NOT_EQUAL,
+    JOP_JUMP_IF_LT_IMMEDIATE,
+    JOP_JUMP_IF_LTE_IMMEDIATE,
+    JOP_JUMP_IF_GT_IMMEDIATE,
+    JOP_JUMP_IF_GTE_IMMEDIATE,
+    JOP_JUMP_IF_EQUAL_IMMEDIATE,
+    JOP_JUMP_IF_NOT_EQUAL_IMMEDIATE,
+    JOP_GET_INT,
+    JOP_IN_INT,
+    JOP_PUT_INT,
     JOP_INSTRUCTION_COUNT
 };
 
@@ -1245,7 +1340,10 @@ JANET_API int janet_struct_compare(JanetStruct lhs, JanetStruct rhs);
 JANET_API const JanetKV *janet_struct_find(JanetStruct st, Janet key);
 
 /* Table functions */
+#define JANET_TABLE_WEAK_KEYS 0x20000
+#define JANET_TABLE_WEAK_VALUES 0x40000
 JANET_API JanetTable *janet_table(int32_t capacity);
+JANET_API JanetTable *janet_table_weak(int32_t capacity, int32_t flags);
 JANET_API JanetTable *janet_table_init(JanetTable *table, int32_t capacity);
 JANET_API void janet_table_deinit(JanetTable *table);
 JANET_API Janet janet_table_get(JanetTable *t, Janet key);
@@ -1263,6 +1361,8 @@ JANET_API JanetTable *janet_table_clone(JanetTable *table);
 JANET_API JanetFiber *janet_fiber(JanetFunction *callee, int32_t capacity, int32_t argc, const Janet *argv);
 JANET_API JanetFiber *janet_fiber_reset(JanetFiber *fiber, JanetFunction *callee, int32_t argc, const Janet *argv);
 JANET_API JanetFiberStatus janet_fiber_status(JanetFiber *fiber);
+JANET_API void janet_fiber_setfuel(JanetFiber *fiber, int32_t fuel);
+JANET_API int32_t janet_fiber_fuel(JanetFiber *fiber);
 JANET_API JanetFiber *janet_current_fiber(void);
 
 /* Treat similar types through uniform interfaces for iteration */
@@ -1304,12 +1404,20 @@ JANET_API void janet_env_lookup_into(JanetTable *renv, JanetTable *env, const ch
 JANET_API void janet_mark(Janet x);
 JANET_API void janet_sweep(void);
 JANET_API void janet_collect(void);
+JANET_API void janet_collect_minor(void);
 JANET_API void janet_clear_memory(void);
 JANET_API void janet_gcroot(Janet root);
 JANET_API int janet_gcunroot(Janet root);
 JANET_API int janet_gcunrootall(Janet root);
+JANET_API int32_t janet_gcroot_handle(Janet root);
+JANET_API int janet_gcunroot_handle(int32_t handle);
 JANET_API int janet_gclock(void);
 JANET_API void janet_gcunlock(int handle);
+JANET_API void janet_gcstats(JanetGCStats *stats);
+JANET_API int janet_arena_begin(void);
+JANET_API void janet_arena_end(int handle);
+JANET_API void janet_gcsetpolicy(JanetGCPolicy policy, double growth,
+                                 uint32_t min_interval, uint32_t max_interval);
 
 /* Functions */
 JANET_API JanetFuncDef *janet_funcdef_alloc(void);
@@ -1368,6 +1476,7 @@ JANET_API void janet_var(JanetTable *env, const char *name, Janet val, const cha
 JANET_API void janet_cfuns(JanetTable *env, const char *regprefix, const JanetReg *cfuns);
 JANET_API JanetBindingType janet_resolve(JanetTable *env, JanetSymbol sym, Janet *out);
 JANET_API void janet_register(const char *name, JanetCFunction cfun);
+JANET_API void janet_register_leaf(JanetCFunction cfun);
 
 /* Get values from the core environment. */
 JANET_API Janet janet_resolve_core(const char *name);
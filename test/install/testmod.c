@@ -30,8 +30,20 @@ static Janet cfun_get_five(int32_t argc, Janet *argv) {
     return janet_wrap_number(5.0);
 }
 
+static Janet cfun_root(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    return janet_wrap_integer(janet_gcroot_handle(argv[0]));
+}
+
+static Janet cfun_unroot(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    return janet_wrap_boolean(janet_gcunroot_handle(janet_getinteger(argv, 0)));
+}
+
 static const JanetReg array_cfuns[] = {
     {"get5", cfun_get_five, NULL},
+    {"root", cfun_root, NULL},
+    {"unroot", cfun_unroot, NULL},
     {NULL, NULL, NULL}
 };
 